@@ -1,17 +1,277 @@
 #include <iostream>
-#include <fstream>
 #include <string>
+#include <string_view>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <csignal>
 #include <cstring>
+#include <cerrno>
 #include <sys/stat.h>
 #include <cctype>
+#include <ctime>
+#include <charconv>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <vector>
+#include <memory>
+#include <unordered_map>
 
 constexpr int PROXY_PORT = 8888;
 constexpr int BUFFER_SIZE = 8192;
 constexpr auto CACHE_DIR = "cache";
+constexpr int DEFAULT_WORKERS = 4;
+constexpr size_t DEFAULT_MEMORY_CACHE_MB = 64;
+constexpr size_t MEMORY_OBJECT_FRACTION = 8;
+constexpr size_t FREQUENCY_SKETCH_WIDTH = 1 << 16;
+constexpr size_t FREQUENCY_SKETCH_DEPTH = 4;
+constexpr uint8_t FREQUENCY_MAX = 15;
+constexpr uint64_t FREQUENCY_SAMPLE_SIZE = 10 * FREQUENCY_SKETCH_WIDTH;
+constexpr size_t MAX_METADATA_SIZE = 128 * 1024;
+constexpr int64_t MAX_HEURISTIC_LIFETIME = 24 * 60 * 60;
+constexpr int STORABLE_STATUS_CODES[] = {200, 203, 204, 300, 301, 308, 410};
+constexpr int RESOLVER_THREADS = 4;
+constexpr int LISTEN_BACKLOG = 1024;
+constexpr int MAX_EPOLL_EVENTS = 256;
+constexpr size_t MAX_REQUEST_HEADER_SIZE = BUFFER_SIZE;
+constexpr size_t MAX_BUFFERED_BYTES = 64 * 1024;
+constexpr size_t MAX_RESPONSE_HEADER_SIZE = 64 * 1024;
+constexpr size_t MAX_CHUNK_LINE_SIZE = 4096;
+constexpr size_t MAX_IDLE_PER_ORIGIN = 16;
+constexpr size_t MAX_IDLE_UPSTREAMS = 512;
+constexpr size_t DNS_CACHE_MAX_ENTRIES = 4096;
+constexpr auto CONNECT_TIMEOUT = std::chrono::seconds(10);
+constexpr auto IDLE_TIMEOUT = std::chrono::seconds(60);
+constexpr auto DNS_CACHE_TTL = std::chrono::seconds(60);
+constexpr auto UPSTREAM_IDLE_TIMEOUT = std::chrono::seconds(30);
+constexpr auto SWEEP_INTERVAL = std::chrono::milliseconds(1000);
+
+struct ProxyOptions
+{
+    int workers = DEFAULT_WORKERS;
+    size_t memoryCacheMegabytes = DEFAULT_MEMORY_CACHE_MB;
+};
+
+enum class SessionState
+{
+    ReadingRequest,
+    Resolving,
+    Connecting,
+    Relaying,
+    ServingCache,
+    Following,
+    Finishing
+};
+
+enum class BodyFraming
+{
+    None,
+    ContentLength,
+    Chunked,
+    UntilClose
+};
+
+enum class ChunkStage
+{
+    Size,
+    Data,
+    DataEnd,
+    Trailer
+};
+
+struct CachingHeaders
+{
+    std::string cacheControl;
+    std::string expires;
+    std::string date;
+    std::string age;
+    std::string lastModified;
+    std::string etag;
+    std::string vary;
+};
+
+struct CacheMetadata
+{
+    int64_t expiresAt = 0;
+    int64_t responseTime = 0;
+    int64_t initialAge = 0;
+    uint64_t size = 0;
+    std::string head;
+    std::string date;
+    std::string etag;
+    std::string lastModified;
+    std::string cacheControl;
+    std::string expires;
+    std::vector<std::pair<std::string, std::string>> vary;
+};
+
+struct ResponseParser
+{
+    std::string head;
+    bool headersDone = false;
+    int statusCode = 0;
+    bool keepAlive = false;
+    CachingHeaders cachingHeaders;
+    std::string storedHead;
+    BodyFraming framing = BodyFraming::UntilClose;
+    uint64_t remaining = 0;
+    ChunkStage chunkStage = ChunkStage::Size;
+    std::string chunkLine;
+    bool complete = false;
+};
+
+enum class FetchState
+{
+    Running,
+    Complete,
+    Abandoned
+};
+
+struct InFlightFetch;
+
+struct ProxySession
+{
+    uint64_t id = 0;
+    int clientFd = -1;
+    int upstreamFd = -1;
+    SessionState state = SessionState::ReadingRequest;
+    std::string request;
+    std::string host;
+    std::string path;
+    int port = 80;
+    std::string origin;
+    std::string cacheFile;
+    std::string toUpstream;
+    size_t toUpstreamSent = 0;
+    bool upstreamReused = false;
+    ResponseParser response;
+    std::string toClient;
+    size_t toClientSent = 0;
+    int cacheFd = -1;
+    std::shared_ptr<const std::string> memoryObject;
+    CacheMetadata cacheMetadata;
+    bool revalidating = false;
+    std::shared_ptr<InFlightFetch> fetch;
+    bool fetchLeader = false;
+    bool clientGone = false;
+    off_t cacheOffset = 0;
+    size_t cacheRemaining = 0;
+    int cacheWriteFd = -1;
+    std::string cacheTempFile;
+    std::string memoryCopy;
+    bool keepMemoryCopy = false;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+struct ResolveResult
+{
+    int clientFd = -1;
+    uint64_t sessionId = 0;
+    std::string origin;
+    bool resolved = false;
+    sockaddr_in address{};
+};
+
+struct ResolvedOrigin
+{
+    sockaddr_in address{};
+    std::chrono::steady_clock::time_point expiresAt;
+};
+
+struct IdleUpstream
+{
+    int fd = -1;
+    std::chrono::steady_clock::time_point idleSince;
+};
+
+struct Worker
+{
+    int epollFd = -1;
+    int listenFd = -1;
+    int wakeFd = -1;
+    std::mutex mutex;
+    std::vector<ResolveResult> resolved;
+    std::unordered_map<int, std::unique_ptr<ProxySession>> sessions;
+    std::unordered_map<int, ProxySession*> upstreams;
+    std::unordered_map<std::string, ResolvedOrigin> dnsCache;
+    std::unordered_map<std::string, std::vector<IdleUpstream>> idleUpstreams;
+    size_t idleUpstreamCount = 0;
+    std::vector<std::shared_ptr<InFlightFetch>> progressedFetches;
+};
+
+struct FetchFollower
+{
+    Worker* worker = nullptr;
+    int clientFd = -1;
+    uint64_t sessionId = 0;
+};
+
+struct InFlightFetch
+{
+    std::mutex mutex;
+    FetchState state = FetchState::Running;
+    std::string tempFile;
+    CacheMetadata metadata;
+    std::atomic<uint64_t> written = 0;
+    std::vector<FetchFollower> followers;
+};
+
+struct FetchRegistry
+{
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<InFlightFetch>> fetches;
+};
+
+struct ResolveJob
+{
+    Worker* worker = nullptr;
+    int clientFd = -1;
+    uint64_t sessionId = 0;
+    std::string host;
+    int port = 80;
+};
+
+struct Resolver
+{
+    std::mutex mutex;
+    std::condition_variable jobsReady;
+    std::deque<ResolveJob> jobs;
+};
+
+struct MemoryCacheEntry
+{
+    std::shared_ptr<const std::string> data;
+    CacheMetadata metadata;
+    std::list<std::string>::iterator recencyPosition;
+};
+
+struct MemoryCache
+{
+    std::mutex mutex;
+    size_t capacity = 0;
+    size_t size = 0;
+    std::list<std::string> recency;
+    std::unordered_map<std::string, MemoryCacheEntry> entries;
+    std::vector<uint8_t> frequency = std::vector<uint8_t>(FREQUENCY_SKETCH_WIDTH * FREQUENCY_SKETCH_DEPTH);
+    uint64_t recordedAccesses = 0;
+};
+
+Resolver g_resolver;
+MemoryCache g_memoryCache;
+FetchRegistry g_fetches;
+std::atomic<uint64_t> g_nextSessionId = 1;
 
 void InitCacheDir()
 {
@@ -100,114 +360,1913 @@ bool ParseGatewayStyle(const std::string& line, std::string& host, std::string&
     return !host.empty();
 }
 
-void SendError(const int sock, const int code, const std::string& msg)
+void Log(const std::string& message)
+{
+    std::cout << message + "\n";
+}
+
+std::string OriginKey(const std::string& host, const int port)
+{
+    return host + ":" + std::to_string(port);
+}
+
+std::string LowerCase(std::string_view text)
+{
+    std::string lower(text);
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](const unsigned char c) { return std::tolower(c); });
+    return lower;
+}
+
+std::string_view TrimSpaces(std::string_view text)
 {
-    const std::string resp = "HTTP/1.0 " + std::to_string(code) + " " + msg + "\r\n\r\n";
-    send(sock, resp.c_str(), resp.size(), 0);
+    text.remove_prefix(std::min(text.find_first_not_of(" \t"), text.size()));
+    text.remove_suffix(text.size() - std::min(text.find_last_not_of(" \t") + 1, text.size()));
+    return text;
 }
 
-int ConnectTo(const std::string& host, const int port)
+template <typename Visitor>
+void ForEachRequestHeader(const std::string& request, Visitor visit)
 {
-    addrinfo hints{},* res;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) return -1;
-    const int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (sock < 0 || connect(sock, res->ai_addr, res->ai_addrlen) < 0)
+    const size_t headerEnd = request.find("\r\n\r\n");
+    for (size_t lineStart = request.find("\r\n") + 2; lineStart < headerEnd;)
     {
-        close(sock);
-        freeaddrinfo(res);
-        return -1;
+        const size_t lineEnd = request.find("\r\n", lineStart);
+        const std::string_view line = std::string_view(request).substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 2;
+        if (const size_t colon = line.find(':'); colon != std::string_view::npos)
+        {
+            visit(LowerCase(TrimSpaces(line.substr(0, colon))), TrimSpaces(line.substr(colon + 1)), line);
+        }
     }
-    freeaddrinfo(res);
-    return sock;
 }
 
-void Handle(int clientSock)
+std::string RequestHeader(const std::string& request, const std::string_view name)
+{
+    std::string value;
+    ForEachRequestHeader(request, [&](const std::string& field, const std::string_view fieldValue, std::string_view) {
+        if (field == name)
+        {
+            value = fieldValue;
+        }
+    });
+    return value;
+}
+
+bool FindDirective(const std::string_view cacheControl, const std::string_view name, std::string_view& value)
 {
-    char buf[BUFFER_SIZE];
-    ssize_t n = recv(clientSock, buf, sizeof(buf) - 1, 0);
-    if (n <= 0)
+    for (size_t start = 0; start < cacheControl.size();)
     {
-        close(clientSock);
-        return;
+        const size_t end = std::min(cacheControl.find(',', start), cacheControl.size());
+        const std::string_view directive = TrimSpaces(cacheControl.substr(start, end - start));
+        const size_t equals = directive.find('=');
+        if (TrimSpaces(directive.substr(0, equals)) == name)
+        {
+            value = equals == std::string_view::npos ? std::string_view() : TrimSpaces(directive.substr(equals + 1));
+            return true;
+        }
+        start = end + 1;
+    }
+    return false;
+}
+
+bool HasDirective(const std::string_view cacheControl, const std::string_view name)
+{
+    std::string_view value;
+    return FindDirective(cacheControl, name, value);
+}
+
+int64_t ParseSeconds(std::string_view text)
+{
+    if (text.size() >= 2 && text.front() == '"' && text.back() == '"')
+    {
+        text = text.substr(1, text.size() - 2);
     }
-    buf[n] = '\0';
-    std::string req(buf);
+    int64_t seconds = 0;
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), seconds);
+    return error == std::errc() && end == text.data() + text.size() && seconds > 0 ? seconds : 0;
+}
 
-    std::string host, path;
-    int port = 80;
-    if (bool ok = ParseProxyStyle(req, host, path, port) || ParseGatewayStyle(req, host, path, port); !ok)
+int64_t ParseHttpDate(const std::string& text)
+{
+    std::tm time{};
+    const char* end = strptime(text.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &time);
+    return end != nullptr && *end == '\0' ? static_cast<int64_t>(timegm(&time)) : -1;
+}
+
+int64_t UnixNow()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+int64_t FreshnessLifetime(const CacheMetadata& metadata, const int64_t date)
+{
+    std::string_view value;
+    if (HasDirective(metadata.cacheControl, "no-cache"))
     {
-        SendError(clientSock, 400, "Bad Request");
-        close(clientSock);
-        return;
+        return 0;
+    }
+    if (FindDirective(metadata.cacheControl, "s-maxage", value) || FindDirective(metadata.cacheControl, "max-age", value))
+    {
+        return ParseSeconds(value);
+    }
+    if (!metadata.expires.empty())
+    {
+        return std::max<int64_t>(ParseHttpDate(metadata.expires) - date, 0);
+    }
+    if (const int64_t lastModified = ParseHttpDate(metadata.lastModified); lastModified >= 0 && lastModified < date)
+    {
+        return std::min((date - lastModified) / 10, MAX_HEURISTIC_LIFETIME);
+    }
+    return 0;
+}
+
+void ComputeExpiry(CacheMetadata& metadata, const CachingHeaders& headers, const int64_t now)
+{
+    const int64_t date = ParseHttpDate(headers.date);
+    const int64_t responseDate = date >= 0 ? date : now;
+    const int64_t initialAge = std::max({int64_t{0}, now - responseDate, ParseSeconds(headers.age)});
+    metadata.expiresAt = now + FreshnessLifetime(metadata, responseDate) - initialAge;
+    metadata.responseTime = now;
+    metadata.initialAge = initialAge;
+}
+
+bool VaryMatches(const CacheMetadata& metadata, const std::string& request)
+{
+    return std::all_of(metadata.vary.begin(), metadata.vary.end(), [&request](const auto& field) {
+        return RequestHeader(request, field.first) == field.second;
+    });
+}
+
+bool ClientRequiresRevalidation(const std::string& request)
+{
+    const std::string cacheControl = LowerCase(RequestHeader(request, "cache-control"));
+    std::string_view maxAge;
+    return HasDirective(cacheControl, "no-cache")
+           || (FindDirective(cacheControl, "max-age", maxAge) && ParseSeconds(maxAge) == 0)
+           || LowerCase(RequestHeader(request, "pragma")).find("no-cache") != std::string::npos;
+}
+
+std::string MetadataPath(const std::string& cacheFile)
+{
+    return cacheFile + "#meta";
+}
+
+std::string CachedResponseHead(const CacheMetadata& metadata)
+{
+    std::string head = metadata.head;
+    const std::pair<const char*, const std::string*> fields[] = {
+        {"Cache-Control", &metadata.cacheControl},
+        {"Expires", &metadata.expires},
+        {"Date", &metadata.date},
+        {"ETag", &metadata.etag},
+        {"Last-Modified", &metadata.lastModified},
+    };
+    for (const auto& [name, value] : fields)
+    {
+        if (!value->empty())
+        {
+            head += std::string(name) + ": " + *value + "\r\n";
+        }
+    }
+    const int64_t age = metadata.initialAge + std::max<int64_t>(UnixNow() - metadata.responseTime, 0);
+    head += "Age: " + std::to_string(age) + "\r\n" "Connection: close\r\n\r\n";
+    return head;
+}
+
+void WriteCacheMetadata(const std::string& cacheFile, const CacheMetadata& metadata, const uint64_t sessionId)
+{
+    std::string text = "expires-at " + std::to_string(metadata.expiresAt) + "\n" "size "
+                       + std::to_string(metadata.size) + "\n" "response-time " + std::to_string(metadata.responseTime)
+                       + "\n" "initial-age " + std::to_string(metadata.initialAge) + "\n";
+    for (size_t lineStart = 0; lineStart < metadata.head.size();)
+    {
+        const size_t lineEnd = metadata.head.find("\r\n", lineStart);
+        text += "header " + metadata.head.substr(lineStart, lineEnd - lineStart) + "\n";
+        lineStart = lineEnd + 2;
+    }
+    const std::pair<const char*, const std::string*> fields[] = {
+        {"date", &metadata.date},
+        {"etag", &metadata.etag},
+        {"last-modified", &metadata.lastModified},
+        {"cache-control", &metadata.cacheControl},
+        {"expires", &metadata.expires},
+    };
+    for (const auto& [name, value] : fields)
+    {
+        if (!value->empty())
+        {
+            text += std::string(name) + " " + *value + "\n";
+        }
+    }
+    for (const auto& [name, value] : metadata.vary)
+    {
+        text += "vary " + name + ":" + value + "\n";
     }
 
-    std::cout << "[REQ] " << host << ":" << port << path << std::endl;
+    const std::string path = MetadataPath(cacheFile);
+    const std::string tempPath = path + "#" + std::to_string(sessionId);
+    const int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    const bool written = fd >= 0 && write(fd, text.data(), text.size()) == static_cast<ssize_t>(text.size());
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (!written || rename(tempPath.c_str(), path.c_str()) < 0)
+    {
+        std::cerr << "Cannot save " << path << ": " << strerror(errno) << "\n";
+        unlink(tempPath.c_str());
+    }
+}
 
-    std::string cacheFile = MakeCacheKey(host, path);
-    if (std::ifstream cache(cacheFile, std::ios::binary); cache.is_open())
+bool ReadCacheMetadata(const std::string& cacheFile, CacheMetadata& metadata)
+{
+    const int fd = open(MetadataPath(cacheFile).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
     {
-        std::cout << "[HIT] " << cacheFile << std::endl;
-        std::string content((std::istreambuf_iterator<char>(cache)), {});
-        send(clientSock, content.data(), content.size(), 0);
-        cache.close();
-        close(clientSock);
-        return;
+        return false;
+    }
+    std::string text(MAX_METADATA_SIZE, '\0');
+    const ssize_t bytesRead = read(fd, text.data(), text.size());
+    close(fd);
+    if (bytesRead <= 0)
+    {
+        return false;
+    }
+    text.resize(static_cast<size_t>(bytesRead));
+
+    bool hasExpiry = false;
+    bool hasSize = false;
+    for (size_t lineStart = 0; lineStart < text.size();)
+    {
+        const size_t lineEnd = std::min(text.find('\n', lineStart), text.size());
+        const std::string_view line = std::string_view(text).substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 1;
+        const size_t space = line.find(' ');
+        const std::string_view key = line.substr(0, space);
+        const std::string value(space == std::string_view::npos ? std::string_view() : line.substr(space + 1));
+        if (key == "expires-at")
+        {
+            hasExpiry = std::from_chars(value.data(), value.data() + value.size(), metadata.expiresAt).ec
+                        == std::errc();
+        }
+        else if (key == "size")
+        {
+            hasSize = std::from_chars(value.data(), value.data() + value.size(), metadata.size).ec == std::errc();
+        }
+        else if (key == "response-time")
+        {
+            std::from_chars(value.data(), value.data() + value.size(), metadata.responseTime);
+        }
+        else if (key == "initial-age")
+        {
+            std::from_chars(value.data(), value.data() + value.size(), metadata.initialAge);
+        }
+        else if (key == "header")
+        {
+            metadata.head += value + "\r\n";
+        }
+        else if (key == "date")
+        {
+            metadata.date = value;
+        }
+        else if (key == "etag")
+        {
+            metadata.etag = value;
+        }
+        else if (key == "last-modified")
+        {
+            metadata.lastModified = value;
+        }
+        else if (key == "cache-control")
+        {
+            metadata.cacheControl = value;
+        }
+        else if (key == "expires")
+        {
+            metadata.expires = value;
+        }
+        else if (const size_t colon = value.find(':'); key == "vary" && colon != std::string::npos)
+        {
+            metadata.vary.emplace_back(value.substr(0, colon), value.substr(colon + 1));
+        }
+    }
+    return hasExpiry && hasSize && !metadata.head.empty();
+}
+
+size_t SketchIndex(const size_t hash, const size_t row)
+{
+    uint64_t mixed = (hash + row * 0x9e3779b97f4a7c15ull) * 0xbf58476d1ce4e5b9ull;
+    mixed ^= mixed >> 31;
+    return row * FREQUENCY_SKETCH_WIDTH + (mixed & (FREQUENCY_SKETCH_WIDTH - 1));
+}
+
+uint8_t EstimateFrequency(const MemoryCache& cache, const size_t hash)
+{
+    uint8_t estimate = FREQUENCY_MAX;
+    for (size_t row = 0; row < FREQUENCY_SKETCH_DEPTH; ++row)
+    {
+        estimate = std::min(estimate, cache.frequency[SketchIndex(hash, row)]);
+    }
+    return estimate;
+}
+
+void RecordAccess(MemoryCache& cache, const size_t hash)
+{
+    for (size_t row = 0; row < FREQUENCY_SKETCH_DEPTH; ++row)
+    {
+        uint8_t& counter = cache.frequency[SketchIndex(hash, row)];
+        counter = std::min<uint8_t>(counter + 1, FREQUENCY_MAX);
+    }
+    if (++cache.recordedAccesses >= FREQUENCY_SAMPLE_SIZE)
+    {
+        for (uint8_t& counter : cache.frequency)
+        {
+            counter /= 2;
+        }
+        cache.recordedAccesses /= 2;
+    }
+}
+
+bool CanAdmit(const MemoryCache& cache, const std::string& key, const size_t objectSize)
+{
+    if (objectSize > cache.capacity / MEMORY_OBJECT_FRACTION)
+    {
+        return false;
+    }
+    const uint8_t candidateFrequency = EstimateFrequency(cache, std::hash<std::string>{}(key));
+    size_t reclaimed = 0;
+    for (auto victim = cache.recency.rbegin(); cache.size - reclaimed + objectSize > cache.capacity; ++victim)
+    {
+        if (victim == cache.recency.rend()
+            || EstimateFrequency(cache, std::hash<std::string>{}(*victim)) >= candidateFrequency)
+        {
+            return false;
+        }
+        reclaimed += cache.entries.at(*victim).data->size();
+    }
+    return true;
+}
+
+void EraseMemoryObject(MemoryCache& cache, const std::string& key)
+{
+    if (const auto it = cache.entries.find(key); it != cache.entries.end())
+    {
+        cache.size -= it->second.data->size();
+        cache.recency.erase(it->second.recencyPosition);
+        cache.entries.erase(it);
+    }
+}
+
+std::shared_ptr<const std::string> LookupMemoryCache(const std::string& key, CacheMetadata& metadata)
+{
+    MemoryCache& cache = g_memoryCache;
+    if (cache.capacity == 0)
+    {
+        return nullptr;
+    }
+    std::lock_guard lock(cache.mutex);
+    RecordAccess(cache, std::hash<std::string>{}(key));
+    const auto it = cache.entries.find(key);
+    if (it == cache.entries.end())
+    {
+        return nullptr;
+    }
+    cache.recency.splice(cache.recency.begin(), cache.recency, it->second.recencyPosition);
+    metadata = it->second.metadata;
+    return it->second.data;
+}
+
+bool WouldAdmitToMemoryCache(const std::string& key, const size_t objectSize)
+{
+    MemoryCache& cache = g_memoryCache;
+    if (cache.capacity == 0)
+    {
+        return false;
+    }
+    std::lock_guard lock(cache.mutex);
+    return CanAdmit(cache, key, objectSize);
+}
+
+bool StoreInMemoryCache(const std::string& key, std::shared_ptr<const std::string> data,
+                        const CacheMetadata& metadata)
+{
+    MemoryCache& cache = g_memoryCache;
+    if (cache.capacity == 0)
+    {
+        return false;
+    }
+    std::lock_guard lock(cache.mutex);
+    EraseMemoryObject(cache, key);
+    if (!data || !CanAdmit(cache, key, data->size()))
+    {
+        return false;
+    }
+    while (cache.size + data->size() > cache.capacity)
+    {
+        EraseMemoryObject(cache, std::string(cache.recency.back()));
     }
+    cache.size += data->size();
+    cache.recency.push_front(key);
+    cache.entries[key] = MemoryCacheEntry{std::move(data), metadata, cache.recency.begin()};
+    return true;
+}
 
-    std::cout << "[MISS] Fetching..." << std::endl;
-    int targetSock = ConnectTo(host, port);
-    if (targetSock < 0)
+void RefreshMemoryCache(const std::string& key, const CacheMetadata& metadata)
+{
+    MemoryCache& cache = g_memoryCache;
+    if (cache.capacity == 0)
     {
-        SendError(clientSock, 502, "Bad Gateway");
-        close(clientSock);
         return;
     }
+    std::lock_guard lock(cache.mutex);
+    if (const auto it = cache.entries.find(key); it != cache.entries.end())
+    {
+        it->second.metadata = metadata;
+    }
+}
 
-    std::string forward = "GET " + path + " HTTP/1.0\r\n" "Host: " + host + "\r\n" "Connection: close\r\n\r\n";
-    send(targetSock, forward.c_str(), forward.size(), 0);
+void CloseUpstream(Worker& worker, ProxySession& session)
+{
+    if (session.upstreamFd < 0)
+    {
+        return;
+    }
+    epoll_ctl(worker.epollFd, EPOLL_CTL_DEL, session.upstreamFd, nullptr);
+    close(session.upstreamFd);
+    worker.upstreams.erase(session.upstreamFd);
+    session.upstreamFd = -1;
+}
 
-    std::ofstream out(cacheFile, std::ios::binary);
-    while ((n = recv(targetSock, buf, sizeof(buf), 0)) > 0)
+void ReleaseUpstream(Worker& worker, ProxySession& session)
+{
+    std::vector<IdleUpstream>& idle = worker.idleUpstreams[session.origin];
+    if (!session.response.keepAlive || idle.size() >= MAX_IDLE_PER_ORIGIN
+        || worker.idleUpstreamCount >= MAX_IDLE_UPSTREAMS)
     {
-        send(clientSock, buf, n, 0);
-        out.write(buf, n);
+        CloseUpstream(worker, session);
+        return;
     }
-    out.close();
-    close(targetSock);
-    close(clientSock);
-    std::cout << "[SAVED] " << cacheFile << std::endl;
+    epoll_ctl(worker.epollFd, EPOLL_CTL_DEL, session.upstreamFd, nullptr);
+    worker.upstreams.erase(session.upstreamFd);
+    idle.push_back(IdleUpstream{session.upstreamFd, std::chrono::steady_clock::now()});
+    ++worker.idleUpstreamCount;
+    session.upstreamFd = -1;
 }
 
-int main()
+bool IsUpstreamHealthy(const int fd)
 {
-    InitCacheDir();
-    const int sock = socket(AF_INET, SOCK_STREAM, 0);
-    const int opt = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    char byte;
+    return recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
 
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(PROXY_PORT);
+int CheckoutUpstream(Worker& worker, const std::string& origin)
+{
+    const auto it = worker.idleUpstreams.find(origin);
+    while (it != worker.idleUpstreams.end() && !it->second.empty())
+    {
+        const int fd = it->second.back().fd;
+        it->second.pop_back();
+        --worker.idleUpstreamCount;
+        if (IsUpstreamHealthy(fd))
+        {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
 
-    bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
-    listen(sock, 10);
+void ExpireIdleUpstreams(Worker& worker)
+{
+    const auto now = std::chrono::steady_clock::now();
+    for (auto it = worker.idleUpstreams.begin(); it != worker.idleUpstreams.end();)
+    {
+        std::vector<IdleUpstream>& idle = it->second;
+        const auto expired = std::remove_if(idle.begin(), idle.end(), [now](const IdleUpstream& upstream) {
+            if (upstream.idleSince + UPSTREAM_IDLE_TIMEOUT > now && IsUpstreamHealthy(upstream.fd))
+            {
+                return false;
+            }
+            close(upstream.fd);
+            return true;
+        });
+        worker.idleUpstreamCount -= static_cast<size_t>(idle.end() - expired);
+        idle.erase(expired, idle.end());
+        it = idle.empty() ? worker.idleUpstreams.erase(it) : std::next(it);
+    }
+}
 
-    std::cout << "Proxy запущен на порту " << PROXY_PORT << std::endl;
-    std::cout << "Кэш: ./" << CACHE_DIR << "/" << std::endl;
-    std::cout << "\n--- СПОСОБЫ ТЕСТИРОВАНИЯ ---" << std::endl;
-    std::cout << "Откройте в браузере: http://localhost:8888/example.com" << std::endl;
+void WakeWorker(Worker& worker)
+{
+    const uint64_t wakeup = 1;
+    if (write(worker.wakeFd, &wakeup, sizeof(wakeup)) < 0)
+    {
+        std::cerr << "eventfd write failed: " << strerror(errno) << "\n";
+    }
+}
 
-    while (true)
+void NotifyFetchFollowers(const std::shared_ptr<InFlightFetch>& fetch)
+{
+    std::vector<Worker*> workers;
+    {
+        std::lock_guard lock(fetch->mutex);
+        for (const FetchFollower& follower : fetch->followers)
+        {
+            if (std::find(workers.begin(), workers.end(), follower.worker) == workers.end())
+            {
+                workers.push_back(follower.worker);
+            }
+        }
+    }
+    for (Worker* worker : workers)
     {
-        sockaddr_in clientAddr;
-        socklen_t len = sizeof(clientAddr);
-        if (const int client = accept(sock, reinterpret_cast<struct sockaddr*>(&clientAddr), &len); client >= 0)
         {
-            Handle(client);
+            std::lock_guard lock(worker->mutex);
+            std::vector<std::shared_ptr<InFlightFetch>>& progressed = worker->progressedFetches;
+            if (std::find(progressed.begin(), progressed.end(), fetch) != progressed.end())
+            {
+                continue;
+            }
+            progressed.push_back(fetch);
         }
+        WakeWorker(*worker);
+    }
+}
+
+bool JoinFetch(Worker& worker, ProxySession& session)
+{
+    std::lock_guard lock(g_fetches.mutex);
+    std::shared_ptr<InFlightFetch>& fetch = g_fetches.fetches[session.cacheFile];
+    session.fetchLeader = !fetch;
+    if (session.fetchLeader)
+    {
+        fetch = std::make_shared<InFlightFetch>();
+    }
+    else
+    {
+        std::lock_guard fetchLock(fetch->mutex);
+        fetch->followers.push_back(FetchFollower{&worker, session.clientFd, session.id});
+    }
+    session.fetch = fetch;
+    return !session.fetchLeader;
+}
+
+void PublishFetch(ProxySession& session)
+{
+    if (!session.fetchLeader)
+    {
+        return;
+    }
+    {
+        std::lock_guard lock(session.fetch->mutex);
+        session.fetch->tempFile = session.cacheTempFile;
+        session.fetch->metadata = session.cacheMetadata;
+    }
+    NotifyFetchFollowers(session.fetch);
+}
+
+bool KeepFetchForFollowers(ProxySession& session)
+{
+    if (!session.fetchLeader)
+    {
+        return false;
+    }
+    std::lock_guard lock(session.fetch->mutex);
+    session.clientGone = !session.fetch->followers.empty();
+    return session.clientGone;
+}
+
+void AdvanceFetch(ProxySession& session, const size_t size)
+{
+    if (session.fetchLeader && size > 0)
+    {
+        session.fetch->written.fetch_add(size, std::memory_order_release);
+        NotifyFetchFollowers(session.fetch);
+    }
+}
+
+void EndFetch(ProxySession& session, const FetchState outcome)
+{
+    if (!session.fetch)
+    {
+        return;
+    }
+    const std::shared_ptr<InFlightFetch> fetch = std::move(session.fetch);
+    session.fetch.reset();
+    if (!session.fetchLeader)
+    {
+        std::lock_guard lock(fetch->mutex);
+        std::erase_if(fetch->followers, [&session](const FetchFollower& follower) {
+            return follower.sessionId == session.id;
+        });
+        return;
+    }
+
+    session.fetchLeader = false;
+    {
+        std::lock_guard lock(g_fetches.mutex);
+        if (const auto it = g_fetches.fetches.find(session.cacheFile);
+            it != g_fetches.fetches.end() && it->second == fetch)
+        {
+            g_fetches.fetches.erase(it);
+        }
+    }
+    {
+        std::lock_guard lock(fetch->mutex);
+        fetch->state = outcome;
+    }
+    NotifyFetchFollowers(fetch);
+}
+
+void AbandonCacheWrite(ProxySession& session)
+{
+    EndFetch(session, FetchState::Abandoned);
+    if (session.cacheWriteFd < 0)
+    {
+        return;
+    }
+    close(session.cacheWriteFd);
+    unlink(session.cacheTempFile.c_str());
+    session.cacheWriteFd = -1;
+}
+
+void CloseSession(Worker& worker, const int clientFd)
+{
+    const auto it = worker.sessions.find(clientFd);
+    if (it == worker.sessions.end())
+    {
+        return;
+    }
+    ProxySession& session = *it->second;
+    CloseUpstream(worker, session);
+    AbandonCacheWrite(session);
+    if (session.cacheFd >= 0)
+    {
+        close(session.cacheFd);
+    }
+    epoll_ctl(worker.epollFd, EPOLL_CTL_DEL, clientFd, nullptr);
+    close(clientFd);
+    worker.sessions.erase(it);
+}
+
+void FailSession(Worker& worker, ProxySession& session, const int code, const std::string& msg)
+{
+    CloseUpstream(worker, session);
+    AbandonCacheWrite(session);
+    session.toClient = "HTTP/1.0 " + std::to_string(code) + " " + msg + "\r\n\r\n";
+    session.toClientSent = 0;
+    session.state = SessionState::Finishing;
+}
+
+bool FlushToClient(ProxySession& session)
+{
+    while (!session.clientGone && session.toClientSent < session.toClient.size())
+    {
+        const ssize_t bytesSent = send(session.clientFd, session.toClient.data() + session.toClientSent,
+                                       session.toClient.size() - session.toClientSent, MSG_NOSIGNAL);
+        if (bytesSent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return true;
+            }
+            if (!KeepFetchForFollowers(session))
+            {
+                return false;
+            }
+            break;
+        }
+        session.toClientSent += static_cast<size_t>(bytesSent);
+    }
+    session.toClient.clear();
+    session.toClientSent = 0;
+    return true;
+}
+
+bool FlushToUpstream(ProxySession& session)
+{
+    while (session.toUpstreamSent < session.toUpstream.size())
+    {
+        const ssize_t bytesSent = send(session.upstreamFd, session.toUpstream.data() + session.toUpstreamSent,
+                                       session.toUpstream.size() - session.toUpstreamSent, MSG_NOSIGNAL);
+        if (bytesSent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        session.toUpstreamSent += static_cast<size_t>(bytesSent);
+    }
+    return true;
+}
+
+bool AttachUpstream(Worker& worker, ProxySession& session, const int upstreamFd)
+{
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = upstreamFd;
+    if (epoll_ctl(worker.epollFd, EPOLL_CTL_ADD, upstreamFd, &event) < 0)
+    {
+        close(upstreamFd);
+        FailSession(worker, session, 502, "Bad Gateway");
+        return false;
+    }
+    session.upstreamFd = upstreamFd;
+    worker.upstreams[upstreamFd] = &session;
+    return true;
+}
+
+void StartUpstreamConnect(Worker& worker, ProxySession& session, const sockaddr_in& address)
+{
+    const int upstreamFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (upstreamFd < 0
+        || (connect(upstreamFd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0
+            && errno != EINPROGRESS))
+    {
+        if (upstreamFd >= 0)
+        {
+            close(upstreamFd);
+        }
+        FailSession(worker, session, 502, "Bad Gateway");
+        return;
+    }
+    if (AttachUpstream(worker, session, upstreamFd))
+    {
+        session.state = SessionState::Connecting;
+    }
+}
+
+void ResolveOrigin(Worker& worker, ProxySession& session)
+{
+    session.state = SessionState::Resolving;
+    session.deadline = std::chrono::steady_clock::now() + CONNECT_TIMEOUT;
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(session.port);
+    if (inet_pton(AF_INET, session.host.c_str(), &address.sin_addr) == 1)
+    {
+        StartUpstreamConnect(worker, session, address);
+        return;
+    }
+    if (const auto it = worker.dnsCache.find(session.origin);
+        it != worker.dnsCache.end() && it->second.expiresAt > std::chrono::steady_clock::now())
+    {
+        StartUpstreamConnect(worker, session, it->second.address);
+        return;
+    }
+
+    {
+        std::lock_guard lock(g_resolver.mutex);
+        g_resolver.jobs.push_back(ResolveJob{&worker, session.clientFd, session.id, session.host, session.port});
+    }
+    g_resolver.jobsReady.notify_one();
+}
+
+void DropCachedObject(ProxySession& session)
+{
+    if (session.cacheFd >= 0)
+    {
+        close(session.cacheFd);
+        session.cacheFd = -1;
+    }
+    session.memoryObject.reset();
+    session.cacheRemaining = 0;
+}
+
+bool OpenCachedObject(ProxySession& session, CacheMetadata& metadata)
+{
+    session.cacheFd = open(session.cacheFile.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (session.cacheFd < 0 || fstat(session.cacheFd, &st) != 0 || !S_ISREG(st.st_mode)
+        || !ReadCacheMetadata(session.cacheFile, metadata) || metadata.size != static_cast<uint64_t>(st.st_size))
+    {
+        return false;
+    }
+    session.cacheRemaining = static_cast<size_t>(st.st_size);
+    return true;
+}
+
+std::string BuildUpstreamRequest(const ProxySession& session)
+{
+    static const std::string_view skippedFields[] = {
+        "host", "connection", "proxy-connection", "keep-alive", "te", "trailer", "upgrade", "proxy-authorization",
+        "if-none-match", "if-modified-since", "if-match", "if-unmodified-since", "if-range", "range",
+    };
+    std::string request = "GET " + session.path + " HTTP/1.1\r\n" "Host: " + session.host
+                          + (session.port == 80 ? "" : ":" + std::to_string(session.port)) + "\r\n";
+    ForEachRequestHeader(session.request, [&request](const std::string& name, std::string_view,
+                                                     const std::string_view line) {
+        if (std::find(std::begin(skippedFields), std::end(skippedFields), name) == std::end(skippedFields))
+        {
+            request.append(line);
+            request += "\r\n";
+        }
+    });
+    return request;
+}
+
+void FetchFromOrigin(Worker& worker, ProxySession& session)
+{
+    if (const int upstreamFd = CheckoutUpstream(worker, session.origin); upstreamFd >= 0)
+    {
+        if (AttachUpstream(worker, session, upstreamFd))
+        {
+            session.upstreamReused = true;
+            session.state = SessionState::Relaying;
+        }
+        return;
+    }
+    ResolveOrigin(worker, session);
+}
+
+void StartRequest(Worker& worker, ProxySession& session)
+{
+    if (!ParseProxyStyle(session.request, session.host, session.path, session.port)
+        && !ParseGatewayStyle(session.request, session.host, session.path, session.port))
+    {
+        FailSession(worker, session, 400, "Bad Request");
+        return;
+    }
+
+    Log("[REQ] " + session.host + ":" + std::to_string(session.port) + session.path);
+    session.origin = OriginKey(session.host, session.port);
+    session.cacheFile = MakeCacheKey(session.host, session.path);
+    CacheMetadata metadata;
+    if (session.memoryObject = LookupMemoryCache(session.cacheFile, metadata); session.memoryObject)
+    {
+        session.cacheRemaining = session.memoryObject->size();
+    }
+    else if (!OpenCachedObject(session, metadata))
+    {
+        DropCachedObject(session);
+    }
+
+    const bool cached = (session.memoryObject || session.cacheFd >= 0) && VaryMatches(metadata, session.request);
+    if (cached && metadata.expiresAt > UnixNow() && !ClientRequiresRevalidation(session.request))
+    {
+        session.state = SessionState::ServingCache;
+        session.toClient = CachedResponseHead(metadata);
+        if (session.memoryObject)
+        {
+            Log("[HIT] " + session.cacheFile + " (memory)");
+            return;
+        }
+        session.keepMemoryCopy = WouldAdmitToMemoryCache(session.cacheFile, session.cacheRemaining);
+        if (session.keepMemoryCopy)
+        {
+            session.memoryCopy.reserve(session.cacheRemaining);
+            session.cacheMetadata = std::move(metadata);
+        }
+        Log("[HIT] " + session.cacheFile + (session.keepMemoryCopy ? " (promoting to memory)" : ""));
+        return;
+    }
+
+    session.toUpstream = BuildUpstreamRequest(session);
+    if (cached && (!metadata.etag.empty() || !metadata.lastModified.empty()))
+    {
+        Log("[STALE] Revalidating " + session.cacheFile);
+        session.revalidating = true;
+        session.toUpstream += metadata.etag.empty() ? "" : "If-None-Match: " + metadata.etag + "\r\n";
+        session.toUpstream += metadata.lastModified.empty()
+                                  ? ""
+                                  : "If-Modified-Since: " + metadata.lastModified + "\r\n";
+        session.cacheMetadata = std::move(metadata);
+    }
+    else
+    {
+        DropCachedObject(session);
+        if (RequestHeader(session.request, "authorization").empty() && JoinFetch(worker, session))
+        {
+            Log("[COALESCED] Waiting for " + session.cacheFile);
+            session.state = SessionState::Following;
+            return;
+        }
+        Log("[MISS] Fetching " + session.cacheFile);
+    }
+    session.toUpstream += "\r\n";
+    FetchFromOrigin(worker, session);
+}
+
+bool ReadClientRequest(Worker& worker, ProxySession& session)
+{
+    char buffer[BUFFER_SIZE];
+    while (session.request.find("\r\n\r\n") == std::string::npos)
+    {
+        if (session.request.size() >= MAX_REQUEST_HEADER_SIZE)
+        {
+            FailSession(worker, session, 400, "Bad Request");
+            return true;
+        }
+        const ssize_t bytesRead = recv(session.clientFd, buffer, sizeof(buffer), 0);
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (bytesRead == 0)
+        {
+            return false;
+        }
+        session.request.append(buffer, static_cast<size_t>(bytesRead));
+    }
+    StartRequest(worker, session);
+    return true;
+}
+
+bool BuildCacheMetadata(const ProxySession& session, CacheMetadata& metadata)
+{
+    const CachingHeaders& headers = session.response.cachingHeaders;
+    if (std::find(std::begin(STORABLE_STATUS_CODES), std::end(STORABLE_STATUS_CODES), session.response.statusCode)
+            == std::end(STORABLE_STATUS_CODES)
+        || HasDirective(headers.cacheControl, "no-store") || HasDirective(headers.cacheControl, "private"))
+    {
+        return false;
+    }
+    if (!RequestHeader(session.request, "authorization").empty() && !HasDirective(headers.cacheControl, "public")
+        && !HasDirective(headers.cacheControl, "s-maxage") && !HasDirective(headers.cacheControl, "must-revalidate"))
+    {
+        return false;
+    }
+
+    metadata = CacheMetadata{};
+    for (size_t start = 0; start < headers.vary.size();)
+    {
+        const size_t end = std::min(headers.vary.find(',', start), headers.vary.size());
+        const std::string name(TrimSpaces(std::string_view(headers.vary).substr(start, end - start)));
+        if (name == "*")
+        {
+            return false;
+        }
+        metadata.vary.emplace_back(name, RequestHeader(session.request, name));
+        start = end + 1;
+    }
+    metadata.head = session.response.storedHead;
+    metadata.date = headers.date;
+    metadata.etag = headers.etag;
+    metadata.lastModified = headers.lastModified;
+    metadata.cacheControl = headers.cacheControl;
+    metadata.expires = headers.expires;
+    const int64_t now = UnixNow();
+    ComputeExpiry(metadata, headers, now);
+    return metadata.expiresAt > now || !metadata.etag.empty() || !metadata.lastModified.empty();
+}
+
+void RefreshCachedObject(ProxySession& session)
+{
+    const CachingHeaders& headers = session.response.cachingHeaders;
+    CacheMetadata& metadata = session.cacheMetadata;
+    metadata.date = headers.date.empty() ? metadata.date : headers.date;
+    metadata.etag = headers.etag.empty() ? metadata.etag : headers.etag;
+    metadata.lastModified = headers.lastModified.empty() ? metadata.lastModified : headers.lastModified;
+    metadata.cacheControl = headers.cacheControl.empty() ? metadata.cacheControl : headers.cacheControl;
+    metadata.expires = headers.expires.empty() ? metadata.expires : headers.expires;
+    ComputeExpiry(metadata, headers, UnixNow());
+    WriteCacheMetadata(session.cacheFile, metadata, session.id);
+    RefreshMemoryCache(session.cacheFile, metadata);
+    session.toClient += CachedResponseHead(metadata);
+    Log("[REVALIDATED] " + session.cacheFile);
+}
+
+void BeginCacheWrite(ProxySession& session)
+{
+    if (!BuildCacheMetadata(session, session.cacheMetadata))
+    {
+        Log("[NOT CACHEABLE] " + session.cacheFile);
+        EndFetch(session, FetchState::Abandoned);
+        return;
+    }
+    session.cacheTempFile = session.cacheFile + "#" + std::to_string(session.id);
+    session.cacheWriteFd = open(session.cacheTempFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (session.cacheWriteFd < 0)
+    {
+        std::cerr << "Cannot create " << session.cacheTempFile << ": " << strerror(errno) << "\n";
+        EndFetch(session, FetchState::Abandoned);
+        return;
+    }
+    // Only bodies of known length that the memory tier would admit are copied while they stream in.
+    session.keepMemoryCopy = session.response.framing == BodyFraming::ContentLength
+                             && WouldAdmitToMemoryCache(session.cacheFile, session.response.remaining);
+    if (session.keepMemoryCopy)
+    {
+        session.memoryCopy.reserve(session.response.remaining);
+    }
+    PublishFetch(session);
+}
+
+void AppendCacheWrite(ProxySession& session, const char* data, size_t size)
+{
+    if (session.cacheWriteFd >= 0 && session.keepMemoryCopy)
+    {
+        session.memoryCopy.append(data, size);
+    }
+    while (session.cacheWriteFd >= 0 && size > 0)
+    {
+        const ssize_t bytesWritten = write(session.cacheWriteFd, data, size);
+        if (bytesWritten < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesWritten <= 0)
+        {
+            std::cerr << "Cannot write " << session.cacheTempFile << ": " << strerror(errno) << "\n";
+            AbandonCacheWrite(session);
+            return;
+        }
+        data += bytesWritten;
+        size -= static_cast<size_t>(bytesWritten);
+        AdvanceFetch(session, static_cast<size_t>(bytesWritten));
+    }
+}
+
+void FinishCacheWrite(ProxySession& session)
+{
+    if (session.cacheWriteFd < 0)
+    {
+        return;
+    }
+    struct stat st;
+    const bool sized = fstat(session.cacheWriteFd, &st) == 0;
+    close(session.cacheWriteFd);
+    session.cacheWriteFd = -1;
+    if (!sized || rename(session.cacheTempFile.c_str(), session.cacheFile.c_str()) < 0)
+    {
+        std::cerr << "Cannot save " << session.cacheFile << ": " << strerror(errno) << "\n";
+        unlink(session.cacheTempFile.c_str());
+        EndFetch(session, FetchState::Abandoned);
+        return;
+    }
+    session.cacheMetadata.size = static_cast<uint64_t>(st.st_size);
+    WriteCacheMetadata(session.cacheFile, session.cacheMetadata, session.id);
+    EndFetch(session, FetchState::Complete);
+    Log("[SAVED] " + session.cacheFile);
+    StoreInMemoryCache(session.cacheFile,
+                       session.keepMemoryCopy
+                           ? std::make_shared<const std::string>(std::move(session.memoryCopy))
+                           : nullptr,
+                       session.cacheMetadata);
+}
+
+bool CompleteUpstreamConnect(Worker& worker, ProxySession& session)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(session.upstreamFd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0)
+    {
+        FailSession(worker, session, 502, "Bad Gateway");
+        return true;
+    }
+    sockaddr_in peer{};
+    socklen_t peerLength = sizeof(peer);
+    if (getpeername(session.upstreamFd, reinterpret_cast<sockaddr*>(&peer), &peerLength) < 0)
+    {
+        return true;
+    }
+    session.state = SessionState::Relaying;
+    return true;
+}
+
+bool ParseResponseHead(ResponseParser& parser, const std::string_view head, std::string& out)
+{
+    size_t lineEnd = head.find("\r\n");
+    const std::string_view statusLine = head.substr(0, lineEnd);
+    if (!statusLine.starts_with("HTTP/1.") || statusLine.size() < 12 || statusLine.find('\n') != std::string_view::npos
+        || std::from_chars(statusLine.data() + 9, statusLine.data() + 12, parser.statusCode).ec != std::errc())
+    {
+        return false;
+    }
+
+    std::vector<std::pair<std::string, std::string_view>> fields;
+    std::string transferCodings;
+    bool hasLength = false;
+    parser.keepAlive = statusLine[7] == '1';
+    parser.cachingHeaders = CachingHeaders{};
+    for (size_t lineStart = lineEnd + 2; lineStart < head.size(); lineStart = lineEnd + 2)
+    {
+        lineEnd = head.find("\r\n", lineStart);
+        const std::string_view line = head.substr(lineStart, lineEnd - lineStart);
+        const size_t colon = line.find(':');
+        if (colon == std::string_view::npos)
+        {
+            return false;
+        }
+        std::string name = LowerCase(TrimSpaces(line.substr(0, colon)));
+        const std::string_view rawValue = TrimSpaces(line.substr(colon + 1));
+        const std::string value = LowerCase(rawValue);
+        CachingHeaders& caching = parser.cachingHeaders;
+        if (name == "connection")
+        {
+            parser.keepAlive = value.find("close") == std::string::npos
+                               && (parser.keepAlive || value.find("keep-alive") != std::string::npos);
+        }
+        else if (name == "transfer-encoding")
+        {
+            transferCodings += (transferCodings.empty() ? "" : ", ") + std::string(rawValue);
+        }
+        else if (name == "content-length")
+        {
+            const auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), parser.remaining);
+            if (error != std::errc() || end != value.data() + value.size())
+            {
+                return false;
+            }
+            hasLength = true;
+        }
+        else if (name == "cache-control" || name == "vary")
+        {
+            std::string& combined = name == "vary" ? caching.vary : caching.cacheControl;
+            combined += (combined.empty() ? "" : ", ") + value;
+        }
+        else if (name == "expires" || name == "date" || name == "age" || name == "last-modified" || name == "etag")
+        {
+            std::string* fields[] = {&caching.expires, &caching.date, &caching.age, &caching.lastModified,
+                                     &caching.etag};
+            const std::string_view names[] = {"expires", "date", "age", "last-modified", "etag"};
+            *fields[std::find(std::begin(names), std::end(names), name) - std::begin(names)] = rawValue;
+        }
+        fields.emplace_back(std::move(name), line);
+    }
+
+    // Only the final chunked coding is removed; any codings applied before it still describe the body.
+    const bool chunked = LowerCase(transferCodings).ends_with("chunked");
+    std::string_view remainingCodings = transferCodings;
+    if (chunked)
+    {
+        remainingCodings.remove_suffix(std::string_view("chunked").size());
+        while (!remainingCodings.empty() && (remainingCodings.back() == ',' || remainingCodings.back() == ' '
+                                             || remainingCodings.back() == '\t'))
+        {
+            remainingCodings.remove_suffix(1);
+        }
+    }
+
+    // The cached copy leaves out the fields that CachedResponseHead regenerates from metadata on every hit.
+    static const std::string_view regeneratedFields[] = {
+        "cache-control", "expires", "date", "etag", "last-modified", "age",
+    };
+    out.append(statusLine);
+    out += "\r\n";
+    parser.storedHead = out;
+    for (const auto& [name, line] : fields)
+    {
+        if (name == "connection" || name == "keep-alive" || name == "proxy-connection"
+            || (!transferCodings.empty() && (name == "transfer-encoding" || name == "content-length")))
+        {
+            continue;
+        }
+        out.append(line);
+        out += "\r\n";
+        if (std::find(std::begin(regeneratedFields), std::end(regeneratedFields), name) == std::end(regeneratedFields)
+            && line.find('\n') == std::string_view::npos)
+        {
+            parser.storedHead.append(line);
+            parser.storedHead += "\r\n";
+        }
+    }
+    if (!remainingCodings.empty())
+    {
+        const std::string field = "Transfer-Encoding: " + std::string(remainingCodings) + "\r\n";
+        out += field;
+        parser.storedHead += field;
+    }
+    out += "Connection: close\r\n\r\n";
+
+    if (parser.statusCode == 204 || parser.statusCode == 304)
+    {
+        parser.framing = BodyFraming::None;
+    }
+    else if (chunked)
+    {
+        parser.framing = BodyFraming::Chunked;
+    }
+    else if (hasLength && transferCodings.empty())
+    {
+        parser.framing = BodyFraming::ContentLength;
+    }
+    else
+    {
+        parser.framing = BodyFraming::UntilClose;
+        parser.keepAlive = false;
+    }
+    parser.complete = parser.framing == BodyFraming::None
+                      || (parser.framing == BodyFraming::ContentLength && parser.remaining == 0);
+    return true;
+}
+
+bool TakeChunkLine(ResponseParser& parser, std::string_view& data, bool& lineReady)
+{
+    const size_t newline = data.find('\n');
+    parser.chunkLine.append(data.substr(0, newline));
+    data.remove_prefix(newline == std::string_view::npos ? data.size() : newline + 1);
+    lineReady = newline != std::string_view::npos;
+    if (lineReady && parser.chunkLine.ends_with('\r'))
+    {
+        parser.chunkLine.pop_back();
+    }
+    return parser.chunkLine.size() <= MAX_CHUNK_LINE_SIZE;
+}
+
+bool ParseChunkedBody(ResponseParser& parser, std::string_view& data, std::string& out)
+{
+    bool lineReady = false;
+    switch (parser.chunkStage)
+    {
+    case ChunkStage::Size:
+        if (!TakeChunkLine(parser, data, lineReady))
+        {
+            return false;
+        }
+        if (lineReady)
+        {
+            const std::string_view sizeText = TrimSpaces(std::string_view(parser.chunkLine).substr(
+                0, parser.chunkLine.find(';')));
+            const auto [end, error] = std::from_chars(sizeText.data(), sizeText.data() + sizeText.size(),
+                                                      parser.remaining, 16);
+            if (sizeText.empty() || error != std::errc() || end != sizeText.data() + sizeText.size())
+            {
+                return false;
+            }
+            parser.chunkLine.clear();
+            parser.chunkStage = parser.remaining == 0 ? ChunkStage::Trailer : ChunkStage::Data;
+        }
+        return true;
+    case ChunkStage::Data:
+    {
+        const size_t length = static_cast<size_t>(std::min<uint64_t>(parser.remaining, data.size()));
+        out.append(data.substr(0, length));
+        data.remove_prefix(length);
+        parser.remaining -= length;
+        parser.chunkStage = parser.remaining == 0 ? ChunkStage::DataEnd : ChunkStage::Data;
+        return true;
+    }
+    case ChunkStage::DataEnd:
+        if (!TakeChunkLine(parser, data, lineReady) || (lineReady && !parser.chunkLine.empty()))
+        {
+            return false;
+        }
+        parser.chunkStage = lineReady ? ChunkStage::Size : ChunkStage::DataEnd;
+        return true;
+    case ChunkStage::Trailer:
+        if (!TakeChunkLine(parser, data, lineReady))
+        {
+            return false;
+        }
+        parser.complete = lineReady && parser.chunkLine.empty();
+        if (lineReady)
+        {
+            parser.chunkLine.clear();
+        }
+        return true;
+    }
+    return false;
+}
+
+bool ParseResponseBody(ResponseParser& parser, std::string_view& data, std::string& out)
+{
+    while (!data.empty() && !parser.complete)
+    {
+        if (parser.framing == BodyFraming::Chunked)
+        {
+            if (!ParseChunkedBody(parser, data, out))
+            {
+                return false;
+            }
+            continue;
+        }
+        const size_t length = parser.framing == BodyFraming::UntilClose
+                                  ? data.size()
+                                  : static_cast<size_t>(std::min<uint64_t>(parser.remaining, data.size()));
+        out.append(data.substr(0, length));
+        data.remove_prefix(length);
+        parser.remaining -= parser.framing == BodyFraming::UntilClose ? 0 : length;
+        parser.complete = parser.framing == BodyFraming::ContentLength && parser.remaining == 0;
+    }
+    if (!data.empty())
+    {
+        parser.keepAlive = false;
+    }
+    return true;
+}
+
+bool ConsumeResponse(ProxySession& session, std::string_view data)
+{
+    ResponseParser& parser = session.response;
+    size_t bodyStart = session.toClient.size();
+    std::string remainder;
+    if (!parser.headersDone)
+    {
+        parser.head.append(data);
+        size_t headEnd = parser.head.find("\r\n\r\n");
+        while (headEnd != std::string::npos && !parser.headersDone)
+        {
+            std::string headers;
+            if (!ParseResponseHead(parser, std::string_view(parser.head).substr(0, headEnd + 2), headers))
+            {
+                return false;
+            }
+            remainder = parser.head.substr(headEnd + 4);
+            if (parser.statusCode / 100 == 1)
+            {
+                parser.head = std::move(remainder);
+                headEnd = parser.head.find("\r\n\r\n");
+                continue;
+            }
+            parser.headersDone = true;
+            parser.head.clear();
+            if (session.revalidating && parser.statusCode == 304)
+            {
+                RefreshCachedObject(session);
+                continue;
+            }
+            session.revalidating = false;
+            DropCachedObject(session);
+            session.toClient += headers;
+            bodyStart = session.toClient.size();
+            BeginCacheWrite(session);
+        }
+        if (!parser.headersDone)
+        {
+            return parser.head.size() <= MAX_RESPONSE_HEADER_SIZE;
+        }
+        data = remainder;
+    }
+
+    if (!ParseResponseBody(parser, data, session.toClient))
+    {
+        return false;
+    }
+    AppendCacheWrite(session, session.toClient.data() + bodyStart, session.toClient.size() - bodyStart);
+    return true;
+}
+
+bool AbortRelay(Worker& worker, ProxySession& session)
+{
+    if (session.upstreamReused && !session.response.headersDone && session.response.head.empty())
+    {
+        CloseUpstream(worker, session);
+        session.upstreamReused = false;
+        session.toUpstreamSent = 0;
+        ResolveOrigin(worker, session);
+        return true;
+    }
+    if (!session.response.headersDone)
+    {
+        FailSession(worker, session, 502, "Bad Gateway");
+        return true;
+    }
+    return false;
+}
+
+bool RelayResponse(Worker& worker, ProxySession& session)
+{
+    if (!FlushToUpstream(session))
+    {
+        return AbortRelay(worker, session);
+    }
+    char buffer[BUFFER_SIZE];
+    while (true)
+    {
+        if (!FlushToClient(session))
+        {
+            return false;
+        }
+        if (session.toClient.size() - session.toClientSent >= MAX_BUFFERED_BYTES)
+        {
+            return true;
+        }
+
+        const ssize_t bytesRead = recv(session.upstreamFd, buffer, sizeof(buffer), 0);
+        if (bytesRead < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return true;
+        }
+        if (bytesRead == 0 && session.response.headersDone && session.response.framing == BodyFraming::UntilClose)
+        {
+            session.response.complete = true;
+        }
+        else if (bytesRead <= 0 || !ConsumeResponse(session, std::string_view(buffer, static_cast<size_t>(bytesRead))))
+        {
+            return AbortRelay(worker, session);
+        }
+
+        if (session.response.complete)
+        {
+            ReleaseUpstream(worker, session);
+            FinishCacheWrite(session);
+            session.state = session.revalidating ? SessionState::ServingCache : SessionState::Finishing;
+            return true;
+        }
+    }
+}
+
+bool ReadMemoryCopyChunk(ProxySession& session)
+{
+    // A promoted hit reads the file one bounded chunk ahead of the client instead of all at once.
+    if (session.memoryCopy.size() > static_cast<size_t>(session.cacheOffset))
+    {
+        return true;
+    }
+    const size_t copied = session.memoryCopy.size();
+    const size_t chunk = std::min(session.cacheRemaining, MAX_BUFFERED_BYTES);
+    session.memoryCopy.resize(copied + chunk);
+    ssize_t bytesRead;
+    do
+    {
+        bytesRead = pread(session.cacheFd, session.memoryCopy.data() + copied, chunk, static_cast<off_t>(copied));
+    } while (bytesRead < 0 && errno == EINTR);
+    session.memoryCopy.resize(copied + static_cast<size_t>(std::max<ssize_t>(bytesRead, 0)));
+    return bytesRead > 0;
+}
+
+bool ServeCachedObject(ProxySession& session)
+{
+    if (!FlushToClient(session))
+    {
+        return false;
+    }
+    if (!session.toClient.empty())
+    {
+        return true;
+    }
+    while (session.cacheRemaining > 0)
+    {
+        if (session.keepMemoryCopy && !ReadMemoryCopyChunk(session))
+        {
+            session.keepMemoryCopy = false;
+            std::string().swap(session.memoryCopy);
+        }
+        const ssize_t bytesSent = session.memoryObject
+                                      ? send(session.clientFd, session.memoryObject->data() + session.cacheOffset,
+                                             session.cacheRemaining, MSG_NOSIGNAL)
+                                  : session.keepMemoryCopy
+                                      ? send(session.clientFd, session.memoryCopy.data() + session.cacheOffset,
+                                             session.memoryCopy.size() - session.cacheOffset, MSG_NOSIGNAL)
+                                      : sendfile(session.clientFd, session.cacheFd, &session.cacheOffset,
+                                                 session.cacheRemaining);
+        if (bytesSent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (bytesSent == 0)
+        {
+            return false;
+        }
+        session.cacheRemaining -= static_cast<size_t>(bytesSent);
+        session.cacheOffset += session.memoryObject || session.keepMemoryCopy ? bytesSent : 0;
+    }
+    if (session.keepMemoryCopy)
+    {
+        session.keepMemoryCopy = false;
+        StoreInMemoryCache(session.cacheFile, std::make_shared<const std::string>(std::move(session.memoryCopy)),
+                           session.cacheMetadata);
+    }
+    return false;
+}
+
+bool FollowFetch(Worker& worker, ProxySession& session)
+{
+    InFlightFetch& fetch = *session.fetch;
+    FetchState state;
+    std::string tempFile;
+    std::string responseHead;
+    bool varyMatches;
+    {
+        std::lock_guard lock(fetch.mutex);
+        state = fetch.state;
+        tempFile = fetch.tempFile;
+        varyMatches = tempFile.empty() || VaryMatches(fetch.metadata, session.request);
+        responseHead = session.cacheFd < 0 && !tempFile.empty() ? CachedResponseHead(fetch.metadata) : "";
+    }
+    const uint64_t available = fetch.written.load(std::memory_order_acquire);
+    if (session.cacheFd < 0 && state != FetchState::Abandoned && varyMatches && !tempFile.empty())
+    {
+        session.cacheFd = open((state == FetchState::Complete ? session.cacheFile : tempFile).c_str(),
+                               O_RDONLY | O_CLOEXEC);
+        session.toClient = session.cacheFd >= 0 ? std::move(responseHead) : "";
+    }
+    if (session.cacheFd < 0 && state == FetchState::Running && varyMatches)
+    {
+        return true;
+    }
+    const bool nothingSent = session.cacheOffset == 0 && session.toClientSent == 0 && !session.toClient.empty();
+    if (session.cacheFd < 0 || (state == FetchState::Abandoned && nothingSent))
+    {
+        session.toClient.clear();
+        DropCachedObject(session);
+        EndFetch(session, FetchState::Abandoned);
+        Log("[MISS] Fetching " + session.cacheFile + " (fetch not shareable)");
+        session.toUpstream = BuildUpstreamRequest(session) + "\r\n";
+        FetchFromOrigin(worker, session);
+        return true;
+    }
+
+    if (!FlushToClient(session))
+    {
+        return false;
+    }
+    if (!session.toClient.empty())
+    {
+        return true;
+    }
+    while (static_cast<uint64_t>(session.cacheOffset) < available)
+    {
+        const ssize_t bytesSent = sendfile(session.clientFd, session.cacheFd, &session.cacheOffset,
+                                           available - static_cast<uint64_t>(session.cacheOffset));
+        if (bytesSent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (bytesSent == 0)
+        {
+            return false;
+        }
+    }
+    return state == FetchState::Running;
+}
+
+bool StepSession(Worker& worker, ProxySession& session)
+{
+    switch (session.state)
+    {
+    case SessionState::ReadingRequest:
+        return ReadClientRequest(worker, session);
+    case SessionState::Resolving:
+        return true;
+    case SessionState::Connecting:
+        return CompleteUpstreamConnect(worker, session);
+    case SessionState::Relaying:
+        return RelayResponse(worker, session);
+    case SessionState::ServingCache:
+        return ServeCachedObject(session);
+    case SessionState::Following:
+        return FollowFetch(worker, session);
+    case SessionState::Finishing:
+        return FlushToClient(session) && !session.toClient.empty();
+    }
+    return false;
+}
+
+void DriveSession(Worker& worker, ProxySession& session)
+{
+    SessionState previous;
+    do
+    {
+        previous = session.state;
+        if (!StepSession(worker, session))
+        {
+            CloseSession(worker, session.clientFd);
+            return;
+        }
+    } while (session.state != previous);
+
+    if (session.state != SessionState::Resolving && session.state != SessionState::Connecting)
+    {
+        session.deadline = std::chrono::steady_clock::now() + IDLE_TIMEOUT;
+    }
+}
+
+void AcceptClients(Worker& worker)
+{
+    while (true)
+    {
+        const int clientFd = accept4(worker.listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientFd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                std::cerr << "Accept failed: " << strerror(errno) << "\n";
+            }
+            return;
+        }
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = clientFd;
+        if (epoll_ctl(worker.epollFd, EPOLL_CTL_ADD, clientFd, &event) < 0)
+        {
+            std::cerr << "epoll_ctl(client) failed: " << strerror(errno) << "\n";
+            close(clientFd);
+            continue;
+        }
+        auto session = std::make_unique<ProxySession>();
+        session->id = g_nextSessionId.fetch_add(1, std::memory_order_relaxed);
+        session->clientFd = clientFd;
+        session->deadline = std::chrono::steady_clock::now() + IDLE_TIMEOUT;
+        worker.sessions[clientFd] = std::move(session);
+    }
+}
+
+void CompleteResolves(Worker& worker)
+{
+    uint64_t wakeups = 0;
+    while (read(worker.wakeFd, &wakeups, sizeof(wakeups)) > 0)
+    {
+    }
+
+    std::vector<ResolveResult> results;
+    {
+        std::lock_guard lock(worker.mutex);
+        results.swap(worker.resolved);
+    }
+    const auto now = std::chrono::steady_clock::now();
+    for (const ResolveResult& result : results)
+    {
+        if (result.resolved)
+        {
+            if (worker.dnsCache.size() >= DNS_CACHE_MAX_ENTRIES)
+            {
+                worker.dnsCache.clear();
+            }
+            worker.dnsCache[result.origin] = ResolvedOrigin{result.address, now + DNS_CACHE_TTL};
+        }
+
+        const auto it = worker.sessions.find(result.clientFd);
+        if (it == worker.sessions.end() || it->second->id != result.sessionId
+            || it->second->state != SessionState::Resolving)
+        {
+            continue;
+        }
+        ProxySession& session = *it->second;
+        if (result.resolved)
+        {
+            StartUpstreamConnect(worker, session, result.address);
+        }
+        else
+        {
+            FailSession(worker, session, 502, "Bad Gateway");
+        }
+        DriveSession(worker, session);
+    }
+}
+
+void AdvanceFollowers(Worker& worker)
+{
+    std::vector<std::shared_ptr<InFlightFetch>> fetches;
+    {
+        std::lock_guard lock(worker.mutex);
+        fetches.swap(worker.progressedFetches);
+    }
+    for (const std::shared_ptr<InFlightFetch>& fetch : fetches)
+    {
+        std::vector<FetchFollower> followers;
+        {
+            std::lock_guard lock(fetch->mutex);
+            std::copy_if(fetch->followers.begin(), fetch->followers.end(), std::back_inserter(followers),
+                         [&worker](const FetchFollower& follower) { return follower.worker == &worker; });
+        }
+        for (const FetchFollower& follower : followers)
+        {
+            const auto it = worker.sessions.find(follower.clientFd);
+            if (it != worker.sessions.end() && it->second->id == follower.sessionId && it->second->fetch == fetch)
+            {
+                DriveSession(worker, *it->second);
+            }
+        }
+    }
+}
+
+void ExpireSessions(Worker& worker)
+{
+    const auto now = std::chrono::steady_clock::now();
+    std::vector<int> expiredFds;
+    for (const auto& [clientFd, session] : worker.sessions)
+    {
+        if (session->deadline <= now)
+        {
+            expiredFds.push_back(clientFd);
+        }
+    }
+    for (const int clientFd : expiredFds)
+    {
+        ProxySession& session = *worker.sessions[clientFd];
+        if (session.state != SessionState::Resolving && session.state != SessionState::Connecting)
+        {
+            CloseSession(worker, clientFd);
+            continue;
+        }
+        FailSession(worker, session, 504, "Gateway Timeout");
+        DriveSession(worker, session);
+    }
+    ExpireIdleUpstreams(worker);
+}
+
+[[noreturn]] void RunResolver(Resolver& resolver)
+{
+    while (true)
+    {
+        std::unique_lock lock(resolver.mutex);
+        resolver.jobsReady.wait(lock, [&resolver] { return !resolver.jobs.empty(); });
+        const ResolveJob job = std::move(resolver.jobs.front());
+        resolver.jobs.pop_front();
+        lock.unlock();
+
+        ResolveResult result;
+        result.clientFd = job.clientFd;
+        result.sessionId = job.sessionId;
+        result.origin = OriginKey(job.host, job.port);
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (addrinfo* res = nullptr;
+            getaddrinfo(job.host.c_str(), std::to_string(job.port).c_str(), &hints, &res) == 0)
+        {
+            std::memcpy(&result.address, res->ai_addr, sizeof(result.address));
+            result.resolved = true;
+            freeaddrinfo(res);
+        }
+
+        {
+            std::lock_guard workerLock(job.worker->mutex);
+            job.worker->resolved.push_back(std::move(result));
+        }
+        WakeWorker(*job.worker);
+    }
+}
+
+[[noreturn]] void RunWorker(Worker& worker)
+{
+    epoll_event events[MAX_EPOLL_EVENTS];
+    auto nextSweep = std::chrono::steady_clock::now() + SWEEP_INTERVAL;
+    while (true)
+    {
+        const int readyCount = epoll_wait(worker.epollFd, events, MAX_EPOLL_EVENTS, SWEEP_INTERVAL.count());
+        if (readyCount < 0 && errno != EINTR)
+        {
+            std::cerr << "epoll_wait failed: " << strerror(errno) << "\n";
+        }
+
+        for (int i = 0; i < readyCount; ++i)
+        {
+            const int fd = events[i].data.fd;
+            if (fd == worker.listenFd)
+            {
+                AcceptClients(worker);
+                continue;
+            }
+            if (fd == worker.wakeFd)
+            {
+                CompleteResolves(worker);
+                AdvanceFollowers(worker);
+                continue;
+            }
+
+            if (const auto it = worker.sessions.find(fd); it != worker.sessions.end())
+            {
+                if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !KeepFetchForFollowers(*it->second))
+                {
+                    CloseSession(worker, fd);
+                    continue;
+                }
+                DriveSession(worker, *it->second);
+            }
+            else if (const auto upstream = worker.upstreams.find(fd); upstream != worker.upstreams.end())
+            {
+                DriveSession(worker, *upstream->second);
+            }
+        }
+
+        if (const auto now = std::chrono::steady_clock::now(); now >= nextSweep)
+        {
+            ExpireSessions(worker);
+            nextSweep = now + SWEEP_INTERVAL;
+        }
+    }
+}
+
+void CreateWorker(Worker& worker, const bool reusePort)
+{
+    worker.listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (worker.listenFd < 0)
+    {
+        std::cerr << "Socket creation failed: " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    const int opt = 1;
+    setsockopt(worker.listenFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reusePort && setsockopt(worker.listenFd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+    {
+        std::cerr << "setsockopt(SO_REUSEPORT) failed: " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(PROXY_PORT);
+    if (bind(worker.listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+        || listen(worker.listenFd, LISTEN_BACKLOG) < 0)
+    {
+        std::cerr << "Cannot listen on port " << PROXY_PORT << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    worker.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    worker.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker.epollFd < 0 || worker.wakeFd < 0)
+    {
+        std::cerr << "Worker setup failed: " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    for (const int fd : {worker.listenFd, worker.wakeFd})
+    {
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = fd;
+        if (epoll_ctl(worker.epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            std::cerr << "epoll_ctl failed: " << strerror(errno) << "\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+ProxyOptions ParseProxyOptions(const int argc, char* argv[])
+{
+    ProxyOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        bool valid = i + 1 < argc;
+        try
+        {
+            if (arg == "--workers" && valid)
+            {
+                options.workers = std::stoi(argv[++i]);
+            }
+            else if (arg == "--memory-cache" && valid)
+            {
+                options.memoryCacheMegabytes = std::stoul(argv[++i]);
+            }
+            else
+            {
+                valid = false;
+            }
+        }
+        catch (...)
+        {
+            valid = false;
+        }
+
+        if (!valid || options.workers <= 0)
+        {
+            std::cerr << "Usage: " << argv[0] << " [--workers <count>] [--memory-cache <MiB>]\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    return options;
+}
+
+int main(const int argc, char* argv[])
+{
+    const ProxyOptions options = ParseProxyOptions(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+    InitCacheDir();
+    g_memoryCache.capacity = options.memoryCacheMegabytes * 1024 * 1024;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < options.workers; ++i)
+    {
+        CreateWorker(*workers.emplace_back(std::make_unique<Worker>()), options.workers > 1);
+    }
+    for (int i = 0; i < RESOLVER_THREADS; ++i)
+    {
+        std::thread(RunResolver, std::ref(g_resolver)).detach();
+    }
+
+    std::cout << "Proxy запущен на порту " << PROXY_PORT << ", рабочих потоков: " << options.workers << std::endl;
+    std::cout << "Кэш: ./" << CACHE_DIR << "/, в памяти до " << options.memoryCacheMegabytes << " МиБ" << std::endl;
+    std::cout << "\n--- СПОСОБЫ ТЕСТИРОВАНИЯ ---" << std::endl;
+    std::cout << "Откройте в браузере: http://localhost:8888/example.com" << std::endl;
+
+    for (int i = 1; i < options.workers; ++i)
+    {
+        std::thread(RunWorker, std::ref(*workers[i])).detach();
     }
+    RunWorker(*workers[0]);
 }
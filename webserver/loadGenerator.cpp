@@ -0,0 +1,878 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cerrno>
+#include <filesystem>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <charconv>
+#include <bit>
+#include <cmath>
+
+using Clock = std::chrono::steady_clock;
+
+constexpr auto DEFAULT_HOST = "127.0.0.1";
+constexpr auto DEFAULT_PORT = "8888";
+constexpr auto DEFAULT_URL = "/index.html";
+constexpr int DEFAULT_CONNECTIONS = 64;
+constexpr double DEFAULT_DURATION_SECONDS = 10.0;
+constexpr int MAX_EPOLL_EVENTS = 256;
+constexpr size_t READ_BUFFER_SIZE = 64 * 1024;
+constexpr size_t MAX_RESPONSE_HEADER_SIZE = 64 * 1024;
+constexpr auto REQUEST_TIMEOUT = std::chrono::seconds(10);
+constexpr int HISTOGRAM_SUB_BUCKET_MAGNITUDE = 11;
+constexpr uint64_t HISTOGRAM_SUB_BUCKET_COUNT = 1ull << HISTOGRAM_SUB_BUCKET_MAGNITUDE;
+constexpr uint64_t HISTOGRAM_SUB_BUCKET_HALF_COUNT = HISTOGRAM_SUB_BUCKET_COUNT / 2;
+constexpr int HISTOGRAM_BUCKET_COUNT = 22;
+constexpr uint64_t HISTOGRAM_MAX_VALUE_US = 3600ull * 1000 * 1000;
+
+struct ReportedPercentile
+{
+    double percentile;
+    const char* label;
+};
+
+constexpr ReportedPercentile REPORTED_PERCENTILES[] = {
+    {50.0, "p50"}, {90.0, "p90"}, {99.0, "p99"}, {99.9, "p99.9"}, {99.99, "p99.99"}
+};
+
+struct LoadOptions
+{
+    std::string host = DEFAULT_HOST;
+    std::string port = DEFAULT_PORT;
+    int connections = DEFAULT_CONNECTIONS;
+    int threads = 1;
+    double durationSeconds = DEFAULT_DURATION_SECONDS;
+    double rate = 0.0;
+    bool keepAlive = true;
+    std::vector<std::string> urls;
+    double maxP99Ms = 0.0;
+    double minRps = 0.0;
+    std::string fixtureDir;
+};
+
+struct Histogram
+{
+    std::vector<uint64_t> counts = std::vector<uint64_t>((HISTOGRAM_BUCKET_COUNT + 1) * HISTOGRAM_SUB_BUCKET_HALF_COUNT);
+    uint64_t totalCount = 0;
+    uint64_t maxValue = 0;
+};
+
+enum class ClientState
+{
+    Idle,
+    Connecting,
+    Sending,
+    Receiving
+};
+
+struct ClientConnection
+{
+    uint32_t index = 0;
+    int fd = -1;
+    ClientState state = ClientState::Idle;
+    bool reused = false;
+    size_t urlIndex = 0;
+    size_t requestSent = 0;
+    std::string responseHeaders;
+    bool headersParsed = false;
+    bool readUntilClose = false;
+    bool serverCloses = false;
+    size_t bodyRemaining = 0;
+    size_t bytesReceived = 0;
+    int status = 0;
+    Clock::time_point scheduledAt;
+    Clock::time_point sentAt;
+};
+
+struct WorkerStats
+{
+    Histogram corrected;
+    Histogram uncorrected;
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    uint64_t connectErrors = 0;
+    uint64_t readErrors = 0;
+    uint64_t statusErrors = 0;
+    uint64_t timeouts = 0;
+    uint64_t incomplete = 0;
+};
+
+struct WorkerContext
+{
+    const LoadOptions* options = nullptr;
+    const addrinfo* address = nullptr;
+    const std::vector<std::string>* requests = nullptr;
+    int firstConnection = 0;
+    int connectionCount = 0;
+    Clock::time_point start;
+    Clock::time_point end;
+    WorkerStats stats;
+};
+
+LoadOptions ParseLoadOptions(int argc, char* argv[]);
+
+bool ParseNumber(const char* arg, double& value);
+
+void ReadUrlsFile(const std::string& path, std::vector<std::string>& urls);
+
+void CreateFixture(const std::string& directory);
+
+void WriteFixtureFile(const std::filesystem::path& path, size_t size, bool text);
+
+addrinfo* ResolveAddress(const LoadOptions& options);
+
+std::vector<std::string> BuildRequests(const LoadOptions& options);
+
+void RunLoadWorker(WorkerContext& context);
+
+void StartRequest(WorkerContext& context, int epollFd, ClientConnection& connection);
+
+bool OpenConnection(const WorkerContext& context, int epollFd, ClientConnection& connection);
+
+void DriveConnection(WorkerContext& context, int epollFd, ClientConnection& connection, uint32_t events);
+
+bool SendRequest(const WorkerContext& context, ClientConnection& connection);
+
+bool ReceiveResponse(ClientConnection& connection, bool& complete);
+
+bool ParseResponseHeaders(ClientConnection& connection);
+
+void CompleteRequest(WorkerContext& context, ClientConnection& connection);
+
+void FailRequest(WorkerContext& context, ClientConnection& connection, uint64_t& counter);
+
+void CloseClientConnection(ClientConnection& connection);
+
+Clock::time_point NextSendTime(const WorkerContext& context, const ClientConnection& connection);
+
+void RecordValue(Histogram& histogram, uint64_t value);
+
+void MergeHistogram(Histogram& target, const Histogram& source);
+
+size_t HistogramIndex(uint64_t value);
+
+uint64_t HistogramValue(size_t index);
+
+uint64_t ValueAtPercentile(const Histogram& histogram, double percentile);
+
+void PrintHistogram(const std::string& title, const Histogram& histogram);
+
+int main(const int argc, char* argv[])
+{
+    const LoadOptions options = ParseLoadOptions(argc, argv);
+    if (!options.fixtureDir.empty())
+    {
+        CreateFixture(options.fixtureDir);
+        return EXIT_SUCCESS;
+    }
+
+    addrinfo* address = ResolveAddress(options);
+    const std::vector<std::string> requests = BuildRequests(options);
+
+    std::cout << "Target: " << options.host << ":" << options.port << ", " << options.urls.size() << " URL(s), "
+              << options.connections << " connection(s), " << options.threads << " thread(s), "
+              << (options.keepAlive ? "keep-alive" : "close") << ", "
+              << (options.rate > 0 ? std::to_string(static_cast<long long>(options.rate)) + " req/s" : "max rate")
+              << ", " << options.durationSeconds << " s\n";
+
+    std::vector<WorkerContext> contexts(options.threads);
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(
+                                              std::chrono::duration<double>(options.durationSeconds));
+    for (int i = 0; i < options.threads; ++i)
+    {
+        contexts[i].options = &options;
+        contexts[i].address = address;
+        contexts[i].requests = &requests;
+        contexts[i].firstConnection = options.connections * i / options.threads;
+        contexts[i].connectionCount = options.connections * (i + 1) / options.threads - contexts[i].firstConnection;
+        contexts[i].start = start;
+        contexts[i].end = end;
+    }
+
+    std::vector<std::thread> workers;
+    for (WorkerContext& context : contexts)
+    {
+        workers.emplace_back(RunLoadWorker, std::ref(context));
+    }
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    freeaddrinfo(address);
+
+    WorkerStats total;
+    for (const WorkerContext& context : contexts)
+    {
+        MergeHistogram(total.corrected, context.stats.corrected);
+        MergeHistogram(total.uncorrected, context.stats.uncorrected);
+        total.requests += context.stats.requests;
+        total.bytes += context.stats.bytes;
+        total.connectErrors += context.stats.connectErrors;
+        total.readErrors += context.stats.readErrors;
+        total.statusErrors += context.stats.statusErrors;
+        total.timeouts += context.stats.timeouts;
+        total.incomplete += context.stats.incomplete;
+    }
+
+    const double rps = static_cast<double>(total.requests) / elapsed;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cerr << std::fixed << std::setprecision(2);
+    std::cout << "Requests: " << total.requests << " in " << elapsed << " s, " << rps << " req/s, "
+              << static_cast<double>(total.bytes) / elapsed / (1024 * 1024) << " MiB/s\n";
+    std::cout << "Errors: connect " << total.connectErrors << ", read " << total.readErrors << ", status "
+              << total.statusErrors << ", timeout " << total.timeouts << ", in flight at end " << total.incomplete
+              << "\n";
+    if (options.rate > 0)
+    {
+        PrintHistogram("Latency (corrected for coordinated omission, from scheduled send time)", total.corrected);
+    }
+    PrintHistogram("Latency (uncorrected, from actual send time)", total.uncorrected);
+
+    const Histogram& gated = options.rate > 0 ? total.corrected : total.uncorrected;
+    const double p99Ms = static_cast<double>(ValueAtPercentile(gated, 99.0)) / 1000.0;
+    bool passed = true;
+    if (options.maxP99Ms > 0 && p99Ms > options.maxP99Ms)
+    {
+        std::cerr << "FAIL: p99 " << p99Ms << " ms exceeds " << options.maxP99Ms << " ms\n";
+        passed = false;
+    }
+    if (options.minRps > 0 && rps < options.minRps)
+    {
+        std::cerr << "FAIL: throughput " << rps << " req/s is below " << options.minRps << " req/s\n";
+        passed = false;
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+LoadOptions ParseLoadOptions(const int argc, char* argv[])
+{
+    LoadOptions options;
+    bool valid = true;
+    for (int i = 1; i < argc && valid; ++i)
+    {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        double number = 0.0;
+        if (arg == "--host" && hasValue)
+        {
+            options.host = argv[++i];
+        }
+        else if (arg == "--port" && hasValue)
+        {
+            options.port = argv[++i];
+        }
+        else if (arg == "--connections" && hasValue && ParseNumber(argv[++i], number) && number >= 1)
+        {
+            options.connections = static_cast<int>(number);
+        }
+        else if (arg == "--threads" && hasValue && ParseNumber(argv[++i], number) && number >= 1)
+        {
+            options.threads = static_cast<int>(number);
+        }
+        else if (arg == "--duration" && hasValue && ParseNumber(argv[++i], number) && number > 0)
+        {
+            options.durationSeconds = number;
+        }
+        else if (arg == "--rate" && hasValue && ParseNumber(argv[++i], number) && number >= 0)
+        {
+            options.rate = number;
+        }
+        else if (arg == "--close")
+        {
+            options.keepAlive = false;
+        }
+        else if (arg == "--url" && hasValue)
+        {
+            options.urls.emplace_back(argv[++i]);
+        }
+        else if (arg == "--urls-file" && hasValue)
+        {
+            ReadUrlsFile(argv[++i], options.urls);
+        }
+        else if (arg == "--max-p99" && hasValue && ParseNumber(argv[++i], number) && number > 0)
+        {
+            options.maxP99Ms = number;
+        }
+        else if (arg == "--min-rps" && hasValue && ParseNumber(argv[++i], number) && number > 0)
+        {
+            options.minRps = number;
+        }
+        else if (arg == "--create-fixture" && hasValue)
+        {
+            options.fixtureDir = argv[++i];
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+
+    if (!valid)
+    {
+        std::cerr << "Usage: " << argv[0] << " [--host <host>] [--port <port>] [--connections <n>] [--threads <n>]\n"
+                  << "       [--duration <seconds>] [--rate <requests/s>] [--close] [--url <path>]...\n"
+                  << "       [--urls-file <file>] [--max-p99 <ms>] [--min-rps <requests/s>]\n"
+                  << "       " << argv[0] << " --create-fixture <document root>\n";
+        exit(EXIT_FAILURE);
+    }
+    if (options.urls.empty())
+    {
+        options.urls.emplace_back(DEFAULT_URL);
+    }
+    options.threads = std::min(options.threads, options.connections);
+    return options;
+}
+
+bool ParseNumber(const char* arg, double& value)
+{
+    const char* end = arg + std::strlen(arg);
+    const auto [last, error] = std::from_chars(arg, end, value);
+    return error == std::errc() && last == end;
+}
+
+void ReadUrlsFile(const std::string& path, std::vector<std::string>& urls)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << "Failed to open URL list " << path << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    for (std::string line; std::getline(file, line);)
+    {
+        if (!line.empty() && line[0] == '/')
+        {
+            urls.push_back(line);
+        }
+    }
+}
+
+void CreateFixture(const std::string& directory)
+{
+    const std::filesystem::path benchDir = std::filesystem::path(directory) / "bench";
+    std::error_code error;
+    std::filesystem::create_directories(benchDir, error);
+    if (error)
+    {
+        std::cerr << "Failed to create " << benchDir << ": " << error.message() << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    WriteFixtureFile(benchDir / "small.html", 1024, true);
+    WriteFixtureFile(benchDir / "medium.css", 16 * 1024, true);
+    WriteFixtureFile(benchDir / "large.js", 256 * 1024, true);
+    WriteFixtureFile(benchDir / "image.bin", 1024 * 1024, false);
+
+    std::ofstream urls(benchDir / "urls.txt");
+    for (int i = 0; i < 6; ++i)
+    {
+        urls << "/bench/small.html\n";
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+        urls << "/bench/medium.css\n";
+    }
+    urls << "/bench/large.js\n/bench/image.bin\n";
+    std::cout << "Fixture written to " << benchDir.string() << ", URL mix in " << (benchDir / "urls.txt").string()
+              << "\n";
+}
+
+void WriteFixtureFile(const std::filesystem::path& path, const size_t size, const bool text)
+{
+    std::string contents(size, '\0');
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < size; ++i)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        contents[i] = text ? (i % 64 == 63 ? '\n' : static_cast<char>('a' + state % 26)) : static_cast<char>(state);
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file.write(contents.data(), static_cast<std::streamsize>(contents.size())))
+    {
+        std::cerr << "Failed to write " << path << "\n";
+        exit(EXIT_FAILURE);
+    }
+}
+
+addrinfo* ResolveAddress(const LoadOptions& options)
+{
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* address = nullptr;
+    if (const int error = getaddrinfo(options.host.c_str(), options.port.c_str(), &hints, &address); error != 0)
+    {
+        std::cerr << "Failed to resolve " << options.host << ": " << gai_strerror(error) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    return address;
+}
+
+std::vector<std::string> BuildRequests(const LoadOptions& options)
+{
+    std::vector<std::string> requests;
+    for (const std::string& url : options.urls)
+    {
+        requests.push_back("GET " + url + " HTTP/1.1\r\nHost: " + options.host + ":" + options.port
+                           + "\r\nUser-Agent: loadGenerator\r\n" + (options.keepAlive ? "" : "Connection: close\r\n")
+                           + "\r\n");
+    }
+    return requests;
+}
+
+void RunLoadWorker(WorkerContext& context)
+{
+    const int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0)
+    {
+        std::cerr << "epoll_create1 failed: " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<ClientConnection> connections(context.connectionCount);
+    for (size_t i = 0; i < connections.size(); ++i)
+    {
+        const int index = context.firstConnection + static_cast<int>(i);
+        connections[i].index = static_cast<uint32_t>(i);
+        connections[i].urlIndex = index % context.requests->size();
+        connections[i].scheduledAt = context.options->rate > 0
+                                         ? context.start + std::chrono::duration_cast<Clock::duration>(
+                                                               std::chrono::duration<double>(index / context.options->rate))
+                                         : context.start;
+    }
+
+    epoll_event events[MAX_EPOLL_EVENTS];
+    while (true)
+    {
+        const Clock::time_point now = Clock::now();
+        if (now >= context.end)
+        {
+            break;
+        }
+
+        Clock::time_point wakeAt = context.end;
+        for (ClientConnection& connection : connections)
+        {
+            if (connection.state == ClientState::Idle && connection.scheduledAt <= now)
+            {
+                StartRequest(context, epollFd, connection);
+            }
+            if (connection.state == ClientState::Idle)
+            {
+                wakeAt = std::min(wakeAt, connection.scheduledAt);
+            }
+            else if (now - connection.sentAt >= REQUEST_TIMEOUT)
+            {
+                FailRequest(context, connection, context.stats.timeouts);
+            }
+        }
+
+        const auto timeoutMs = std::chrono::duration_cast<std::chrono::milliseconds>(wakeAt - Clock::now()).count();
+        const int readyCount = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS,
+                                          static_cast<int>(std::clamp<long long>(timeoutMs, 0, 100)));
+        for (int i = 0; i < readyCount; ++i)
+        {
+            DriveConnection(context, epollFd, connections[events[i].data.u32], events[i].events);
+        }
+    }
+
+    for (ClientConnection& connection : connections)
+    {
+        if (connection.state != ClientState::Idle)
+        {
+            ++context.stats.incomplete;
+        }
+        CloseClientConnection(connection);
+    }
+    close(epollFd);
+}
+
+void StartRequest(WorkerContext& context, const int epollFd, ClientConnection& connection)
+{
+    connection.requestSent = 0;
+    connection.responseHeaders.clear();
+    connection.headersParsed = false;
+    connection.readUntilClose = false;
+    connection.serverCloses = false;
+    connection.bytesReceived = 0;
+    connection.sentAt = Clock::now();
+
+    if (connection.fd >= 0)
+    {
+        connection.reused = true;
+        connection.state = ClientState::Sending;
+        DriveConnection(context, epollFd, connection, EPOLLOUT);
+        return;
+    }
+
+    connection.reused = false;
+    if (!OpenConnection(context, epollFd, connection))
+    {
+        FailRequest(context, connection, context.stats.connectErrors);
+    }
+}
+
+bool OpenConnection(const WorkerContext& context, const int epollFd, ClientConnection& connection)
+{
+    connection.fd = socket(context.address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (connection.fd < 0)
+    {
+        return false;
+    }
+
+    int enable = 1;
+    setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    if (connect(connection.fd, context.address->ai_addr, context.address->ai_addrlen) < 0 && errno != EINPROGRESS)
+    {
+        return false;
+    }
+
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.u32 = connection.index;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, connection.fd, &event) < 0)
+    {
+        return false;
+    }
+    connection.state = ClientState::Connecting;
+    return true;
+}
+
+void DriveConnection(WorkerContext& context, const int epollFd, ClientConnection& connection, const uint32_t events)
+{
+    if (connection.state == ClientState::Idle)
+    {
+        if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        {
+            CloseClientConnection(connection);
+        }
+        return;
+    }
+
+    if (connection.state == ClientState::Connecting)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0)
+        {
+            FailRequest(context, connection, context.stats.connectErrors);
+            return;
+        }
+        if (!(events & EPOLLOUT))
+        {
+            return;
+        }
+        connection.state = ClientState::Sending;
+    }
+
+    if (connection.state == ClientState::Sending)
+    {
+        if (!SendRequest(context, connection))
+        {
+            FailRequest(context, connection, context.stats.readErrors);
+            return;
+        }
+        if (connection.state == ClientState::Sending)
+        {
+            return;
+        }
+    }
+
+    bool complete = false;
+    if (!ReceiveResponse(connection, complete))
+    {
+        if (connection.reused && connection.bytesReceived == 0)
+        {
+            CloseClientConnection(connection);
+            StartRequest(context, epollFd, connection);
+            return;
+        }
+        FailRequest(context, connection, context.stats.readErrors);
+        return;
+    }
+    if (complete)
+    {
+        CompleteRequest(context, connection);
+        if (connection.state == ClientState::Idle && connection.scheduledAt <= Clock::now())
+        {
+            StartRequest(context, epollFd, connection);
+        }
+    }
+}
+
+bool SendRequest(const WorkerContext& context, ClientConnection& connection)
+{
+    const std::string& request = (*context.requests)[connection.urlIndex];
+    while (connection.requestSent < request.size())
+    {
+        const ssize_t bytesSent = send(connection.fd, request.data() + connection.requestSent,
+                                       request.size() - connection.requestSent, MSG_NOSIGNAL);
+        if (bytesSent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        connection.requestSent += static_cast<size_t>(bytesSent);
+    }
+    connection.state = ClientState::Receiving;
+    return true;
+}
+
+bool ReceiveResponse(ClientConnection& connection, bool& complete)
+{
+    char buffer[READ_BUFFER_SIZE];
+    while (true)
+    {
+        const ssize_t bytesRead = recv(connection.fd, buffer, sizeof(buffer), 0);
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (bytesRead == 0)
+        {
+            complete = connection.headersParsed && connection.readUntilClose;
+            connection.serverCloses = true;
+            return complete;
+        }
+
+        connection.bytesReceived += static_cast<size_t>(bytesRead);
+        std::string_view data(buffer, static_cast<size_t>(bytesRead));
+        if (!connection.headersParsed)
+        {
+            connection.responseHeaders.append(data);
+            const size_t headerEnd = connection.responseHeaders.find("\r\n\r\n");
+            if (headerEnd == std::string::npos)
+            {
+                if (connection.responseHeaders.size() > MAX_RESPONSE_HEADER_SIZE)
+                {
+                    return false;
+                }
+                continue;
+            }
+            const size_t bodyInBuffer = connection.responseHeaders.size() - headerEnd - 4;
+            connection.responseHeaders.resize(headerEnd + 2);
+            if (!ParseResponseHeaders(connection))
+            {
+                return false;
+            }
+            data = data.substr(data.size() - bodyInBuffer);
+        }
+
+        if (connection.readUntilClose)
+        {
+            continue;
+        }
+        if (data.size() > connection.bodyRemaining)
+        {
+            return false;
+        }
+        connection.bodyRemaining -= data.size();
+        if (connection.bodyRemaining == 0)
+        {
+            complete = true;
+            return true;
+        }
+    }
+}
+
+bool ParseResponseHeaders(ClientConnection& connection)
+{
+    const std::string_view headers = connection.responseHeaders;
+    if (!headers.starts_with("HTTP/1.") || headers.size() < 12)
+    {
+        return false;
+    }
+    const auto [statusEnd, statusError] = std::from_chars(headers.data() + 9, headers.data() + 12, connection.status);
+    if (statusError != std::errc())
+    {
+        return false;
+    }
+
+    connection.headersParsed = true;
+    connection.readUntilClose = true;
+    connection.serverCloses = headers.starts_with("HTTP/1.0");
+    if (connection.status == 204 || connection.status == 304 || connection.status / 100 == 1)
+    {
+        connection.readUntilClose = false;
+        connection.bodyRemaining = 0;
+    }
+
+    size_t lineStart = headers.find("\r\n") + 2;
+    while (lineStart < headers.size())
+    {
+        const size_t lineEnd = headers.find("\r\n", lineStart);
+        const std::string_view line = headers.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 2;
+
+        const size_t colon = line.find(':');
+        if (colon == std::string_view::npos)
+        {
+            continue;
+        }
+        std::string name(line.substr(0, colon));
+        std::transform(name.begin(), name.end(), name.begin(), [](const unsigned char c) { return std::tolower(c); });
+        std::string_view value = line.substr(colon + 1);
+        value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+
+        if (name == "content-length" && connection.readUntilClose)
+        {
+            const auto [end, error] = std::from_chars(value.data(), value.data() + value.size(),
+                                                      connection.bodyRemaining);
+            if (error != std::errc())
+            {
+                return false;
+            }
+            connection.readUntilClose = false;
+        }
+        else if (name == "connection")
+        {
+            connection.serverCloses = value.find("close") != std::string_view::npos;
+        }
+    }
+    return true;
+}
+
+void CompleteRequest(WorkerContext& context, ClientConnection& connection)
+{
+    const Clock::time_point now = Clock::now();
+    const auto corrected = std::chrono::duration_cast<std::chrono::microseconds>(now - connection.scheduledAt);
+    const auto uncorrected = std::chrono::duration_cast<std::chrono::microseconds>(now - connection.sentAt);
+    RecordValue(context.stats.corrected, static_cast<uint64_t>(std::max<int64_t>(corrected.count(), 0)));
+    RecordValue(context.stats.uncorrected, static_cast<uint64_t>(std::max<int64_t>(uncorrected.count(), 0)));
+    ++context.stats.requests;
+    context.stats.bytes += connection.bytesReceived;
+    if (connection.status >= 400)
+    {
+        ++context.stats.statusErrors;
+    }
+
+    if (!context.options->keepAlive || connection.serverCloses)
+    {
+        CloseClientConnection(connection);
+    }
+    connection.state = ClientState::Idle;
+    connection.urlIndex = (connection.urlIndex + context.connectionCount) % context.requests->size();
+    connection.scheduledAt = NextSendTime(context, connection);
+}
+
+void FailRequest(WorkerContext& context, ClientConnection& connection, uint64_t& counter)
+{
+    ++counter;
+    CloseClientConnection(connection);
+    connection.state = ClientState::Idle;
+    connection.scheduledAt = NextSendTime(context, connection);
+}
+
+void CloseClientConnection(ClientConnection& connection)
+{
+    if (connection.fd >= 0)
+    {
+        close(connection.fd);
+        connection.fd = -1;
+    }
+}
+
+Clock::time_point NextSendTime(const WorkerContext& context, const ClientConnection& connection)
+{
+    if (context.options->rate <= 0)
+    {
+        return Clock::now();
+    }
+    const std::chrono::duration<double> interval(context.options->connections / context.options->rate);
+    return connection.scheduledAt + std::chrono::duration_cast<Clock::duration>(interval);
+}
+
+void RecordValue(Histogram& histogram, const uint64_t value)
+{
+    const uint64_t clamped = std::min(value, HISTOGRAM_MAX_VALUE_US);
+    ++histogram.counts[HistogramIndex(clamped)];
+    ++histogram.totalCount;
+    histogram.maxValue = std::max(histogram.maxValue, clamped);
+}
+
+void MergeHistogram(Histogram& target, const Histogram& source)
+{
+    for (size_t i = 0; i < target.counts.size(); ++i)
+    {
+        target.counts[i] += source.counts[i];
+    }
+    target.totalCount += source.totalCount;
+    target.maxValue = std::max(target.maxValue, source.maxValue);
+}
+
+size_t HistogramIndex(const uint64_t value)
+{
+    const int bucket = std::bit_width(value | (HISTOGRAM_SUB_BUCKET_COUNT - 1)) - HISTOGRAM_SUB_BUCKET_MAGNITUDE;
+    const uint64_t subBucket = value >> bucket;
+    return (static_cast<size_t>(bucket) + 1) * HISTOGRAM_SUB_BUCKET_HALF_COUNT + subBucket
+           - HISTOGRAM_SUB_BUCKET_HALF_COUNT;
+}
+
+uint64_t HistogramValue(const size_t index)
+{
+    int bucket = static_cast<int>(index / HISTOGRAM_SUB_BUCKET_HALF_COUNT) - 1;
+    uint64_t subBucket = index % HISTOGRAM_SUB_BUCKET_HALF_COUNT + HISTOGRAM_SUB_BUCKET_HALF_COUNT;
+    if (bucket < 0)
+    {
+        subBucket -= HISTOGRAM_SUB_BUCKET_HALF_COUNT;
+        bucket = 0;
+    }
+    return ((subBucket + 1) << bucket) - 1;
+}
+
+uint64_t ValueAtPercentile(const Histogram& histogram, const double percentile)
+{
+    const auto target = std::max<uint64_t>(
+        1, static_cast<uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(histogram.totalCount))));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < histogram.counts.size(); ++i)
+    {
+        seen += histogram.counts[i];
+        if (seen >= target)
+        {
+            return std::min(HistogramValue(i), histogram.maxValue);
+        }
+    }
+    return histogram.maxValue;
+}
+
+void PrintHistogram(const std::string& title, const Histogram& histogram)
+{
+    std::cout << title << ":\n";
+    if (histogram.totalCount == 0)
+    {
+        std::cout << "  no samples\n";
+        return;
+    }
+    for (const auto& [percentile, label] : REPORTED_PERCENTILES)
+    {
+        std::cout << "  " << std::setw(7) << std::left << label << std::right << std::setw(12)
+                  << static_cast<double>(ValueAtPercentile(histogram, percentile)) / 1000.0 << " ms\n";
+    }
+    std::cout << "  " << std::setw(7) << std::left << "max" << std::right << std::setw(12) << static_cast<double>(histogram.maxValue) / 1000.0 << " ms\n";
+}
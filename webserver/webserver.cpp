@@ -1,242 +1,6050 @@
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
 #include <cerrno>
 #include <filesystem>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+#include <zlib.h>
+#include <chrono>
+#include <algorithm>
+#include <charconv>
+#include <ctime>
+#include <array>
+#include <bit>
+#include <span>
+#include <atomic>
+#include <functional>
 
 constexpr int SERVER_PORT = 8888;
-constexpr int BACKLOG_SIZE = 10;
+constexpr int DEFAULT_BACKLOG_SIZE = 1024;
 constexpr size_t BUFFER_SIZE = 4096;
+constexpr size_t MAX_REQUEST_SIZE = 64 * 1024;
+constexpr size_t MAX_REQUEST_LINE_SIZE = 8 * 1024;
+constexpr size_t MAX_HEADER_COUNT = 64;
+constexpr int MAX_EPOLL_EVENTS = 256;
+constexpr unsigned URING_QUEUE_DEPTH = 4096;
+constexpr size_t URING_FIXED_BUFFER_COUNT = 1024;
+constexpr size_t SPLICE_CHUNK_SIZE = 64 * 1024;
+constexpr auto KEEP_ALIVE_TIMEOUT = std::chrono::seconds(5);
+constexpr auto HEADER_READ_TIMEOUT = std::chrono::seconds(10);
+constexpr auto BODY_READ_TIMEOUT = std::chrono::seconds(10);
+constexpr auto WRITE_TIMEOUT = std::chrono::seconds(30);
+constexpr auto TIMER_WHEEL_TICK = std::chrono::milliseconds(100);
+constexpr int TIMER_WHEEL_SLOT_BITS = 6;
+constexpr size_t TIMER_WHEEL_SLOTS = 1 << TIMER_WHEEL_SLOT_BITS;
+constexpr size_t TIMER_WHEEL_LEVELS = 4;
+constexpr size_t MAX_KEEP_ALIVE_REQUESTS = 100;
+constexpr size_t MAX_PIPELINED_RESPONSES = 16;
+constexpr int MAX_RESPONSE_IOVECS = 16;
+constexpr size_t FILE_CACHE_BUDGET_BYTES = 32 * 1024 * 1024;
+constexpr size_t MAX_CACHED_FILE_SIZE = 256 * 1024;
+constexpr size_t PATH_CACHE_MAX_ENTRIES = 4096;
+constexpr size_t PATH_CACHE_MAX_OPEN_FILES = 256;
+constexpr auto PATH_CACHE_NEGATIVE_TTL = std::chrono::seconds(1);
+constexpr size_t MAX_BYTE_RANGES = 16;
+constexpr size_t COMPRESSED_CACHE_BUDGET_BYTES = 16 * 1024 * 1024;
+constexpr size_t MAX_COMPRESSIBLE_FILE_SIZE = 4 * 1024 * 1024;
+constexpr size_t MAX_COMPRESSION_ATTEMPTS = 4096;
+constexpr auto COMPRESSION_RECHECK_INTERVAL = std::chrono::seconds(1);
+constexpr char VARIANT_KEY_SEPARATOR = '\n';
+constexpr size_t HTTP_DATE_BUFFER_SIZE = 32;
+constexpr auto MULTIPART_BOUNDARY = "WebServerByteRangesBoundary";
 constexpr auto DEFAULT_DOCUMENT_ROOT = "./www";
+constexpr auto DEFAULT_CONTENT_TYPE = "application/octet-stream";
+constexpr size_t MAX_EXTENSION_LENGTH = 32;
+constexpr uint32_t MAX_MIME_SEED = 1 << 16;
+constexpr auto METRICS_PATH = "/metrics";
+constexpr auto METRICS_CONTENT_TYPE = "text/plain; version=0.0.4";
+constexpr int MAX_STATUS_CODE = 600;
+constexpr uint64_t LATENCY_BUCKET_BOUNDS_US[] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+                                                 100000, 250000, 500000, 1000000, 2500000, 5000000};
+constexpr size_t ACCESS_LOG_RING_CAPACITY = 4096;
+constexpr size_t ACCESS_LOG_REQUEST_LINE_SIZE = 512;
+constexpr size_t ACCESS_LOG_HEADER_SIZE = 256;
+constexpr size_t ACCESS_LOG_BATCH_SIZE = 64 * 1024;
+constexpr size_t DEFAULT_ACCESS_LOG_MAX_BYTES = 64 * 1024 * 1024;
+constexpr int ACCESS_LOG_ROTATED_FILES = 5;
+constexpr auto ACCESS_LOG_FLUSH_INTERVAL = std::chrono::milliseconds(20);
+constexpr char BUNDLE_MAGIC[8] = {'W', 'S', 'B', 'U', 'N', 'D', 'L', 'E'};
+constexpr uint32_t BUNDLE_VERSION = 1;
+constexpr uint32_t HANDOFF_MAGIC = 0x57534831;
+constexpr auto HANDOFF_TIMEOUT = std::chrono::seconds(5);
+constexpr auto HANDOFF_DRAIN_TIMEOUT = std::chrono::seconds(30);
+constexpr std::string_view HTTP2_PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+constexpr size_t HTTP2_FRAME_HEADER_SIZE = 9;
+constexpr uint32_t HTTP2_DEFAULT_FRAME_SIZE = 16384;
+constexpr uint32_t HTTP2_MAX_FRAME_SIZE = 16777215;
+constexpr int64_t HTTP2_DEFAULT_WINDOW_SIZE = 65535;
+constexpr int64_t HTTP2_MAX_WINDOW_SIZE = 0x7fffffff;
+constexpr uint32_t HTTP2_MAX_CONCURRENT_STREAMS = 128;
+constexpr int HTTP2_DEFAULT_WEIGHT = 16;
+constexpr size_t HTTP2_SCHEDULER_QUANTUM = 1024;
+constexpr size_t HTTP2_OUTPUT_BUDGET = 256 * 1024;
+constexpr uint8_t HTTP2_FLAG_END_STREAM = 0x1;
+constexpr uint8_t HTTP2_FLAG_ACK = 0x1;
+constexpr uint8_t HTTP2_FLAG_END_HEADERS = 0x4;
+constexpr uint8_t HTTP2_FLAG_PADDED = 0x8;
+constexpr uint8_t HTTP2_FLAG_PRIORITY = 0x20;
+constexpr uint16_t HTTP2_SETTINGS_HEADER_TABLE_SIZE = 1;
+constexpr uint16_t HTTP2_SETTINGS_ENABLE_PUSH = 2;
+constexpr uint16_t HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS = 3;
+constexpr uint16_t HTTP2_SETTINGS_INITIAL_WINDOW_SIZE = 4;
+constexpr uint16_t HTTP2_SETTINGS_MAX_FRAME_SIZE = 5;
+constexpr size_t HPACK_DEFAULT_TABLE_SIZE = 4096;
+constexpr size_t HPACK_ENTRY_OVERHEAD = 32;
+constexpr size_t HPACK_STATIC_TABLE_SIZE = 61;
+constexpr uint16_t HPACK_HUFFMAN_EOS = 256;
+constexpr size_t HPACK_HUFFMAN_MAX_CODE_LENGTH = 30;
+constexpr uint8_t HPACK_HUFFMAN_CODE_LENGTHS[] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28,
+    28, 28, 28, 6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12,
+    10, 13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6, 15, 5, 6,
+    5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5, 6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28, 20, 22, 20, 20, 22, 22,
+    22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24, 22, 21, 20,
+    22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25, 19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28,
+    27, 27, 27, 20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27, 27, 27, 27, 28,
+    27, 27, 27, 27, 27, 26, 30};
 
-int CreateTcpSocket();
+enum class VariantState
+{
+    Unknown,
+    Pending,
+    Unavailable
+};
+
+enum class IoBackend
+{
+    Epoll,
+    IoUring
+};
+
+struct ServerOptions
+{
+    int workers = 1;
+    int backlog = DEFAULT_BACKLOG_SIZE;
+    bool pinWorkers = false;
+    IoBackend ioBackend = IoBackend::Epoll;
+    std::string mimeTypesPath;
+    std::string accessLogPath;
+    size_t accessLogMaxBytes = DEFAULT_ACCESS_LOG_MAX_BYTES;
+    bool combinedLogFormat = true;
+    std::string packBundlePath;
+    std::string bundlePath;
+    std::string handoffSocketPath;
+    std::string takeoverPath;
+};
+
+enum class ConnectionState
+{
+    Reading,
+    Writing,
+    Closed
+};
+
+enum class ParseStage
+{
+    RequestLine,
+    Headers,
+    Done
+};
+
+enum class ParseStatus
+{
+    Incomplete,
+    Complete,
+    Error
+};
+
+enum class Http2FrameType : uint8_t
+{
+    Data,
+    Headers,
+    Priority,
+    RstStream,
+    Settings,
+    PushPromise,
+    Ping,
+    GoAway,
+    WindowUpdate,
+    Continuation
+};
+
+enum class Http2Error : uint32_t
+{
+    NoError = 0x0,
+    ProtocolError = 0x1,
+    InternalError = 0x2,
+    FlowControlError = 0x3,
+    StreamClosed = 0x5,
+    FrameSizeError = 0x6,
+    RefusedStream = 0x7,
+    CompressionError = 0x9,
+    EnhanceYourCalm = 0xb
+};
+
+struct TextSpan
+{
+    uint32_t offset = 0;
+    uint32_t length = 0;
+};
+
+struct RequestParser
+{
+    ParseStage stage = ParseStage::RequestLine;
+    size_t lineStart = 0;
+    size_t scanOffset = 0;
+    TextSpan method;
+    TextSpan target;
+    TextSpan version;
+    TextSpan headerNames[MAX_HEADER_COUNT];
+    TextSpan headerValues[MAX_HEADER_COUNT];
+    size_t headerCount = 0;
+    int errorStatus = 0;
+};
+
+struct HttpHeader
+{
+    std::string_view name;
+    std::string_view value;
+};
+
+struct HttpRequest
+{
+    std::string_view method;
+    std::string_view target;
+    std::string_view version;
+    HttpHeader headers[MAX_HEADER_COUNT];
+    size_t headerCount = 0;
+    size_t length = 0;
+};
+
+struct ByteRange
+{
+    size_t first = 0;
+    size_t last = 0;
+};
+
+struct StringHash
+{
+    using is_transparent = void;
+
+    size_t operator()(const std::string_view text) const
+    {
+        return std::hash<std::string_view>{}(text);
+    }
+};
+
+struct FileValidators
+{
+    std::string etag;
+    std::string lastModified;
+    time_t modifiedTime = 0;
+};
+
+struct CachedFile
+{
+    std::string headers;
+    std::string notModifiedHeaders;
+    std::shared_ptr<const std::string> body;
+    FileValidators validators;
+};
+
+struct FileCacheEntry
+{
+    std::shared_ptr<const CachedFile> file;
+    std::list<std::string>::iterator lruPosition;
+    size_t size = 0;
+    // Content negotiation outcome for identity entries; reset whenever the entry is invalidated.
+    bool brotliUnavailable = false;
+    VariantState gzip = VariantState::Unknown;
+    std::chrono::steady_clock::time_point gzipCheckedAt;
+};
+
+struct FileCache
+{
+    size_t usedBytes = 0;
+    std::list<std::string> lru;
+    std::unordered_map<std::string, FileCacheEntry, StringHash, std::equal_to<>> entries;
+    int inotifyFd = -1;
+    std::unordered_map<int, std::string> watchedDirs;
+    std::unordered_set<std::string> watchedPrefixes;
+};
+
+struct ResolvedPath
+{
+    int fd = -1;
+    struct stat fileStat{};
+    uint64_t generation = 0;
+    std::chrono::steady_clock::time_point resolvedAt;
+};
+
+struct PathCache
+{
+    std::unordered_map<std::string, ResolvedPath, StringHash, std::equal_to<>> entries;
+    size_t openFiles = 0;
+    uint64_t generation = 0;
+};
+
+struct CompressionJob
+{
+    std::string filename;
+    uint64_t generation = 0;
+};
+
+struct CompressedBody
+{
+    std::string data;
+    FileValidators validators;
+};
+
+struct CompressedVariant
+{
+    std::shared_ptr<const CompressedBody> body;
+    std::list<std::string>::iterator lruPosition;
+};
+
+struct CompressedVariantCache
+{
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::deque<CompressionJob> jobs;
+    std::unordered_set<std::string, StringHash, std::equal_to<>> attempted;
+    std::unordered_set<std::string, StringHash, std::equal_to<>> unavailable;
+    std::list<std::string> lru;
+    std::unordered_map<std::string, CompressedVariant, StringHash, std::equal_to<>> entries;
+    size_t usedBytes = 0;
+    uint64_t generation = 0;
+};
+
+struct PendingResponse
+{
+    size_t headerOffset = 0;
+    size_t headerLength = 0;
+    std::shared_ptr<const std::string> body;
+    std::string_view mappedBody;
+    size_t bytesSent = 0;
+    int fileFd = -1;
+    bool ownsFile = true;
+    off_t fileOffset = 0;
+    size_t fileRemaining = 0;
+    int statusCode = 0;
+    size_t contentLength = 0;
+    std::chrono::steady_clock::time_point queuedAt;
+};
+
+struct TimerNode
+{
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t expiryTick = 0;
+    int fd = -1;
+};
+
+struct TimerWheel
+{
+    std::array<std::array<TimerNode, TIMER_WHEEL_SLOTS>, TIMER_WHEEL_LEVELS> slots;
+    std::chrono::steady_clock::time_point start;
+    uint64_t currentTick = 0;
+};
+
+struct HpackEntry
+{
+    std::string name;
+    std::string value;
+};
+
+struct HpackTable
+{
+    std::deque<HpackEntry> entries;
+    size_t size = 0;
+    size_t maxSize = HPACK_DEFAULT_TABLE_SIZE;
+};
+
+struct Http2BodySegment
+{
+    std::shared_ptr<const std::string> owner;
+    std::string_view bytes;
+    int fileFd = -1;
+    bool ownsFile = false;
+    off_t fileOffset = 0;
+    size_t fileRemaining = 0;
+};
+
+struct Http2Stream
+{
+    uint32_t id = 0;
+    int weight = HTTP2_DEFAULT_WEIGHT;
+    int64_t sendWindow = HTTP2_DEFAULT_WINDOW_SIZE;
+    std::deque<Http2BodySegment> body;
+    int statusCode = 0;
+    size_t contentLength = 0;
+    std::chrono::steady_clock::time_point queuedAt;
+};
+
+struct Http2Session
+{
+    HpackTable decoder;
+    HpackTable encoder;
+    bool encoderSizeChanged = false;
+    std::map<uint32_t, Http2Stream> streams;
+    uint32_t lastStreamId = 0;
+    uint32_t headerStreamId = 0;
+    int headerWeight = HTTP2_DEFAULT_WEIGHT;
+    std::string headerBlock;
+    int64_t sendWindow = HTTP2_DEFAULT_WINDOW_SIZE;
+    int64_t peerInitialWindow = HTTP2_DEFAULT_WINDOW_SIZE;
+    uint32_t peerMaxFrameSize = HTTP2_DEFAULT_FRAME_SIZE;
+    size_t unacknowledgedData = 0;
+    bool prefaceReceived = false;
+    uint32_t nextScheduledStream = 0;
+    bool goAwaySent = false;
+};
+
+struct Connection
+{
+    int fd = -1;
+    in_addr clientAddress{};
+    ConnectionState state = ConnectionState::Reading;
+    std::string request;
+    std::string headerBuffer;
+    RequestParser parser;
+    HttpRequest parsedRequest;
+    size_t bodyBytesToDiscard = 0;
+    std::deque<PendingResponse> responses;
+    size_t requestsServed = 0;
+    bool keepAlive = true;
+    bool peerClosed = false;
+    std::chrono::steady_clock::time_point lastActivity = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point requestStarted = lastActivity;
+    std::chrono::steady_clock::duration parseTime{};
+    TimerNode timer;
+    std::unique_ptr<Http2Session> http2;
+};
+
+struct LatencyHistogram
+{
+    std::array<std::atomic<uint64_t>, std::size(LATENCY_BUCKET_BOUNDS_US) + 1> buckets{};
+    std::atomic<uint64_t> sumNanoseconds{};
+};
+
+struct WorkerMetrics
+{
+    std::array<std::atomic<uint64_t>, MAX_STATUS_CODE> responsesByStatus{};
+    std::atomic<uint64_t> bytesSent{};
+    std::atomic<uint64_t> connectionsAccepted{};
+    std::atomic<uint64_t> connectionsClosed{};
+    std::atomic<uint64_t> accessLogDropped{};
+    LatencyHistogram parseLatency;
+    LatencyHistogram fileOpenLatency;
+    LatencyHistogram sendLatency;
+};
+
+struct MetricsRegistry
+{
+    std::mutex mutex;
+    std::vector<const WorkerMetrics*> workers;
+};
+
+template <size_t Capacity>
+struct LogField
+{
+    std::array<char, Capacity> text;
+    uint16_t length = 0;
+};
+
+struct AccessLogRecord
+{
+    time_t time = 0;
+    in_addr clientAddress{};
+    int statusCode = 0;
+    size_t contentLength = 0;
+    LogField<ACCESS_LOG_REQUEST_LINE_SIZE> requestLine;
+    LogField<ACCESS_LOG_HEADER_SIZE> referer;
+    LogField<ACCESS_LOG_HEADER_SIZE> userAgent;
+};
+
+struct AccessLogRing
+{
+    std::array<AccessLogRecord, ACCESS_LOG_RING_CAPACITY> records;
+    alignas(64) std::atomic<size_t> head{};
+    alignas(64) std::atomic<size_t> tail{};
+};
+
+struct AccessLog
+{
+    std::mutex mutex;
+    std::vector<std::unique_ptr<AccessLogRing>> rings;
+    std::string path;
+    size_t maxBytes = DEFAULT_ACCESS_LOG_MAX_BYTES;
+    bool combinedFormat = true;
+    int fd = -1;
+    size_t fileBytes = 0;
+};
+
+enum class UringOperation : uint32_t
+{
+    Accept,
+    Read,
+    Send,
+    SpliceIn,
+    SpliceOut,
+    Tick,
+    FileEvents,
+    Cancel
+};
+
+struct IoUring
+{
+    int fd = -1;
+    unsigned entries = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned* sqArray = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+    unsigned pendingSubmissions = 0;
+    bool multishotAccept = true;
+    bool accepting = true;
+    __kernel_timespec tickInterval{0, std::chrono::nanoseconds(TIMER_WHEEL_TICK).count()};
+    std::unique_ptr<char[]> bufferPool;
+    std::vector<int> freeBuffers;
+};
+
+struct UringConnection
+{
+    Connection connection;
+    int bufferIndex = -1;
+    std::unique_ptr<char[]> ownBuffer;
+    int pipeFds[2] = {-1, -1};
+    size_t pipeBytes = 0;
+    int operationsInFlight = 0;
+    msghdr message{};
+    iovec iov[MAX_RESPONSE_IOVECS];
+};
+
+struct BundleHeader
+{
+    char magic[8];
+    uint32_t version = BUNDLE_VERSION;
+    uint32_t entryCount = 0;
+};
+
+struct BundleSpan
+{
+    uint64_t offset = 0;
+    uint64_t length = 0;
+};
+
+struct BundleVariant
+{
+    BundleSpan headers;
+    BundleSpan notModifiedHeaders;
+    BundleSpan etag;
+    BundleSpan body;
+};
+
+struct BundleEntry
+{
+    BundleSpan path;
+    int64_t modifiedTime = 0;
+    BundleVariant identity;
+    BundleVariant gzip;
+};
+
+struct SiteBundle
+{
+    const char* data = nullptr;
+    size_t size = 0;
+    std::span<const BundleEntry> entries;
+};
+
+struct HandoffState
+{
+    std::atomic<bool> draining = false;
+    std::mutex mutex;
+    std::condition_variable changed;
+    int workerCount = 0;
+    std::vector<int> listenSockets;
+    std::vector<std::string> warmPaths;
+    int workersStopped = 0;
+    int workersDrained = 0;
+    std::vector<int> inheritedSockets;
+    std::vector<std::string> prewarmPaths;
+};
+
+struct MimeEntry
+{
+    std::string_view extension;
+    std::string_view type;
+};
+
+struct MimeTable
+{
+    std::span<const uint32_t> seeds;
+    std::span<const MimeEntry> slots;
+};
+
+struct LoadedMimeTypes
+{
+    std::string text;
+    std::vector<MimeEntry> entries;
+    std::vector<uint32_t> seeds;
+    std::vector<MimeEntry> slots;
+};
+
+template <size_t EntryCount>
+struct StaticMimeTable
+{
+    std::array<uint32_t, EntryCount / 2 + 1> seeds{};
+    std::array<MimeEntry, std::bit_ceil(EntryCount * 2)> slots{};
+    bool complete = false;
+};
+
+struct HuffmanDecodeTable
+{
+    std::array<uint32_t, HPACK_HUFFMAN_MAX_CODE_LENGTH + 1> firstCode{};
+    std::array<uint16_t, HPACK_HUFFMAN_MAX_CODE_LENGTH + 1> count{};
+    std::array<uint16_t, HPACK_HUFFMAN_MAX_CODE_LENGTH + 1> offset{};
+    std::array<uint16_t, HPACK_HUFFMAN_EOS + 1> symbols{};
+};
+
+constexpr uint32_t HashExtension(const std::string_view extension)
+{
+    uint32_t hash = 2166136261u;
+    for (const char c : extension)
+    {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+constexpr uint32_t MimeSlot(uint32_t hash, const uint32_t seed)
+{
+    hash ^= seed * 0x9e3779b9u;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    return hash ^ (hash >> 16);
+}
+
+template <typename Seeds, typename Slots>
+constexpr bool BuildMimeTable(const std::span<const MimeEntry> entries, Seeds& seeds, Slots& slots)
+{
+    const size_t slotMask = slots.size() - 1;
+    const auto bucketOf = [&seeds](const MimeEntry& entry) { return HashExtension(entry.extension) % seeds.size(); };
+    std::vector<size_t> bucketSizes(seeds.size());
+    for (const MimeEntry& entry : entries)
+    {
+        ++bucketSizes[bucketOf(entry)];
+    }
+
+    for (size_t size = *std::max_element(bucketSizes.begin(), bucketSizes.end()); size > 0; --size)
+    {
+        for (size_t bucket = 0; bucket < seeds.size(); ++bucket)
+        {
+            if (bucketSizes[bucket] != size)
+            {
+                continue;
+            }
+
+            bool placed = false;
+            for (uint32_t seed = 1; !placed && seed <= MAX_MIME_SEED; ++seed)
+            {
+                placed = true;
+                for (const MimeEntry& entry : entries)
+                {
+                    if (bucketOf(entry) != bucket)
+                    {
+                        continue;
+                    }
+                    MimeEntry& slot = slots[MimeSlot(HashExtension(entry.extension), seed) & slotMask];
+                    if (!slot.extension.empty())
+                    {
+                        placed = false;
+                        break;
+                    }
+                    slot = entry;
+                }
+                if (placed)
+                {
+                    seeds[bucket] = seed;
+                    continue;
+                }
+                for (const MimeEntry& entry : entries)
+                {
+                    MimeEntry& slot = slots[MimeSlot(HashExtension(entry.extension), seed) & slotMask];
+                    if (bucketOf(entry) == bucket && slot.extension == entry.extension)
+                    {
+                        slot = MimeEntry{};
+                    }
+                }
+            }
+            if (!placed)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+constexpr MimeEntry DEFAULT_MIME_TYPES[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"shtml", "text/html"},
+    {"xhtml", "application/xhtml+xml"},
+    {"css", "text/css"},
+    {"js", "application/javascript"},
+    {"mjs", "application/javascript"},
+    {"json", "application/json"},
+    {"jsonld", "application/ld+json"},
+    {"map", "application/json"},
+    {"webmanifest", "application/manifest+json"},
+    {"xml", "application/xml"},
+    {"rss", "application/rss+xml"},
+    {"atom", "application/atom+xml"},
+    {"txt", "text/plain"},
+    {"md", "text/markdown"},
+    {"csv", "text/csv"},
+    {"ics", "text/calendar"},
+    {"vtt", "text/vtt"},
+    {"yaml", "application/yaml"},
+    {"yml", "application/yaml"},
+    {"png", "image/png"},
+    {"apng", "image/apng"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"svg", "image/svg+xml"},
+    {"svgz", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"bmp", "image/bmp"},
+    {"tif", "image/tiff"},
+    {"tiff", "image/tiff"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"eot", "application/vnd.ms-fontobject"},
+    {"mp3", "audio/mpeg"},
+    {"ogg", "audio/ogg"},
+    {"oga", "audio/ogg"},
+    {"opus", "audio/opus"},
+    {"wav", "audio/wav"},
+    {"flac", "audio/flac"},
+    {"aac", "audio/aac"},
+    {"m4a", "audio/mp4"},
+    {"weba", "audio/webm"},
+    {"mid", "audio/midi"},
+    {"midi", "audio/midi"},
+    {"mp4", "video/mp4"},
+    {"m4v", "video/mp4"},
+    {"webm", "video/webm"},
+    {"ogv", "video/ogg"},
+    {"mov", "video/quicktime"},
+    {"avi", "video/x-msvideo"},
+    {"mkv", "video/x-matroska"},
+    {"mpeg", "video/mpeg"},
+    {"mpg", "video/mpeg"},
+    {"3gp", "video/3gpp"},
+    {"ts", "video/mp2t"},
+    {"m3u8", "application/vnd.apple.mpegurl"},
+    {"pdf", "application/pdf"},
+    {"rtf", "application/rtf"},
+    {"doc", "application/msword"},
+    {"docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    {"xls", "application/vnd.ms-excel"},
+    {"xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+    {"ppt", "application/vnd.ms-powerpoint"},
+    {"pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+    {"odt", "application/vnd.oasis.opendocument.text"},
+    {"ods", "application/vnd.oasis.opendocument.spreadsheet"},
+    {"odp", "application/vnd.oasis.opendocument.presentation"},
+    {"epub", "application/epub+zip"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"tgz", "application/gzip"},
+    {"bz2", "application/x-bzip2"},
+    {"xz", "application/x-xz"},
+    {"zst", "application/zstd"},
+    {"7z", "application/x-7z-compressed"},
+    {"rar", "application/vnd.rar"},
+    {"tar", "application/x-tar"},
+    {"jar", "application/java-archive"},
+    {"wasm", "application/wasm"},
+    {"swf", "application/x-shockwave-flash"},
+    {"sh", "application/x-sh"},
+    {"exe", "application/vnd.microsoft.portable-executable"},
+    {"iso", "application/x-iso9660-image"},
+    {"dmg", "application/x-apple-diskimage"},
+    {"apk", "application/vnd.android.package-archive"},
+    {"deb", "application/vnd.debian.binary-package"},
+    {"rpm", "application/x-rpm"},
+    {"bin", "application/octet-stream"},
+};
+
+constexpr auto DEFAULT_MIME_TABLE = [] {
+    StaticMimeTable<std::size(DEFAULT_MIME_TYPES)> table;
+    table.complete = BuildMimeTable(DEFAULT_MIME_TYPES, table.seeds, table.slots);
+    return table;
+}();
+
+static_assert(DEFAULT_MIME_TABLE.complete, "no perfect hash seeds found for DEFAULT_MIME_TYPES");
+
+constexpr HttpHeader HPACK_STATIC_TABLE[HPACK_STATIC_TABLE_SIZE] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static_assert(std::size(HPACK_HUFFMAN_CODE_LENGTHS) == HPACK_HUFFMAN_EOS + 1, "HPACK Huffman code is incomplete");
+
+constexpr auto HPACK_HUFFMAN_TABLE = [] {
+    HuffmanDecodeTable table;
+    for (const uint8_t length : HPACK_HUFFMAN_CODE_LENGTHS)
+    {
+        ++table.count[length];
+    }
+    uint32_t code = 0;
+    uint16_t offset = 0;
+    for (size_t length = 1; length <= HPACK_HUFFMAN_MAX_CODE_LENGTH; ++length)
+    {
+        table.firstCode[length] = code;
+        table.offset[length] = offset;
+        code = (code + table.count[length]) << 1;
+        offset += table.count[length];
+    }
+    auto next = table.offset;
+    for (uint16_t symbol = 0; symbol <= HPACK_HUFFMAN_EOS; ++symbol)
+    {
+        table.symbols[next[HPACK_HUFFMAN_CODE_LENGTHS[symbol]]++] = symbol;
+    }
+    return table;
+}();
+
+thread_local FileCache g_fileCache;
+thread_local PathCache g_pathCache;
+int g_documentRootFd = -1;
+bool g_openat2Supported = true;
+thread_local TimerWheel g_timerWheel;
+thread_local WorkerMetrics g_workerMetrics;
+MetricsRegistry g_metricsRegistry;
+thread_local AccessLogRing* g_accessLogRing = nullptr;
+AccessLog g_accessLog;
+CompressedVariantCache g_compressedVariants;
+LoadedMimeTypes g_loadedMimeTypes;
+SiteBundle g_siteBundle;
+MimeTable g_mimeTable{DEFAULT_MIME_TABLE.seeds, DEFAULT_MIME_TABLE.slots};
+HandoffState g_handoff;
+
+ServerOptions ParseServerOptions(int argc, char* argv[]);
+
+int ParsePositiveInt(const char* arg);
+
+[[noreturn]] void RunWorker(const ServerOptions& options, int workerIndex);
+
+void PinCurrentThread(int workerIndex);
+
+int OpenListeningSocket(const ServerOptions& options, int workerIndex);
+
+int CreateTcpSocket(bool reusePort);
 
 void BindSocket(int socketFd, int port);
 
-void ListenForConnections(int socketFd);
+void ListenForConnections(int socketFd, int backlog);
+
+void SetNonBlocking(int socketFd);
+
+int CreateEpoll(int serverSocket);
+
+[[noreturn]] void RunEventLoop(int epollFd, int serverSocket);
+
+void AcceptConnections(int epollFd, int serverSocket, std::unordered_map<int, Connection>& connections);
+
+void HandleReadable(Connection& connection);
+
+void ReadRequests(Connection& connection);
+
+void HandleWritable(Connection& connection);
+
+ssize_t SendQueuedBuffers(Connection& connection);
+
+int CollectResponseIovecs(const Connection& connection, iovec* iov, bool& fileFollows);
+
+void AdvanceSentBuffers(Connection& connection, size_t bytesWritten);
+
+void ReleaseFinishedResponses(Connection& connection);
+
+size_t PendingBufferBytes(const PendingResponse& response);
+
+void ReleaseResponse(PendingResponse& response);
+
+void CloseConnection(int epollFd, std::unordered_map<int, Connection>& connections, int clientFd);
+
+void CloseExpiredConnections(int epollFd, std::unordered_map<int, Connection>& connections);
+
+bool CloseIdleConnections(int epollFd, std::unordered_map<int, Connection>& connections);
+
+bool IsConnectionIdle(const Connection& connection);
+
+void InitTimerWheel(TimerWheel& wheel);
+
+uint64_t TimerTick(const TimerWheel& wheel, std::chrono::steady_clock::time_point time);
+
+void ArmTimer(TimerWheel& wheel, TimerNode& node, uint64_t expiryTick);
+
+void LinkTimer(TimerWheel& wheel, TimerNode& node);
+
+TimerNode& TimerSlot(TimerWheel& wheel, size_t level, uint64_t tick);
+
+void CancelTimer(TimerNode& node);
+
+void ExpireTimers(TimerWheel& wheel, std::vector<int>& expiredFds);
+
+void CascadeTimerSlot(TimerWheel& wheel, size_t level);
+
+void UpdateConnectionTimer(TimerWheel& wheel, Connection& connection);
+
+std::chrono::steady_clock::time_point ConnectionDeadline(const Connection& connection);
+
+bool SetupIoUring(IoUring& ring, unsigned entries);
+
+bool ProbeUringOperations(int ringFd);
+
+void RegisterUringBuffers(IoUring& ring);
+
+io_uring_sqe* GetSubmissionEntry(IoUring& ring, UringOperation operation, int fd);
+
+int SubmitAndWait(IoUring& ring, unsigned waitCount);
+
+[[noreturn]] void RunUringEventLoop(IoUring& ring, int serverSocket);
+
+void ArmUringAccept(IoUring& ring, int serverSocket);
+
+void CancelUringAccept(IoUring& ring, int serverSocket);
+
+void ArmUringTick(IoUring& ring);
+
+void ArmUringFileEvents(IoUring& ring);
+
+void AcceptUringConnection(IoUring& ring, int serverSocket, const io_uring_cqe& cqe,
+                           std::unordered_map<int, UringConnection>& connections);
+
+void CompleteUringOperation(const IoUring& ring, UringConnection& uringConnection, UringOperation operation,
+                            int result);
+
+void AdvanceUringConnection(IoUring& ring, std::unordered_map<int, UringConnection>& connections,
+                            UringConnection& uringConnection);
+
+void SubmitUringRead(IoUring& ring, UringConnection& uringConnection);
+
+char* UringReadBuffer(const IoUring& ring, const UringConnection& uringConnection);
+
+void SubmitUringSend(IoUring& ring, UringConnection& uringConnection);
+
+bool SubmitUringSplice(IoUring& ring, UringConnection& uringConnection);
+
+void CloseUringConnection(IoUring& ring, std::unordered_map<int, UringConnection>& connections, int clientFd);
+
+void ShutdownExpiredUringConnections(std::unordered_map<int, UringConnection>& connections);
+
+bool ShutdownIdleUringConnections(std::unordered_map<int, UringConnection>& connections);
+
+void ProcessRequests(Connection& connection);
+
+ParseStatus ParseHttpRequest(RequestParser& parser, std::string_view buffer, HttpRequest& request);
+
+ParseStatus FailParse(RequestParser& parser, int statusCode);
+
+bool ParseRequestLine(RequestParser& parser, std::string_view line, size_t lineOffset);
+
+bool ParseHeaderLine(RequestParser& parser, std::string_view line, size_t lineOffset);
+
+std::string_view TrimWhitespace(std::string_view text);
+
+bool ParseSize(std::string_view text, size_t& value);
+
+bool EqualsIgnoreCase(std::string_view a, std::string_view b);
+
+bool HasHeaderToken(std::string_view value, std::string_view token);
+
+std::string_view FindHeaderValue(const HttpRequest& request, std::string_view name);
+
+bool IsKeepAliveRequested(const HttpRequest& request);
+
+std::string_view ExtractRequestedFile(const HttpRequest& request);
+
+std::string_view DetermineContentType(std::string_view filename);
+
+std::string_view LookupMimeType(const MimeTable& table, std::string_view extension);
+
+void LoadMimeTypes(const std::string& path, LoadedMimeTypes& loaded, MimeTable& table);
+
+std::string_view StatusLine(int statusCode);
+
+std::string_view ReasonPhrase(int statusCode);
+
+void AppendStatusLine(std::string& out, int statusCode);
+
+void AppendFieldLines(std::string& out, int statusCode, std::string_view contentType, size_t contentLength,
+                      std::string_view extraHeaders);
+
+void AppendHttpHeaders(std::string& out, int statusCode, std::string_view contentType, size_t contentLength,
+                       bool keepAlive, std::string_view extraHeaders = {});
+
+void AppendConnectionHeaders(std::string& out, bool keepAlive);
+
+PendingResponse& QueueResponse(Connection& connection, std::string_view headers,
+                               std::shared_ptr<const std::string> body = nullptr, int fileFd = -1, size_t fileSize = 0);
+
+PendingResponse& QueueHttpResponse(Connection& connection, int statusCode, std::string_view contentType,
+                                   size_t contentLength, std::string_view extraHeaders = {},
+                                   std::shared_ptr<const std::string> body = nullptr, int fileFd = -1);
+
+void QueueTextResponse(Connection& connection, int statusCode, std::string_view text,
+                       std::string_view extraHeaders = {});
+
+std::string_view CurrentHttpDate();
+
+void WriteHttpDate(time_t time, char* buffer);
+
+std::string FormatHttpDate(time_t time);
+
+bool ParseHttpDate(std::string_view text, time_t& time);
+
+FileValidators MakeFileValidators(const struct stat& fileStat, std::string_view etagSuffix);
+
+std::string ValidatorHeaders(const FileValidators& validators);
+
+bool EntityTagListMatches(std::string_view header, std::string_view etag);
+
+bool IsNotModified(const HttpRequest& request, const FileValidators& validators);
+
+bool IsNotModified(const HttpRequest& request, std::string_view etag, time_t modifiedTime);
+
+void QueueNotModified(Connection& connection, std::string_view headers);
+
+bool IsRangeApplicable(const HttpRequest& request, const FileValidators& validators);
+
+bool ParseByteRanges(std::string_view header, size_t fileSize, std::vector<ByteRange>& ranges);
+
+void SendRangeResponse(Connection& connection, int fileFd, size_t fileSize, std::string_view contentType,
+                       const FileValidators& validators, const std::vector<ByteRange>& ranges);
+
+void InitFileCache(FileCache& cache, int epollFd);
+
+FileCacheEntry* FindCachedFile(FileCache& cache, std::string_view filename);
+
+std::shared_ptr<const CachedFile> LookupCachedFile(FileCache& cache, std::string_view filename);
+
+std::shared_ptr<const CachedFile> CacheFileContents(FileCache& cache, const std::string& key,
+                                                   std::string_view contentType,
+                                                   std::shared_ptr<const std::string> body,
+                                                   const FileValidators& validators, const std::string& extraHeaders);
+
+void QueueCachedFile(Connection& connection, const HttpRequest& request, const CachedFile& file);
+
+void WatchCachedFileDirectory(FileCache& cache, const std::string& filename);
+
+void InvalidateCachedFile(FileCache& cache, const std::string& filename);
+
+void ClearFileCache(FileCache& cache);
+
+void InvalidateFileVariants(FileCache& cache, const std::string& filename);
+
+void HandleFileCacheEvents(FileCache& cache);
+
+bool ReadWholeFile(int fileFd, size_t fileSize, std::string& contents);
+
+void OpenDocumentRoot();
+
+int OpenBeneathDocumentRoot(const std::string& filename, int flags);
+
+int OpenComponentsBeneathDocumentRoot(const std::string& filename, int flags);
+
+const ResolvedPath* ResolvePath(PathCache& cache, std::string_view filename);
+
+void ClearPathCache(PathCache& cache);
+
+void SendFileResponse(Connection& connection, const HttpRequest& request, std::string_view filename,
+                      const ResolvedPath& resolved);
+
+bool IsCompressibleType(std::string_view contentType);
+
+bool AcceptsEncoding(std::string_view acceptEncoding, std::string_view coding);
+
+std::string IdentityExtraHeaders(std::string_view contentType);
+
+std::string VariantKey(std::string_view filename, std::string_view coding);
+
+bool SendCompressedVariant(Connection& connection, const HttpRequest& request, std::string_view filename,
+                           std::string_view contentType, FileCacheEntry* identity);
+
+bool SendPrecompressedSibling(Connection& connection, const HttpRequest& request, const std::string& variantKey,
+                              std::string_view siblingName, std::string_view contentType, std::string_view coding);
+
+std::shared_ptr<const CompressedBody> LookupCompressedVariant(CompressedVariantCache& variants,
+                                                              std::string_view filename);
+
+VariantState ScheduleCompression(CompressedVariantCache& variants, std::string_view filename);
+
+[[noreturn]] void RunCompressionWorker(CompressedVariantCache& variants);
+
+bool CompressFile(const std::string& filename, std::shared_ptr<const CompressedBody>& body);
+
+bool GzipCompress(const std::string& input, std::string& output);
+
+void InvalidateCompressedVariant(CompressedVariantCache& variants, std::string_view filename);
+
+void ClearCompressedVariants(CompressedVariantCache& variants);
+
+void RegisterWorkerMetrics(MetricsRegistry& registry, const WorkerMetrics& metrics);
+
+void AddToCounter(std::atomic<uint64_t>& counter, uint64_t delta);
+
+void ObserveLatency(LatencyHistogram& histogram, std::chrono::steady_clock::duration elapsed);
+
+std::string RenderMetrics(MetricsRegistry& registry);
+
+void AppendMetricValue(std::string& out, std::string_view name, std::string_view labels, uint64_t value);
+
+void AppendLatencyMetric(std::string& out, std::span<const WorkerMetrics* const> workers,
+                         LatencyHistogram WorkerMetrics::*histogram, std::string_view name, std::string_view help);
+
+bool OpenAccessLog(AccessLog& log);
+
+AccessLogRing* CreateAccessLogRing(AccessLog& log);
+
+void LogAccess(AccessLogRing& ring, const Connection& connection, const HttpRequest& request,
+               const PendingResponse& response);
+
+template <size_t Capacity>
+void CopyLogField(LogField<Capacity>& field, std::string_view text);
+
+void RunAccessLogWriter(AccessLog& log);
+
+void FormatAccessLogRecord(const AccessLogRecord& record, bool combinedFormat, std::string& out);
+
+void AppendEscapedLogText(std::string& out, std::string_view text);
+
+void WriteAccessLogBatch(AccessLog& log, const std::string& batch);
+
+void RotateAccessLog(AccessLog& log);
+
+void PackSiteBundle(const std::string& outputPath);
+
+BundleSpan AppendBundleText(std::string& blob, std::string_view text);
+
+BundleVariant AppendBundleVariant(std::string& blob, std::string_view contentType, const std::string& body,
+                                  const FileValidators& validators, const std::string& extraHeaders);
+
+void MapSiteBundle(const std::string& path, SiteBundle& bundle);
+
+bool IsBundleVariantValid(const SiteBundle& bundle, const BundleVariant& variant);
+
+std::string_view BundleText(const SiteBundle& bundle, BundleSpan span);
+
+const BundleEntry* FindBundleEntry(const SiteBundle& bundle, std::string_view filename);
+
+void SendBundleResponse(Connection& connection, const HttpRequest& request, std::string_view filename);
+
+std::string_view ResponseBody(const PendingResponse& response);
+
+void StartHttp2Session(Connection& connection);
+
+bool IsHttp2UpgradeRequest(const HttpRequest& request);
+
+bool UpgradeToHttp2(Connection& connection, const HttpRequest& request);
+
+bool IsConnectionSpecificHeader(std::string_view name);
+
+bool DecodeBase64Url(std::string_view text, std::string& out);
+
+void ProcessHttp2Frames(Connection& connection, Http2Session& session);
+
+Http2Error HandleHttp2Frame(Connection& connection, Http2Session& session, Http2FrameType type, uint8_t flags,
+                            uint32_t streamId, std::string_view payload);
+
+Http2Error HandleHttp2Headers(Connection& connection, Http2Session& session, uint8_t flags, uint32_t streamId,
+                              std::string_view payload);
+
+Http2Error CompleteHttp2Headers(Connection& connection, Http2Session& session);
+
+Http2Error HandleHttp2WindowUpdate(Connection& connection, Http2Session& session, uint32_t streamId,
+                                   std::string_view payload);
+
+Http2Error ApplyHttp2Settings(Http2Session& session, std::string_view payload);
+
+bool BuildHttp2Request(std::span<const HpackEntry> fields, std::string& requestText);
+
+void StartHttp2Stream(Connection& connection, Http2Session& session, Http2Stream stream, std::string requestText);
+
+void AppendHttp2BodySegment(Http2Stream& stream, std::shared_ptr<const std::string> owner, std::string_view bytes);
+
+void QueueHttp2Headers(Connection& connection, Http2Session& session, const Http2Stream& stream,
+                       std::string_view fieldLines, bool endStream);
+
+void EncodeHttp2ResponseHeaders(Http2Session& session, int statusCode, std::string_view fieldLines,
+                                std::string& block);
+
+void ScheduleHttp2Output(Connection& connection, Http2Session& session);
+
+size_t QueueHttp2Data(Connection& connection, Http2Session& session, Http2Stream& stream, size_t allowance);
+
+void MarkHttp2StreamComplete(PendingResponse& response, const Http2Stream& stream);
+
+PendingResponse& QueueHttp2Frame(Connection& connection, Http2FrameType type, uint8_t flags, uint32_t streamId,
+                                 std::string_view payload = {});
+
+void AppendHttp2FrameHeader(std::string& out, size_t length, Http2FrameType type, uint8_t flags, uint32_t streamId);
+
+void AppendUint32(std::string& out, uint32_t value);
+
+uint32_t ReadUint32(std::string_view bytes);
+
+void ResetHttp2Stream(Connection& connection, Http2Session& session, uint32_t streamId, Http2Error error);
+
+void FailHttp2Connection(Connection& connection, Http2Session& session, Http2Error error);
+
+void SendHttp2GoAway(const Connection& connection);
+
+void ReleaseHttp2Stream(Http2Stream& stream);
+
+void ReleaseHttp2Session(Connection& connection);
+
+bool DecodeHpackBlock(HpackTable& table, std::string_view block, std::vector<HpackEntry>& fields, size_t& listSize);
+
+bool DecodeHpackInteger(std::string_view& input, int prefixBits, uint64_t& value);
+
+bool DecodeHpackString(std::string_view& input, std::string& out);
+
+bool DecodeHuffman(std::string_view input, std::string& out);
+
+bool LookupHpackEntry(const HpackTable& table, uint64_t index, HpackEntry& entry);
+
+void AddHpackEntry(HpackTable& table, std::string_view name, std::string_view value);
+
+void ResizeHpackTable(HpackTable& table, size_t maxSize);
+
+void EncodeHpackField(HpackTable& table, std::string& out, std::string_view name, std::string_view value);
+
+bool IsHpackIndexable(std::string_view name);
+
+void EncodeHpackInteger(std::string& out, uint8_t prefix, int prefixBits, uint64_t value);
+
+void EncodeHpackString(std::string& out, std::string_view text);
+
+void RunHandoffListener(HandoffState& handoff, const std::string& path);
+
+bool SendListeningSockets(HandoffState& handoff, int successorFd);
+
+bool SendWarmPaths(int successorFd, const std::vector<std::string>& paths);
+
+void TakeOverListeningSockets(HandoffState& handoff, const std::string& path);
+
+void RegisterListeningSocket(HandoffState& handoff, int serverSocket);
+
+void StopAccepting(HandoffState& handoff, const FileCache& cache);
+
+void ReportWorkerDrained(HandoffState& handoff);
+
+void PrewarmFileCache(const std::vector<std::string>& paths);
+
+void HandleClientConnection(Connection& connection, const HttpRequest& request);
+
+[[noreturn]] int main(const int argc, char* argv[])
+{
+    ServerOptions options = ParseServerOptions(argc, argv);
+
+    std::cout << "Starting web server on port " << SERVER_PORT << "...\n";
+    std::cout << "Document root: " << DEFAULT_DOCUMENT_ROOT << "\n";
+    std::cout << "Workers: " << options.workers << ", backlog: " << options.backlog
+              << (options.pinWorkers ? ", pinned to CPUs" : "")
+              << ", I/O backend: " << (options.ioBackend == IoBackend::IoUring ? "io_uring" : "epoll") << "\n";
+
+    if (!options.mimeTypesPath.empty())
+    {
+        LoadMimeTypes(options.mimeTypesPath, g_loadedMimeTypes, g_mimeTable);
+    }
+
+    if (!options.packBundlePath.empty())
+    {
+        PackSiteBundle(options.packBundlePath);
+        exit(EXIT_SUCCESS);
+    }
+    if (!options.bundlePath.empty())
+    {
+        MapSiteBundle(options.bundlePath, g_siteBundle);
+        std::cout << "Serving " << g_siteBundle.entries.size() << " files from bundle " << options.bundlePath << "\n";
+    }
+    else
+    {
+        OpenDocumentRoot();
+    }
+
+    if (!options.accessLogPath.empty())
+    {
+        g_accessLog.path = options.accessLogPath;
+        g_accessLog.maxBytes = options.accessLogMaxBytes;
+        g_accessLog.combinedFormat = options.combinedLogFormat;
+        if (!OpenAccessLog(g_accessLog))
+        {
+            exit(EXIT_FAILURE);
+        }
+        std::thread(RunAccessLogWriter, std::ref(g_accessLog)).detach();
+    }
+
+    std::thread(RunCompressionWorker, std::ref(g_compressedVariants)).detach();
+
+    if (!options.takeoverPath.empty())
+    {
+        TakeOverListeningSockets(g_handoff, options.takeoverPath);
+        options.workers = std::max(options.workers, static_cast<int>(g_handoff.inheritedSockets.size()));
+        std::cout << "Took over " << g_handoff.inheritedSockets.size() << " listening sockets from "
+                  << options.takeoverPath << ", prewarming " << g_handoff.prewarmPaths.size()
+                  << " files, workers: " << options.workers << "\n";
+    }
+    g_handoff.workerCount = options.workers;
+    if (!options.handoffSocketPath.empty())
+    {
+        std::thread(RunHandoffListener, std::ref(g_handoff), options.handoffSocketPath).detach();
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < options.workers; ++i)
+    {
+        workers.emplace_back(RunWorker, std::cref(options), i);
+    }
+    RunWorker(options, 0);
+}
+
+ServerOptions ParseServerOptions(const int argc, char* argv[])
+{
+    ServerOptions options;
+    bool valid = true;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--workers" && i + 1 < argc)
+        {
+            options.workers = std::string(argv[++i]) == "auto"
+                                  ? static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))
+                                  : ParsePositiveInt(argv[i]);
+        }
+        else if (arg == "--backlog" && i + 1 < argc)
+        {
+            options.backlog = ParsePositiveInt(argv[++i]);
+        }
+        else if (arg == "--pin-cpus")
+        {
+            options.pinWorkers = true;
+        }
+        else if (arg == "--mime-types" && i + 1 < argc)
+        {
+            options.mimeTypesPath = argv[++i];
+        }
+        else if (arg == "--pack-bundle" && i + 1 < argc)
+        {
+            options.packBundlePath = argv[++i];
+        }
+        else if (arg == "--bundle" && i + 1 < argc)
+        {
+            options.bundlePath = argv[++i];
+        }
+        else if (arg == "--handoff-socket" && i + 1 < argc)
+        {
+            options.handoffSocketPath = argv[++i];
+        }
+        else if (arg == "--takeover" && i + 1 < argc)
+        {
+            options.takeoverPath = argv[++i];
+        }
+        else if (arg == "--access-log" && i + 1 < argc)
+        {
+            options.accessLogPath = argv[++i];
+        }
+        else if (arg == "--access-log-max-mb" && i + 1 < argc)
+        {
+            const int megabytes = ParsePositiveInt(argv[++i]);
+            options.accessLogMaxBytes = static_cast<size_t>(std::max(megabytes, 0)) * 1024 * 1024;
+            valid = megabytes > 0;
+        }
+        else if (arg == "--log-format" && i + 1 < argc && std::string(argv[i + 1]) == "common")
+        {
+            options.combinedLogFormat = false;
+            ++i;
+        }
+        else if (arg == "--log-format" && i + 1 < argc && std::string(argv[i + 1]) == "combined")
+        {
+            options.combinedLogFormat = true;
+            ++i;
+        }
+        else if (arg == "--io-backend" && i + 1 < argc && std::string(argv[i + 1]) == "epoll")
+        {
+            options.ioBackend = IoBackend::Epoll;
+            ++i;
+        }
+        else if (arg == "--io-backend" && i + 1 < argc && std::string(argv[i + 1]) == "io_uring")
+        {
+            options.ioBackend = IoBackend::IoUring;
+            ++i;
+        }
+        else
+        {
+            valid = false;
+        }
+
+        if (!valid || options.workers <= 0 || options.backlog <= 0)
+        {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--workers <count>|auto] [--backlog <size>] [--pin-cpus] [--io-backend epoll|io_uring]"
+                      << " [--mime-types <path>] [--access-log <path>] [--access-log-max-mb <size>]"
+                      << " [--log-format common|combined] [--pack-bundle <path>] [--bundle <path>]"
+                      << " [--handoff-socket <path>] [--takeover <path>]\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    return options;
+}
+
+int ParsePositiveInt(const char* arg)
+{
+    try
+    {
+        size_t pos = 0;
+        const int value = std::stoi(arg, &pos);
+        return pos == std::strlen(arg) && value > 0 ? value : -1;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+void RunWorker(const ServerOptions& options, const int workerIndex)
+{
+    RegisterWorkerMetrics(g_metricsRegistry, g_workerMetrics);
+    if (!options.accessLogPath.empty())
+    {
+        g_accessLogRing = CreateAccessLogRing(g_accessLog);
+    }
+    if (options.pinWorkers)
+    {
+        PinCurrentThread(workerIndex);
+    }
+
+    const int serverSocket = OpenListeningSocket(options, workerIndex);
+    RegisterListeningSocket(g_handoff, serverSocket);
+
+    if (workerIndex == 0)
+    {
+        std::cout << "Server is listening...\n";
+    }
+
+    InitTimerWheel(g_timerWheel);
+    if (options.ioBackend == IoBackend::IoUring)
+    {
+        if (IoUring ring; SetupIoUring(ring, URING_QUEUE_DEPTH))
+        {
+            RegisterUringBuffers(ring);
+            InitFileCache(g_fileCache, -1);
+            PrewarmFileCache(g_handoff.prewarmPaths);
+            RunUringEventLoop(ring, serverSocket);
+        }
+        std::cerr << "io_uring is unavailable (" << strerror(errno) << "), falling back to epoll\n";
+    }
+
+    SetNonBlocking(serverSocket);
+    const int epollFd = CreateEpoll(serverSocket);
+    InitFileCache(g_fileCache, epollFd);
+    PrewarmFileCache(g_handoff.prewarmPaths);
+    RunEventLoop(epollFd, serverSocket);
+}
+
+void PinCurrentThread(const int workerIndex)
+{
+    const unsigned cpuCount = std::max(1u, std::thread::hardware_concurrency());
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(workerIndex % cpuCount, &cpuSet);
+    if (const int error = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet); error != 0)
+    {
+        std::cerr << "pthread_setaffinity_np failed for worker " << workerIndex << ": " << strerror(error) << "\n";
+    }
+}
+
+int OpenListeningSocket(const ServerOptions& options, const int workerIndex)
+{
+    const std::vector<int>& inherited = g_handoff.inheritedSockets;
+    int serverSocket = -1;
+    if (inherited.empty())
+    {
+        serverSocket = CreateTcpSocket(options.workers > 1);
+        BindSocket(serverSocket, SERVER_PORT);
+    }
+    else if (static_cast<size_t>(workerIndex) < inherited.size())
+    {
+        serverSocket = inherited[workerIndex];
+    }
+    else if (serverSocket = fcntl(inherited[workerIndex % inherited.size()], F_DUPFD_CLOEXEC, 0); serverSocket < 0)
+    {
+        std::cerr << "fcntl(F_DUPFD_CLOEXEC) failed: " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    if (const int flags = fcntl(serverSocket, F_GETFL, 0); !inherited.empty() && flags >= 0)
+    {
+        fcntl(serverSocket, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    ListenForConnections(serverSocket, options.backlog);
+    return serverSocket;
+}
+
+int CreateTcpSocket(const bool reusePort)
+{
+    const int socketFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketFd < 0)
+    {
+        std::cerr << "Socket creation failed: " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    int enable = 1;
+    if (setsockopt(socketFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+    {
+        std::cerr << "setsockopt(SO_REUSEADDR) failed\n";
+    }
+
+    if (reusePort && setsockopt(socketFd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+    {
+        std::cerr << "setsockopt(SO_REUSEPORT) failed: " << strerror(errno) << "\n";
+        close(socketFd);
+        exit(EXIT_FAILURE);
+    }
+
+    return socketFd;
+}
+
+void BindSocket(const int socketFd, const int port)
+{
+    sockaddr_in serverAddr{};
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = INADDR_ANY;
+    serverAddr.sin_port = htons(port);
+
+    if (bind(socketFd, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) < 0)
+    {
+        std::cerr << "Bind failed on port " << port << ": " << strerror(errno) << "\n";
+        close(socketFd);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void ListenForConnections(const int socketFd, const int backlog)
+{
+    if (listen(socketFd, backlog) < 0)
+    {
+        std::cerr << "Listen failed: " << strerror(errno) << "\n";
+        close(socketFd);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void SetNonBlocking(const int socketFd)
+{
+    const int flags = fcntl(socketFd, F_GETFL, 0);
+    if (flags < 0 || fcntl(socketFd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        std::cerr << "fcntl(O_NONBLOCK) failed: " << strerror(errno) << "\n";
+        close(socketFd);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int CreateEpoll(const int serverSocket)
+{
+    const int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0)
+    {
+        std::cerr << "epoll_create1 failed: " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = serverSocket;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, serverSocket, &event) < 0)
+    {
+        std::cerr << "epoll_ctl(listen socket) failed: " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    return epollFd;
+}
+
+void RunEventLoop(const int epollFd, const int serverSocket)
+{
+    std::unordered_map<int, Connection> connections;
+    epoll_event events[MAX_EPOLL_EVENTS];
+    bool accepting = true;
+    bool drained = false;
+
+    while (true)
+    {
+        const int readyCount = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, TIMER_WHEEL_TICK.count());
+        if (readyCount < 0 && errno != EINTR)
+        {
+            std::cerr << "epoll_wait failed: " << strerror(errno) << "\n";
+        }
+        CloseExpiredConnections(epollFd, connections);
+        if (accepting && g_handoff.draining.load(std::memory_order_acquire))
+        {
+            accepting = false;
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, serverSocket, nullptr);
+            close(serverSocket);
+            StopAccepting(g_handoff, g_fileCache);
+        }
+        if (!accepting && !drained && CloseIdleConnections(epollFd, connections))
+        {
+            drained = true;
+            ReportWorkerDrained(g_handoff);
+        }
+
+        for (int i = 0; i < readyCount; ++i)
+        {
+            const int fd = events[i].data.fd;
+            if (accepting && fd == serverSocket)
+            {
+                AcceptConnections(epollFd, serverSocket, connections);
+                continue;
+            }
+            if (fd == g_fileCache.inotifyFd)
+            {
+                HandleFileCacheEvents(g_fileCache);
+                continue;
+            }
+
+            const auto it = connections.find(fd);
+            if (it == connections.end())
+            {
+                continue;
+            }
+            Connection& connection = it->second;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                connection.state = ConnectionState::Closed;
+            }
+            if (connection.state == ConnectionState::Reading && events[i].events & (EPOLLIN | EPOLLRDHUP))
+            {
+                HandleReadable(connection);
+            }
+            if (connection.state == ConnectionState::Writing && events[i].events & EPOLLOUT)
+            {
+                HandleWritable(connection);
+                if (connection.state == ConnectionState::Reading)
+                {
+                    HandleReadable(connection);
+                }
+            }
+            if (connection.state == ConnectionState::Closed)
+            {
+                CloseConnection(epollFd, connections, fd);
+                continue;
+            }
+            UpdateConnectionTimer(g_timerWheel, connection);
+        }
+    }
+}
+
+void AcceptConnections(const int epollFd, const int serverSocket, std::unordered_map<int, Connection>& connections)
+{
+    while (true)
+    {
+        sockaddr_in clientAddr{};
+        socklen_t clientLen = sizeof(clientAddr);
+        const int clientSocket = accept4(serverSocket, reinterpret_cast<struct sockaddr*>(&clientAddr), &clientLen,
+                                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (clientSocket < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            std::cerr << "Accept failed: " << strerror(errno) << "\n";
+            return;
+        }
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = clientSocket;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0)
+        {
+            std::cerr << "epoll_ctl(client socket) failed: " << strerror(errno) << "\n";
+            close(clientSocket);
+            continue;
+        }
+
+        AddToCounter(g_workerMetrics.connectionsAccepted, 1);
+        Connection& connection = connections[clientSocket];
+        connection.fd = clientSocket;
+        connection.clientAddress = clientAddr.sin_addr;
+        connection.headerBuffer.reserve(BUFFER_SIZE);
+        connection.timer.fd = clientSocket;
+        UpdateConnectionTimer(g_timerWheel, connection);
+    }
+}
+
+void HandleReadable(Connection& connection)
+{
+    while (connection.state == ConnectionState::Reading)
+    {
+        ReadRequests(connection);
+        if (connection.state == ConnectionState::Closed)
+        {
+            return;
+        }
+
+        const bool bufferFull = connection.request.size() >= MAX_REQUEST_SIZE;
+        ProcessRequests(connection);
+        if (connection.responses.empty())
+        {
+            if (connection.http2 && bufferFull && connection.request.size() < MAX_REQUEST_SIZE)
+            {
+                continue;
+            }
+            if (!connection.keepAlive || connection.peerClosed)
+            {
+                connection.state = ConnectionState::Closed;
+            }
+            return;
+        }
+
+        connection.state = ConnectionState::Writing;
+        HandleWritable(connection);
+    }
+}
+
+void ReadRequests(Connection& connection)
+{
+    char buffer[BUFFER_SIZE];
+    while (connection.keepAlive && !connection.peerClosed && connection.request.size() < MAX_REQUEST_SIZE)
+    {
+        const ssize_t bytesRead = recv(connection.fd, buffer, sizeof(buffer), 0);
+        if (bytesRead > 0)
+        {
+            connection.lastActivity = std::chrono::steady_clock::now();
+            if (connection.request.empty())
+            {
+                connection.requestStarted = connection.lastActivity;
+            }
+            connection.request.append(buffer, bytesRead);
+            continue;
+        }
+        if (bytesRead == 0)
+        {
+            if (connection.request.empty() && connection.requestsServed == 0)
+            {
+                std::cout << "Client closed connection (no data)\n";
+            }
+            connection.peerClosed = true;
+            return;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return;
+        }
+        std::cerr << "Read error: " << strerror(errno) << "\n";
+        connection.state = ConnectionState::Closed;
+        return;
+    }
+}
+
+void HandleWritable(Connection& connection)
+{
+    while (!connection.responses.empty())
+    {
+        PendingResponse& front = connection.responses.front();
+        ssize_t bytesWritten;
+        if (PendingBufferBytes(front) > 0)
+        {
+            bytesWritten = SendQueuedBuffers(connection);
+        }
+        else
+        {
+            bytesWritten = sendfile(connection.fd, front.fileFd, &front.fileOffset, front.fileRemaining);
+            if (bytesWritten == 0)
+            {
+                std::cerr << "sendfile: file was truncated while sending\n";
+                connection.state = ConnectionState::Closed;
+                return;
+            }
+            if (bytesWritten > 0)
+            {
+                front.fileRemaining -= bytesWritten;
+                AddToCounter(g_workerMetrics.bytesSent, bytesWritten);
+            }
+        }
+
+        if (bytesWritten < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            std::cerr << "Write error: " << strerror(errno) << "\n";
+            connection.state = ConnectionState::Closed;
+            return;
+        }
+
+        connection.lastActivity = std::chrono::steady_clock::now();
+        ReleaseFinishedResponses(connection);
+    }
+
+    connection.state = connection.keepAlive ? ConnectionState::Reading : ConnectionState::Closed;
+}
+
+ssize_t SendQueuedBuffers(Connection& connection)
+{
+    iovec iov[MAX_RESPONSE_IOVECS];
+    bool fileFollows = false;
+    msghdr message{};
+    message.msg_iov = iov;
+    message.msg_iovlen = CollectResponseIovecs(connection, iov, fileFollows);
+    const ssize_t bytesWritten = sendmsg(connection.fd, &message, MSG_NOSIGNAL | (fileFollows ? MSG_MORE : 0));
+    if (bytesWritten > 0)
+    {
+        AdvanceSentBuffers(connection, bytesWritten);
+    }
+    return bytesWritten;
+}
+
+int CollectResponseIovecs(const Connection& connection, iovec* iov, bool& fileFollows)
+{
+    int iovCount = 0;
+    fileFollows = false;
+    for (const PendingResponse& response : connection.responses)
+    {
+        if (iovCount + 2 > MAX_RESPONSE_IOVECS)
+        {
+            break;
+        }
+        if (response.bytesSent < response.headerLength)
+        {
+            iov[iovCount].iov_base = const_cast<char*>(connection.headerBuffer.data()) + response.headerOffset
+                                     + response.bytesSent;
+            iov[iovCount].iov_len = response.headerLength - response.bytesSent;
+            ++iovCount;
+        }
+        if (const std::string_view body = ResponseBody(response); !body.empty())
+        {
+            const size_t bodySent = response.bytesSent > response.headerLength
+                                        ? response.bytesSent - response.headerLength
+                                        : 0;
+            iov[iovCount].iov_base = const_cast<char*>(body.data()) + bodySent;
+            iov[iovCount].iov_len = body.size() - bodySent;
+            ++iovCount;
+        }
+        if (response.fileRemaining > 0)
+        {
+            fileFollows = true;
+            break;
+        }
+    }
+    return iovCount;
+}
+
+void AdvanceSentBuffers(Connection& connection, const size_t bytesWritten)
+{
+    AddToCounter(g_workerMetrics.bytesSent, bytesWritten);
+    size_t remaining = bytesWritten;
+    for (PendingResponse& response : connection.responses)
+    {
+        const size_t chunk = std::min(remaining, PendingBufferBytes(response));
+        response.bytesSent += chunk;
+        remaining -= chunk;
+        if (remaining == 0)
+        {
+            break;
+        }
+    }
+}
+
+void ReleaseFinishedResponses(Connection& connection)
+{
+    while (!connection.responses.empty() && PendingBufferBytes(connection.responses.front()) == 0
+           && connection.responses.front().fileRemaining == 0)
+    {
+        if (const PendingResponse& front = connection.responses.front(); front.statusCode > 0)
+        {
+            AddToCounter(g_workerMetrics.responsesByStatus[front.statusCode], 1);
+            ObserveLatency(g_workerMetrics.sendLatency, std::chrono::steady_clock::now() - front.queuedAt);
+        }
+        ReleaseResponse(connection.responses.front());
+        connection.responses.pop_front();
+    }
+    if (connection.responses.empty())
+    {
+        connection.headerBuffer.clear();
+    }
+}
+
+size_t PendingBufferBytes(const PendingResponse& response)
+{
+    const size_t total = response.headerLength + ResponseBody(response).size();
+    return total - response.bytesSent;
+}
+
+void ReleaseResponse(PendingResponse& response)
+{
+    if (response.fileFd >= 0 && response.ownsFile)
+    {
+        close(response.fileFd);
+        response.fileFd = -1;
+    }
+}
+
+void CloseConnection(const int epollFd, std::unordered_map<int, Connection>& connections, const int clientFd)
+{
+    Connection& connection = connections[clientFd];
+    CancelTimer(connection.timer);
+    for (PendingResponse& response : connection.responses)
+    {
+        ReleaseResponse(response);
+    }
+    ReleaseHttp2Session(connection);
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, clientFd, nullptr);
+    close(clientFd);
+    connections.erase(clientFd);
+    AddToCounter(g_workerMetrics.connectionsClosed, 1);
+}
+
+void CloseExpiredConnections(const int epollFd, std::unordered_map<int, Connection>& connections)
+{
+    thread_local std::vector<int> expiredFds;
+    ExpireTimers(g_timerWheel, expiredFds);
+    for (const int fd : expiredFds)
+    {
+        CloseConnection(epollFd, connections, fd);
+    }
+}
+
+bool CloseIdleConnections(const int epollFd, std::unordered_map<int, Connection>& connections)
+{
+    thread_local std::vector<int> idleFds;
+    idleFds.clear();
+    for (const auto& [fd, connection] : connections)
+    {
+        if (IsConnectionIdle(connection))
+        {
+            SendHttp2GoAway(connection);
+            idleFds.push_back(fd);
+        }
+    }
+    for (const int fd : idleFds)
+    {
+        CloseConnection(epollFd, connections, fd);
+    }
+    return connections.empty();
+}
+
+bool IsConnectionIdle(const Connection& connection)
+{
+    if (connection.state != ConnectionState::Reading || !connection.responses.empty() || !connection.request.empty())
+    {
+        return false;
+    }
+    return connection.http2 ? connection.http2->streams.empty() : connection.requestsServed > 0;
+}
+
+void InitTimerWheel(TimerWheel& wheel)
+{
+    for (auto& level : wheel.slots)
+    {
+        for (TimerNode& head : level)
+        {
+            head.prev = &head;
+            head.next = &head;
+        }
+    }
+    wheel.start = std::chrono::steady_clock::now();
+    wheel.currentTick = 0;
+}
+
+uint64_t TimerTick(const TimerWheel& wheel, const std::chrono::steady_clock::time_point time)
+{
+    return time <= wheel.start ? 0 : static_cast<uint64_t>((time - wheel.start) / TIMER_WHEEL_TICK);
+}
+
+void ArmTimer(TimerWheel& wheel, TimerNode& node, const uint64_t expiryTick)
+{
+    CancelTimer(node);
+    node.expiryTick = expiryTick;
+    LinkTimer(wheel, node);
+}
+
+void LinkTimer(TimerWheel& wheel, TimerNode& node)
+{
+    constexpr uint64_t WHEEL_SPAN = uint64_t{1} << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS);
+    node.expiryTick = std::clamp(node.expiryTick, wheel.currentTick + 1, wheel.currentTick + WHEEL_SPAN - 1);
+
+    size_t level = 0;
+    while ((node.expiryTick >> (TIMER_WHEEL_SLOT_BITS * (level + 1)))
+           != (wheel.currentTick >> (TIMER_WHEEL_SLOT_BITS * (level + 1))))
+    {
+        ++level;
+    }
+    TimerNode& head = TimerSlot(wheel, level, node.expiryTick);
+    node.prev = head.prev;
+    node.next = &head;
+    head.prev->next = &node;
+    head.prev = &node;
+}
+
+TimerNode& TimerSlot(TimerWheel& wheel, const size_t level, const uint64_t tick)
+{
+    return wheel.slots[level][(tick >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+}
+
+void CancelTimer(TimerNode& node)
+{
+    if (node.next == nullptr)
+    {
+        return;
+    }
+    node.prev->next = node.next;
+    node.next->prev = node.prev;
+    node.prev = nullptr;
+    node.next = nullptr;
+}
+
+void ExpireTimers(TimerWheel& wheel, std::vector<int>& expiredFds)
+{
+    expiredFds.clear();
+    const uint64_t targetTick = TimerTick(wheel, std::chrono::steady_clock::now());
+    while (wheel.currentTick < targetTick)
+    {
+        ++wheel.currentTick;
+        for (size_t level = TIMER_WHEEL_LEVELS - 1; level > 0; --level)
+        {
+            if ((wheel.currentTick & ((uint64_t{1} << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) == 0)
+            {
+                CascadeTimerSlot(wheel, level);
+            }
+        }
+
+        TimerNode& head = TimerSlot(wheel, 0, wheel.currentTick);
+        while (head.next != &head)
+        {
+            TimerNode& node = *head.next;
+            CancelTimer(node);
+            expiredFds.push_back(node.fd);
+        }
+    }
+}
+
+void CascadeTimerSlot(TimerWheel& wheel, const size_t level)
+{
+    TimerNode& head = TimerSlot(wheel, level, wheel.currentTick);
+    while (head.next != &head)
+    {
+        TimerNode& node = *head.next;
+        CancelTimer(node);
+        LinkTimer(wheel, node);
+    }
+}
+
+void UpdateConnectionTimer(TimerWheel& wheel, Connection& connection)
+{
+    const auto deadline = ConnectionDeadline(connection);
+    const uint64_t expiryTick = TimerTick(wheel, deadline + TIMER_WHEEL_TICK - std::chrono::nanoseconds(1));
+    if (connection.timer.next == nullptr || connection.timer.expiryTick != expiryTick)
+    {
+        ArmTimer(wheel, connection.timer, expiryTick);
+    }
+}
+
+std::chrono::steady_clock::time_point ConnectionDeadline(const Connection& connection)
+{
+    if (connection.http2 && connection.responses.empty())
+    {
+        return connection.lastActivity + (connection.http2->streams.empty() ? KEEP_ALIVE_TIMEOUT : WRITE_TIMEOUT);
+    }
+    if (!connection.responses.empty())
+    {
+        return connection.lastActivity + WRITE_TIMEOUT;
+    }
+    if (connection.bodyBytesToDiscard > 0)
+    {
+        return connection.lastActivity + BODY_READ_TIMEOUT;
+    }
+    if (!connection.request.empty() || connection.requestsServed == 0)
+    {
+        return connection.requestStarted + HEADER_READ_TIMEOUT;
+    }
+    return connection.lastActivity + KEEP_ALIVE_TIMEOUT;
+}
+
+bool SetupIoUring(IoUring& ring, const unsigned entries)
+{
+    io_uring_params params{};
+    ring.fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ring.fd < 0)
+    {
+        return false;
+    }
+    if (!ProbeUringOperations(ring.fd))
+    {
+        close(ring.fd);
+        errno = EOPNOTSUPP;
+        return false;
+    }
+
+    size_t sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+    {
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+
+    auto* sqRing = static_cast<char*>(mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           ring.fd, IORING_OFF_SQ_RING));
+    auto* cqRing = singleMmap ? sqRing
+                              : static_cast<char*>(mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                                                        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING));
+    auto* sqes = mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(ring.fd);
+        return false;
+    }
+
+    ring.entries = params.sq_entries;
+    ring.sqHead = reinterpret_cast<unsigned*>(sqRing + params.sq_off.head);
+    ring.sqTail = reinterpret_cast<unsigned*>(sqRing + params.sq_off.tail);
+    ring.sqMask = *reinterpret_cast<unsigned*>(sqRing + params.sq_off.ring_mask);
+    ring.sqArray = reinterpret_cast<unsigned*>(sqRing + params.sq_off.array);
+    ring.sqes = static_cast<io_uring_sqe*>(sqes);
+    ring.cqHead = reinterpret_cast<unsigned*>(cqRing + params.cq_off.head);
+    ring.cqTail = reinterpret_cast<unsigned*>(cqRing + params.cq_off.tail);
+    ring.cqMask = *reinterpret_cast<unsigned*>(cqRing + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<io_uring_cqe*>(cqRing + params.cq_off.cqes);
+    return true;
+}
+
+bool ProbeUringOperations(const int ringFd)
+{
+    constexpr unsigned PROBE_OPS = 256;
+    const auto buffer = std::make_unique<char[]>(sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op));
+    std::memset(buffer.get(), 0, sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op));
+    auto* probe = reinterpret_cast<io_uring_probe*>(buffer.get());
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, PROBE_OPS) < 0)
+    {
+        return false;
+    }
+
+    for (const int operation : {IORING_OP_ACCEPT, IORING_OP_READ_FIXED, IORING_OP_READ, IORING_OP_SENDMSG,
+                                IORING_OP_SPLICE, IORING_OP_TIMEOUT, IORING_OP_POLL_ADD,
+                                IORING_OP_ASYNC_CANCEL})
+    {
+        if (operation > probe->last_op || !(probe->ops[operation].flags & IO_URING_OP_SUPPORTED))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void RegisterUringBuffers(IoUring& ring)
+{
+    ring.bufferPool = std::make_unique<char[]>(URING_FIXED_BUFFER_COUNT * BUFFER_SIZE);
+    std::vector<iovec> buffers(URING_FIXED_BUFFER_COUNT);
+    for (size_t i = 0; i < URING_FIXED_BUFFER_COUNT; ++i)
+    {
+        buffers[i].iov_base = ring.bufferPool.get() + i * BUFFER_SIZE;
+        buffers[i].iov_len = BUFFER_SIZE;
+    }
+
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) < 0)
+    {
+        std::cerr << "io_uring buffer registration failed, using unregistered reads: " << strerror(errno) << "\n";
+        ring.bufferPool.reset();
+        return;
+    }
+
+    for (size_t i = URING_FIXED_BUFFER_COUNT; i > 0; --i)
+    {
+        ring.freeBuffers.push_back(static_cast<int>(i - 1));
+    }
+}
+
+io_uring_sqe* GetSubmissionEntry(IoUring& ring, const UringOperation operation, const int fd)
+{
+    const unsigned tail = *ring.sqTail;
+    if (tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) >= ring.entries)
+    {
+        SubmitAndWait(ring, 0);
+    }
+
+    io_uring_sqe* sqe = &ring.sqes[tail & ring.sqMask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->user_data = static_cast<uint64_t>(operation) << 32 | static_cast<uint32_t>(fd);
+    ring.sqArray[tail & ring.sqMask] = tail & ring.sqMask;
+    __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++ring.pendingSubmissions;
+    return sqe;
+}
+
+int SubmitAndWait(IoUring& ring, const unsigned waitCount)
+{
+    const auto submitted = static_cast<int>(syscall(__NR_io_uring_enter, ring.fd, ring.pendingSubmissions, waitCount,
+                                                    waitCount > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+    if (submitted > 0)
+    {
+        ring.pendingSubmissions -= submitted;
+    }
+    return submitted;
+}
+
+void RunUringEventLoop(IoUring& ring, const int serverSocket)
+{
+    std::unordered_map<int, UringConnection> connections;
+    bool drained = false;
+    ArmUringAccept(ring, serverSocket);
+    ArmUringTick(ring);
+    ArmUringFileEvents(ring);
+
+    while (true)
+    {
+        if (SubmitAndWait(ring, 1) < 0 && errno != EINTR)
+        {
+            std::cerr << "io_uring_enter failed: " << strerror(errno) << "\n";
+        }
+
+        const unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (unsigned head = *ring.cqHead; head != tail; ++head)
+        {
+            const io_uring_cqe cqe = ring.cqes[head & ring.cqMask];
+            __atomic_store_n(ring.cqHead, head + 1, __ATOMIC_RELEASE);
+
+            const auto operation = static_cast<UringOperation>(cqe.user_data >> 32);
+            const auto fd = static_cast<int>(cqe.user_data & 0xffffffff);
+            if (operation == UringOperation::Accept)
+            {
+                AcceptUringConnection(ring, serverSocket, cqe, connections);
+                continue;
+            }
+            if (operation == UringOperation::Tick)
+            {
+                ShutdownExpiredUringConnections(connections);
+                if (ring.accepting && g_handoff.draining.load(std::memory_order_acquire))
+                {
+                    ring.accepting = false;
+                    CancelUringAccept(ring, serverSocket);
+                    StopAccepting(g_handoff, g_fileCache);
+                }
+                if (!ring.accepting && !drained && ShutdownIdleUringConnections(connections))
+                {
+                    drained = true;
+                    ReportWorkerDrained(g_handoff);
+                }
+                ArmUringTick(ring);
+                continue;
+            }
+            if (operation == UringOperation::FileEvents)
+            {
+                HandleFileCacheEvents(g_fileCache);
+                ArmUringFileEvents(ring);
+                continue;
+            }
+            if (operation == UringOperation::Cancel)
+            {
+                continue;
+            }
+
+            const auto it = connections.find(fd);
+            if (it == connections.end())
+            {
+                continue;
+            }
+            CompleteUringOperation(ring, it->second, operation, cqe.res);
+            if (it->second.operationsInFlight == 0)
+            {
+                AdvanceUringConnection(ring, connections, it->second);
+            }
+        }
+    }
+}
+
+void ArmUringAccept(IoUring& ring, const int serverSocket)
+{
+    io_uring_sqe* sqe = GetSubmissionEntry(ring, UringOperation::Accept, serverSocket);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = ring.multishotAccept ? IORING_ACCEPT_MULTISHOT : 0;
+}
+
+void CancelUringAccept(IoUring& ring, const int serverSocket)
+{
+    io_uring_sqe* sqe = GetSubmissionEntry(ring, UringOperation::Cancel, serverSocket);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = static_cast<uint64_t>(UringOperation::Accept) << 32 | static_cast<uint32_t>(serverSocket);
+}
+
+void ArmUringTick(IoUring& ring)
+{
+    io_uring_sqe* sqe = GetSubmissionEntry(ring, UringOperation::Tick, -1);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uint64_t>(&ring.tickInterval);
+    sqe->len = 1;
+}
+
+void ArmUringFileEvents(IoUring& ring)
+{
+    if (g_fileCache.inotifyFd < 0)
+    {
+        return;
+    }
+    io_uring_sqe* sqe = GetSubmissionEntry(ring, UringOperation::FileEvents, g_fileCache.inotifyFd);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = POLLIN;
+}
+
+void AcceptUringConnection(IoUring& ring, const int serverSocket, const io_uring_cqe& cqe,
+                           std::unordered_map<int, UringConnection>& connections)
+{
+    if (cqe.res == -EINVAL && ring.multishotAccept)
+    {
+        std::cerr << "Multishot accept is not supported, re-arming accept per connection\n";
+        ring.multishotAccept = false;
+    }
+    if (!(cqe.flags & IORING_CQE_F_MORE) && ring.accepting)
+    {
+        ArmUringAccept(ring, serverSocket);
+    }
+    else if (!(cqe.flags & IORING_CQE_F_MORE))
+    {
+        close(serverSocket);
+    }
+    if (cqe.res < 0)
+    {
+        if (cqe.res != -EINTR && cqe.res != -ECONNABORTED && cqe.res != -EAGAIN && cqe.res != -EINVAL
+            && cqe.res != -ECANCELED)
+        {
+            std::cerr << "Accept failed: " << strerror(-cqe.res) << "\n";
+        }
+        return;
+    }
+
+    const int clientSocket = cqe.res;
+    AddToCounter(g_workerMetrics.connectionsAccepted, 1);
+    UringConnection& uringConnection = connections[clientSocket];
+    uringConnection.connection.fd = clientSocket;
+    uringConnection.connection.timer.fd = clientSocket;
+    if (sockaddr_in clientAddr{}; g_accessLogRing)
+    {
+        socklen_t clientLen = sizeof(clientAddr);
+        if (getpeername(clientSocket, reinterpret_cast<struct sockaddr*>(&clientAddr), &clientLen) == 0)
+        {
+            uringConnection.connection.clientAddress = clientAddr.sin_addr;
+        }
+    }
+    uringConnection.connection.headerBuffer.reserve(BUFFER_SIZE);
+    if (!ring.freeBuffers.empty())
+    {
+        uringConnection.bufferIndex = ring.freeBuffers.back();
+        ring.freeBuffers.pop_back();
+    }
+    else
+    {
+        uringConnection.ownBuffer = std::make_unique<char[]>(BUFFER_SIZE);
+    }
+    AdvanceUringConnection(ring, connections, uringConnection);
+}
+
+void CompleteUringOperation(const IoUring& ring, UringConnection& uringConnection, const UringOperation operation,
+                            const int result)
+{
+    Connection& connection = uringConnection.connection;
+    --uringConnection.operationsInFlight;
+
+    if (operation == UringOperation::Read)
+    {
+        if (result > 0)
+        {
+            connection.lastActivity = std::chrono::steady_clock::now();
+            if (connection.request.empty())
+            {
+                connection.requestStarted = connection.lastActivity;
+            }
+            connection.request.append(UringReadBuffer(ring, uringConnection), result);
+        }
+        else if (result == 0 || result == -ECONNRESET)
+        {
+            connection.peerClosed = true;
+        }
+        else if (result != -EINTR && result != -EAGAIN)
+        {
+            std::cerr << "Read error: " << strerror(-result) << "\n";
+            connection.state = ConnectionState::Closed;
+        }
+        return;
+    }
+
+    if (operation == UringOperation::Send && result >= 0)
+    {
+        AdvanceSentBuffers(connection, result);
+    }
+    else if (operation == UringOperation::SpliceIn && result > 0)
+    {
+        PendingResponse& front = connection.responses.front();
+        front.fileOffset += result;
+        front.fileRemaining -= result;
+        uringConnection.pipeBytes += result;
+    }
+    else if (operation == UringOperation::SpliceIn && result == 0)
+    {
+        std::cerr << "splice: file was truncated while sending\n";
+        connection.state = ConnectionState::Closed;
+    }
+    else if (operation == UringOperation::SpliceOut && result > 0)
+    {
+        uringConnection.pipeBytes -= result;
+        AddToCounter(g_workerMetrics.bytesSent, result);
+    }
+    else if (result != -ECANCELED && result != -EINTR && result != -EAGAIN)
+    {
+        std::cerr << "Write error: " << strerror(result < 0 ? -result : EPIPE) << "\n";
+        connection.state = ConnectionState::Closed;
+        return;
+    }
+    connection.lastActivity = std::chrono::steady_clock::now();
+}
+
+void AdvanceUringConnection(IoUring& ring, std::unordered_map<int, UringConnection>& connections,
+                            UringConnection& uringConnection)
+{
+    Connection& connection = uringConnection.connection;
+    while (connection.state != ConnectionState::Closed)
+    {
+        if (connection.state == ConnectionState::Reading)
+        {
+            ProcessRequests(connection);
+            if (!connection.responses.empty())
+            {
+                connection.state = ConnectionState::Writing;
+                continue;
+            }
+            if (!connection.keepAlive || connection.peerClosed || connection.request.size() >= MAX_REQUEST_SIZE)
+            {
+                connection.state = ConnectionState::Closed;
+                break;
+            }
+            SubmitUringRead(ring, uringConnection);
+            UpdateConnectionTimer(g_timerWheel, connection);
+            return;
+        }
+
+        if (uringConnection.pipeBytes == 0)
+        {
+            ReleaseFinishedResponses(connection);
+        }
+        if (uringConnection.pipeBytes == 0 && connection.responses.empty())
+        {
+            connection.state = connection.keepAlive ? ConnectionState::Reading : ConnectionState::Closed;
+            continue;
+        }
+        if (uringConnection.pipeBytes == 0 && PendingBufferBytes(connection.responses.front()) > 0)
+        {
+            SubmitUringSend(ring, uringConnection);
+            UpdateConnectionTimer(g_timerWheel, connection);
+            return;
+        }
+        if (!SubmitUringSplice(ring, uringConnection))
+        {
+            connection.state = ConnectionState::Closed;
+            break;
+        }
+        UpdateConnectionTimer(g_timerWheel, connection);
+        return;
+    }
+
+    if (uringConnection.operationsInFlight == 0)
+    {
+        CloseUringConnection(ring, connections, connection.fd);
+    }
+}
+
+void SubmitUringRead(IoUring& ring, UringConnection& uringConnection)
+{
+    io_uring_sqe* sqe = GetSubmissionEntry(ring, UringOperation::Read, uringConnection.connection.fd);
+    sqe->opcode = uringConnection.bufferIndex >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->addr = reinterpret_cast<uint64_t>(UringReadBuffer(ring, uringConnection));
+    sqe->buf_index = static_cast<uint16_t>(std::max(uringConnection.bufferIndex, 0));
+    sqe->len = BUFFER_SIZE;
+    ++uringConnection.operationsInFlight;
+}
+
+char* UringReadBuffer(const IoUring& ring, const UringConnection& uringConnection)
+{
+    return uringConnection.bufferIndex >= 0 ? ring.bufferPool.get() + uringConnection.bufferIndex * BUFFER_SIZE
+                                            : uringConnection.ownBuffer.get();
+}
+
+void SubmitUringSend(IoUring& ring, UringConnection& uringConnection)
+{
+    bool fileFollows = false;
+    uringConnection.message = msghdr{};
+    uringConnection.message.msg_iov = uringConnection.iov;
+    uringConnection.message.msg_iovlen = CollectResponseIovecs(uringConnection.connection, uringConnection.iov,
+                                                               fileFollows);
+
+    io_uring_sqe* sqe = GetSubmissionEntry(ring, UringOperation::Send, uringConnection.connection.fd);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = reinterpret_cast<uint64_t>(&uringConnection.message);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | (fileFollows ? MSG_MORE : 0);
+    ++uringConnection.operationsInFlight;
+}
+
+bool SubmitUringSplice(IoUring& ring, UringConnection& uringConnection)
+{
+    if (uringConnection.pipeFds[0] < 0 && pipe2(uringConnection.pipeFds, O_CLOEXEC) < 0)
+    {
+        std::cerr << "pipe2 failed: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    PendingResponse& front = uringConnection.connection.responses.front();
+    size_t chunk = uringConnection.pipeBytes;
+    const bool moreFollows = uringConnection.connection.responses.size() > 1
+                             || front.fileRemaining > (chunk == 0 ? SPLICE_CHUNK_SIZE : 0);
+    if (chunk == 0)
+    {
+        chunk = std::min(front.fileRemaining, SPLICE_CHUNK_SIZE);
+
+        io_uring_sqe* fileToPipe = GetSubmissionEntry(ring, UringOperation::SpliceIn, uringConnection.connection.fd);
+        fileToPipe->opcode = IORING_OP_SPLICE;
+        fileToPipe->flags = IOSQE_IO_LINK;
+        fileToPipe->splice_fd_in = front.fileFd;
+        fileToPipe->splice_off_in = front.fileOffset;
+        fileToPipe->fd = uringConnection.pipeFds[1];
+        fileToPipe->off = static_cast<uint64_t>(-1);
+        fileToPipe->len = chunk;
+        fileToPipe->splice_flags = SPLICE_F_MOVE;
+        ++uringConnection.operationsInFlight;
+    }
+
+    io_uring_sqe* pipeToSocket = GetSubmissionEntry(ring, UringOperation::SpliceOut, uringConnection.connection.fd);
+    pipeToSocket->opcode = IORING_OP_SPLICE;
+    pipeToSocket->splice_fd_in = uringConnection.pipeFds[0];
+    pipeToSocket->splice_off_in = static_cast<uint64_t>(-1);
+    pipeToSocket->off = static_cast<uint64_t>(-1);
+    pipeToSocket->len = chunk;
+    pipeToSocket->splice_flags = SPLICE_F_MOVE | (moreFollows ? SPLICE_F_MORE : 0);
+    ++uringConnection.operationsInFlight;
+    return true;
+}
+
+void CloseUringConnection(IoUring& ring, std::unordered_map<int, UringConnection>& connections, const int clientFd)
+{
+    UringConnection& uringConnection = connections[clientFd];
+    CancelTimer(uringConnection.connection.timer);
+    for (PendingResponse& response : uringConnection.connection.responses)
+    {
+        ReleaseResponse(response);
+    }
+    ReleaseHttp2Session(uringConnection.connection);
+    for (const int pipeFd : uringConnection.pipeFds)
+    {
+        if (pipeFd >= 0)
+        {
+            close(pipeFd);
+        }
+    }
+    if (uringConnection.bufferIndex >= 0)
+    {
+        ring.freeBuffers.push_back(uringConnection.bufferIndex);
+    }
+    close(clientFd);
+    connections.erase(clientFd);
+    AddToCounter(g_workerMetrics.connectionsClosed, 1);
+}
+
+void ShutdownExpiredUringConnections(std::unordered_map<int, UringConnection>& connections)
+{
+    thread_local std::vector<int> expiredFds;
+    ExpireTimers(g_timerWheel, expiredFds);
+    for (const int fd : expiredFds)
+    {
+        if (const auto it = connections.find(fd); it != connections.end())
+        {
+            it->second.connection.state = ConnectionState::Closed;
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+}
+
+bool ShutdownIdleUringConnections(std::unordered_map<int, UringConnection>& connections)
+{
+    for (auto& [fd, uringConnection] : connections)
+    {
+        if (IsConnectionIdle(uringConnection.connection))
+        {
+            SendHttp2GoAway(uringConnection.connection);
+            uringConnection.connection.state = ConnectionState::Closed;
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    return connections.empty();
+}
+
+void ProcessRequests(Connection& connection)
+{
+    if (!connection.http2 && connection.requestsServed == 0
+        && HTTP2_PREFACE.starts_with(std::string_view(connection.request).substr(0, HTTP2_PREFACE.size())))
+    {
+        if (connection.request.size() < HTTP2_PREFACE.size())
+        {
+            return;
+        }
+        StartHttp2Session(connection);
+    }
+    if (connection.http2)
+    {
+        ProcessHttp2Frames(connection, *connection.http2);
+        return;
+    }
+
+    while (connection.keepAlive && connection.responses.size() < MAX_PIPELINED_RESPONSES)
+    {
+        if (connection.bodyBytesToDiscard > 0)
+        {
+            const size_t discarded = std::min(connection.bodyBytesToDiscard, connection.request.size());
+            connection.request.erase(0, discarded);
+            connection.bodyBytesToDiscard -= discarded;
+            if (connection.bodyBytesToDiscard > 0)
+            {
+                return;
+            }
+        }
+
+        const auto parseStart = std::chrono::steady_clock::now();
+        const ParseStatus status = ParseHttpRequest(connection.parser, connection.request, connection.parsedRequest);
+        connection.parseTime += std::chrono::steady_clock::now() - parseStart;
+        if (status == ParseStatus::Incomplete)
+        {
+            return;
+        }
+        ObserveLatency(g_workerMetrics.parseLatency, connection.parseTime);
+        connection.parseTime = {};
+        if (status == ParseStatus::Error)
+        {
+            connection.keepAlive = false;
+            QueueTextResponse(connection, connection.parser.errorStatus, ReasonPhrase(connection.parser.errorStatus));
+            connection.request.clear();
+            connection.parser = RequestParser{};
+            return;
+        }
+
+        const HttpRequest& request = connection.parsedRequest;
+        ++connection.requestsServed;
+        connection.keepAlive = IsKeepAliveRequested(request) && connection.requestsServed < MAX_KEEP_ALIVE_REQUESTS
+                               && !g_handoff.draining.load(std::memory_order_relaxed);
+        if (IsHttp2UpgradeRequest(request) && UpgradeToHttp2(connection, request))
+        {
+            ProcessHttp2Frames(connection, *connection.http2);
+            return;
+        }
+
+        const std::string_view contentLength = FindHeaderValue(request, "Content-Length");
+        if (!FindHeaderValue(request, "Transfer-Encoding").empty())
+        {
+            connection.keepAlive = false;
+        }
+        else if (!contentLength.empty() && !ParseSize(contentLength, connection.bodyBytesToDiscard))
+        {
+            connection.keepAlive = false;
+        }
+
+        const size_t responsesBefore = connection.responses.size();
+        HandleClientConnection(connection, request);
+        if (g_accessLogRing && connection.responses.size() > responsesBefore)
+        {
+            LogAccess(*g_accessLogRing, connection, request, connection.responses[responsesBefore]);
+        }
+        connection.request.erase(0, request.length);
+        connection.requestStarted = connection.lastActivity;
+        connection.parser = RequestParser{};
+    }
+}
+
+ParseStatus ParseHttpRequest(RequestParser& parser, const std::string_view buffer, HttpRequest& request)
+{
+    while (parser.stage != ParseStage::Done)
+    {
+        const size_t newline = buffer.find('\n', parser.scanOffset);
+        if (newline == std::string_view::npos)
+        {
+            parser.scanOffset = buffer.size();
+            if (parser.stage == ParseStage::RequestLine && buffer.size() - parser.lineStart > MAX_REQUEST_LINE_SIZE)
+            {
+                return FailParse(parser, 414);
+            }
+            if (buffer.size() >= MAX_REQUEST_SIZE)
+            {
+                return FailParse(parser, 431);
+            }
+            return ParseStatus::Incomplete;
+        }
+
+        const size_t lineOffset = parser.lineStart;
+        size_t lineEnd = newline;
+        if (lineEnd > lineOffset && buffer[lineEnd - 1] == '\r')
+        {
+            --lineEnd;
+        }
+        const std::string_view line = buffer.substr(lineOffset, lineEnd - lineOffset);
+        parser.lineStart = parser.scanOffset = newline + 1;
+        if (parser.lineStart > MAX_REQUEST_SIZE)
+        {
+            return FailParse(parser, 431);
+        }
+
+        if (parser.stage == ParseStage::RequestLine)
+        {
+            if (line.empty())
+            {
+                continue;
+            }
+            if (line.size() > MAX_REQUEST_LINE_SIZE)
+            {
+                return FailParse(parser, 414);
+            }
+            if (!ParseRequestLine(parser, line, lineOffset))
+            {
+                return FailParse(parser, 400);
+            }
+            parser.stage = ParseStage::Headers;
+        }
+        else if (line.empty())
+        {
+            parser.stage = ParseStage::Done;
+        }
+        else if (parser.headerCount == MAX_HEADER_COUNT)
+        {
+            return FailParse(parser, 431);
+        }
+        else if (!ParseHeaderLine(parser, line, lineOffset))
+        {
+            return FailParse(parser, 400);
+        }
+    }
+
+    const auto spanText = [buffer](const TextSpan span) { return buffer.substr(span.offset, span.length); };
+    request.method = spanText(parser.method);
+    request.target = spanText(parser.target);
+    request.version = spanText(parser.version);
+    request.headerCount = parser.headerCount;
+    for (size_t i = 0; i < parser.headerCount; ++i)
+    {
+        request.headers[i].name = spanText(parser.headerNames[i]);
+        request.headers[i].value = spanText(parser.headerValues[i]);
+    }
+    request.length = parser.lineStart;
+    return ParseStatus::Complete;
+}
+
+ParseStatus FailParse(RequestParser& parser, const int statusCode)
+{
+    parser.errorStatus = statusCode;
+    return ParseStatus::Error;
+}
+
+bool ParseRequestLine(RequestParser& parser, const std::string_view line, const size_t lineOffset)
+{
+    const size_t methodEnd = line.find(' ');
+    if (methodEnd == std::string_view::npos || methodEnd == 0)
+    {
+        return false;
+    }
+    const size_t targetEnd = line.find(' ', methodEnd + 1);
+    if (targetEnd == std::string_view::npos || targetEnd == methodEnd + 1)
+    {
+        return false;
+    }
+    const std::string_view version = line.substr(targetEnd + 1);
+    if (!version.starts_with("HTTP/1."))
+    {
+        return false;
+    }
+
+    const auto offset = static_cast<uint32_t>(lineOffset);
+    parser.method = {offset, static_cast<uint32_t>(methodEnd)};
+    parser.target = {offset + static_cast<uint32_t>(methodEnd + 1), static_cast<uint32_t>(targetEnd - methodEnd - 1)};
+    parser.version = {offset + static_cast<uint32_t>(targetEnd + 1), static_cast<uint32_t>(version.size())};
+    return true;
+}
+
+bool ParseHeaderLine(RequestParser& parser, const std::string_view line, const size_t lineOffset)
+{
+    const size_t colon = line.find(':');
+    if (colon == std::string_view::npos || colon == 0 || line[colon - 1] == ' ' || line[colon - 1] == '\t')
+    {
+        return false;
+    }
+
+    const std::string_view value = TrimWhitespace(line.substr(colon + 1));
+    const auto offset = static_cast<uint32_t>(lineOffset);
+    parser.headerNames[parser.headerCount] = {offset, static_cast<uint32_t>(colon)};
+    parser.headerValues[parser.headerCount] = {offset + static_cast<uint32_t>(value.data() - line.data()),
+                                               static_cast<uint32_t>(value.size())};
+    ++parser.headerCount;
+    return true;
+}
+
+std::string_view TrimWhitespace(std::string_view text)
+{
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+    {
+        text.remove_prefix(1);
+    }
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+    {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+bool ParseSize(const std::string_view text, size_t& value)
+{
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return !text.empty() && error == std::errc() && end == text.data() + text.size();
+}
+
+bool EqualsIgnoreCase(const std::string_view a, const std::string_view b)
+{
+    return a.size() == b.size()
+           && std::equal(a.begin(), a.end(), b.begin(), [](const unsigned char x, const unsigned char y) {
+               return std::tolower(x) == std::tolower(y);
+           });
+}
+
+bool HasHeaderToken(std::string_view value, const std::string_view token)
+{
+    while (!value.empty())
+    {
+        const size_t comma = value.find(',');
+        if (EqualsIgnoreCase(TrimWhitespace(value.substr(0, comma)), token))
+        {
+            return true;
+        }
+        if (comma == std::string_view::npos)
+        {
+            break;
+        }
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+std::string_view FindHeaderValue(const HttpRequest& request, const std::string_view name)
+{
+    for (size_t i = 0; i < request.headerCount; ++i)
+    {
+        if (EqualsIgnoreCase(request.headers[i].name, name))
+        {
+            return request.headers[i].value;
+        }
+    }
+    return {};
+}
+
+bool IsKeepAliveRequested(const HttpRequest& request)
+{
+    const std::string_view connectionHeader = FindHeaderValue(request, "Connection");
+    if (HasHeaderToken(connectionHeader, "close"))
+    {
+        return false;
+    }
+    return request.version == "HTTP/1.1" || HasHeaderToken(connectionHeader, "keep-alive");
+}
+
+std::string_view ExtractRequestedFile(const HttpRequest& request)
+{
+    if (request.method != "GET")
+    {
+        return {};
+    }
+
+    std::string_view path = request.target.substr(0, request.target.find('?'));
+    if (path.empty() || path[0] != '/')
+    {
+        return "index.html";
+    }
+
+    std::string_view filename = path.substr(1);
+    if (filename.empty())
+    {
+        filename = "index.html";
+    }
+
+    if (filename.find("..") != std::string_view::npos)
+    {
+        return {};
+    }
+
+    return filename;
+}
+
+std::string_view DetermineContentType(const std::string_view filename)
+{
+    const size_t dot = filename.rfind('.');
+    if (dot == std::string_view::npos || filename.find('/', dot) != std::string_view::npos)
+    {
+        return DEFAULT_CONTENT_TYPE;
+    }
+    const std::string_view type = LookupMimeType(g_mimeTable, filename.substr(dot + 1));
+    return type.empty() ? DEFAULT_CONTENT_TYPE : type;
+}
+
+std::string_view LookupMimeType(const MimeTable& table, const std::string_view extension)
+{
+    if (extension.empty() || extension.size() > MAX_EXTENSION_LENGTH)
+    {
+        return {};
+    }
+
+    char lowered[MAX_EXTENSION_LENGTH];
+    std::transform(extension.begin(), extension.end(), lowered, [](const unsigned char c) { return std::tolower(c); });
+    const std::string_view key(lowered, extension.size());
+
+    const uint32_t hash = HashExtension(key);
+    const uint32_t seed = table.seeds[hash % table.seeds.size()];
+    const MimeEntry& entry = table.slots[MimeSlot(hash, seed) & (table.slots.size() - 1)];
+    return entry.extension == key ? entry.type : std::string_view{};
+}
+
+void LoadMimeTypes(const std::string& path, LoadedMimeTypes& loaded, MimeTable& table)
+{
+    const int fileFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat fileStat{};
+    if (fileFd < 0 || fstat(fileFd, &fileStat) < 0
+        || !ReadWholeFile(fileFd, static_cast<size_t>(fileStat.st_size), loaded.text))
+    {
+        std::cerr << "Failed to read MIME types from " << path << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    close(fileFd);
+
+    std::unordered_map<std::string_view, std::string_view> types;
+    for (const MimeEntry& entry : DEFAULT_MIME_TYPES)
+    {
+        types[entry.extension] = entry.type;
+    }
+
+    std::transform(loaded.text.begin(), loaded.text.end(), loaded.text.begin(),
+                   [](const unsigned char c) { return c == '\t' || c == '\r' ? ' ' : c; });
+    std::string_view text = loaded.text;
+    while (!text.empty())
+    {
+        const size_t newline = text.find('\n');
+        std::string_view line = text.substr(0, newline);
+        text.remove_prefix(newline == std::string_view::npos ? text.size() : newline + 1);
+        line = TrimWhitespace(line.substr(0, line.find('#')));
+
+        const size_t space = line.find(' ');
+        if (space == std::string_view::npos)
+        {
+            continue;
+        }
+        const std::string_view type = line.substr(0, space);
+        for (line = TrimWhitespace(line.substr(space)); !line.empty(); line = TrimWhitespace(line))
+        {
+            const size_t end = std::min(line.find(' '), line.size());
+            const auto extension = const_cast<char*>(line.data());
+            std::transform(extension, extension + end, extension,
+                           [](const unsigned char c) { return std::tolower(c); });
+            if (end <= MAX_EXTENSION_LENGTH)
+            {
+                types[line.substr(0, end)] = type;
+            }
+            line.remove_prefix(end);
+        }
+    }
+
+    for (const auto& [extension, type] : types)
+    {
+        loaded.entries.push_back(MimeEntry{extension, type});
+    }
+    loaded.seeds.resize(loaded.entries.size() / 2 + 1);
+    loaded.slots.resize(std::bit_ceil(loaded.entries.size() * 2));
+    if (!BuildMimeTable(loaded.entries, loaded.seeds, loaded.slots))
+    {
+        std::cerr << "Failed to build MIME table from " << path << ", using built-in types\n";
+        return;
+    }
+
+    table = MimeTable{loaded.seeds, loaded.slots};
+    std::cout << "Loaded " << loaded.entries.size() << " MIME types from " << path << "\n";
+}
+
+std::string_view StatusLine(const int statusCode)
+{
+    switch (statusCode)
+    {
+    case 200:
+        return "HTTP/1.1 200 OK\r\n";
+    case 206:
+        return "HTTP/1.1 206 Partial Content\r\n";
+    case 304:
+        return "HTTP/1.1 304 Not Modified\r\n";
+    case 400:
+        return "HTTP/1.1 400 Bad Request\r\n";
+    case 404:
+        return "HTTP/1.1 404 Not Found\r\n";
+    case 414:
+        return "HTTP/1.1 414 URI Too Long\r\n";
+    case 416:
+        return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+    case 431:
+        return "HTTP/1.1 431 Request Header Fields Too Large\r\n";
+    default:
+        return "HTTP/1.1 500 Internal Server Error\r\n";
+    }
+}
+
+std::string_view ReasonPhrase(const int statusCode)
+{
+    std::string_view line = StatusLine(statusCode);
+    line.remove_prefix(std::string_view("HTTP/1.1 200 ").size());
+    line.remove_suffix(2);
+    return line;
+}
+
+void AppendStatusLine(std::string& out, const int statusCode)
+{
+    out += StatusLine(statusCode);
+    out += "Date: ";
+    out += CurrentHttpDate();
+    out += "\r\n";
+}
+
+void AppendFieldLines(std::string& out, const int statusCode, const std::string_view contentType,
+                      const size_t contentLength, const std::string_view extraHeaders)
+{
+    if (statusCode != 304)
+    {
+        char length[24];
+        const auto [end, error] = std::to_chars(length, length + sizeof(length), contentLength);
+        out += "Content-Type: ";
+        out += contentType;
+        out += "\r\nContent-Length: ";
+        out.append(length, end);
+        out += "\r\n";
+    }
+    out += extraHeaders;
+}
+
+void AppendHttpHeaders(std::string& out, const int statusCode, const std::string_view contentType,
+                       const size_t contentLength, const bool keepAlive, const std::string_view extraHeaders)
+{
+    AppendStatusLine(out, statusCode);
+    AppendFieldLines(out, statusCode, contentType, contentLength, extraHeaders);
+    AppendConnectionHeaders(out, keepAlive);
+}
+
+void AppendConnectionHeaders(std::string& out, const bool keepAlive)
+{
+    static const std::string KEEP_ALIVE_HEADERS = "Connection: keep-alive\r\nKeep-Alive: timeout="
+                                                  + std::to_string(KEEP_ALIVE_TIMEOUT.count())
+                                                  + ", max=" + std::to_string(MAX_KEEP_ALIVE_REQUESTS) + "\r\n\r\n";
+    out += keepAlive ? std::string_view(KEEP_ALIVE_HEADERS) : std::string_view("Connection: close\r\n\r\n");
+}
+
+PendingResponse& QueueResponse(Connection& connection, const std::string_view headers,
+                               std::shared_ptr<const std::string> body, const int fileFd, const size_t fileSize)
+{
+    PendingResponse& response = connection.responses.emplace_back();
+    response.headerOffset = connection.headerBuffer.size();
+    response.headerLength = headers.size();
+    connection.headerBuffer += headers;
+    response.body = std::move(body);
+    response.fileFd = fileFd;
+    response.fileRemaining = fileSize;
+    return response;
+}
+
+PendingResponse& QueueHttpResponse(Connection& connection, const int statusCode, const std::string_view contentType,
+                                   const size_t contentLength, const std::string_view extraHeaders,
+                                   std::shared_ptr<const std::string> body, const int fileFd)
+{
+    PendingResponse& response = connection.responses.emplace_back();
+    response.headerOffset = connection.headerBuffer.size();
+    AppendHttpHeaders(connection.headerBuffer, statusCode, contentType, contentLength, connection.keepAlive,
+                      extraHeaders);
+    response.headerLength = connection.headerBuffer.size() - response.headerOffset;
+    response.body = std::move(body);
+    response.fileFd = fileFd;
+    response.fileRemaining = fileFd >= 0 ? contentLength : 0;
+    response.statusCode = statusCode;
+    response.contentLength = statusCode == 304 ? 0 : contentLength;
+    response.queuedAt = std::chrono::steady_clock::now();
+    return response;
+}
+
+void QueueTextResponse(Connection& connection, const int statusCode, const std::string_view text,
+                       const std::string_view extraHeaders)
+{
+    PendingResponse& response = QueueHttpResponse(connection, statusCode, "text/plain", text.size(), extraHeaders);
+    connection.headerBuffer += text;
+    response.headerLength += text.size();
+}
+
+std::string_view CurrentHttpDate()
+{
+    thread_local time_t cachedSecond = -1;
+    thread_local char cachedDate[HTTP_DATE_BUFFER_SIZE];
+    if (const time_t now = time(nullptr); now != cachedSecond)
+    {
+        WriteHttpDate(now, cachedDate);
+        cachedSecond = now;
+    }
+    return cachedDate;
+}
+
+void WriteHttpDate(const time_t time, char* buffer)
+{
+    static constexpr const char* DAY_NAMES[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static constexpr const char* MONTH_NAMES[] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+
+    tm parts{};
+    gmtime_r(&time, &parts);
+    snprintf(buffer, HTTP_DATE_BUFFER_SIZE, "%s, %02d %s %04d %02d:%02d:%02d GMT", DAY_NAMES[parts.tm_wday],
+             parts.tm_mday, MONTH_NAMES[parts.tm_mon], parts.tm_year + 1900, parts.tm_hour, parts.tm_min,
+             parts.tm_sec);
+}
+
+std::string FormatHttpDate(const time_t time)
+{
+    char buffer[HTTP_DATE_BUFFER_SIZE];
+    WriteHttpDate(time, buffer);
+    return buffer;
+}
+
+bool ParseHttpDate(const std::string_view text, time_t& time)
+{
+    static constexpr std::string_view MONTH_NAMES = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    if (text.size() != 29 || text.substr(3, 2) != ", " || text.substr(25) != " GMT")
+    {
+        return false;
+    }
+
+    const auto parseNumber = [text](const size_t offset, const size_t length, int& value) {
+        const auto [end, error] = std::from_chars(text.data() + offset, text.data() + offset + length, value);
+        return error == std::errc() && end == text.data() + offset + length;
+    };
+
+    tm parts{};
+    const size_t month = MONTH_NAMES.find(text.substr(8, 3));
+    if (month == std::string_view::npos || month % 3 != 0 || !parseNumber(5, 2, parts.tm_mday)
+        || !parseNumber(12, 4, parts.tm_year) || !parseNumber(17, 2, parts.tm_hour)
+        || !parseNumber(20, 2, parts.tm_min) || !parseNumber(23, 2, parts.tm_sec))
+    {
+        return false;
+    }
+    parts.tm_mon = static_cast<int>(month / 3);
+    parts.tm_year -= 1900;
+    time = timegm(&parts);
+    return true;
+}
+
+FileValidators MakeFileValidators(const struct stat& fileStat, const std::string_view etagSuffix)
+{
+    char etag[80];
+    snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx%09lx", static_cast<unsigned long>(fileStat.st_ino),
+             static_cast<unsigned long>(fileStat.st_size), static_cast<unsigned long>(fileStat.st_mtim.tv_sec),
+             static_cast<unsigned long>(fileStat.st_mtim.tv_nsec));
+
+    FileValidators validators;
+    validators.etag = std::string(etag) + std::string(etagSuffix) + "\"";
+    validators.lastModified = FormatHttpDate(fileStat.st_mtime);
+    validators.modifiedTime = fileStat.st_mtime;
+    return validators;
+}
+
+std::string ValidatorHeaders(const FileValidators& validators)
+{
+    return "ETag: " + validators.etag + "\r\nLast-Modified: " + validators.lastModified + "\r\n";
+}
+
+bool EntityTagListMatches(std::string_view header, const std::string_view etag)
+{
+    while (!header.empty())
+    {
+        const size_t comma = header.find(',');
+        std::string_view candidate = TrimWhitespace(header.substr(0, comma));
+        header.remove_prefix(comma == std::string_view::npos ? header.size() : comma + 1);
+
+        if (candidate.starts_with("W/"))
+        {
+            candidate.remove_prefix(2);
+        }
+        if (candidate == "*" || candidate == etag)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool IsNotModified(const HttpRequest& request, const FileValidators& validators)
+{
+    return IsNotModified(request, validators.etag, validators.modifiedTime);
+}
+
+bool IsNotModified(const HttpRequest& request, const std::string_view etag, const time_t modifiedTime)
+{
+    if (const std::string_view ifNoneMatch = FindHeaderValue(request, "If-None-Match"); !ifNoneMatch.empty())
+    {
+        return EntityTagListMatches(ifNoneMatch, etag);
+    }
+
+    time_t since = 0;
+    const std::string_view ifModifiedSince = FindHeaderValue(request, "If-Modified-Since");
+    return !ifModifiedSince.empty() && ParseHttpDate(ifModifiedSince, since) && modifiedTime <= since;
+}
+
+void QueueNotModified(Connection& connection, const std::string_view headers)
+{
+    QueueHttpResponse(connection, 304, {}, 0, headers);
+}
+
+bool IsRangeApplicable(const HttpRequest& request, const FileValidators& validators)
+{
+    const std::string_view ifRange = FindHeaderValue(request, "If-Range");
+    return ifRange.empty() || ifRange == validators.etag || ifRange == validators.lastModified;
+}
+
+bool ParseByteRanges(std::string_view header, const size_t fileSize, std::vector<ByteRange>& ranges)
+{
+    if (!header.starts_with("bytes="))
+    {
+        return false;
+    }
+    header.remove_prefix(6);
+
+    while (!header.empty())
+    {
+        const size_t comma = header.find(',');
+        const std::string_view spec = TrimWhitespace(header.substr(0, comma));
+        header.remove_prefix(comma == std::string_view::npos ? header.size() : comma + 1);
+        if (spec.empty())
+        {
+            continue;
+        }
+
+        const size_t dash = spec.find('-');
+        if (dash == std::string_view::npos)
+        {
+            return false;
+        }
+
+        ByteRange range;
+        if (dash == 0)
+        {
+            size_t suffixLength = 0;
+            if (!ParseSize(spec.substr(1), suffixLength))
+            {
+                return false;
+            }
+            if (suffixLength == 0 || fileSize == 0)
+            {
+                continue;
+            }
+            range.first = fileSize > suffixLength ? fileSize - suffixLength : 0;
+            range.last = fileSize - 1;
+        }
+        else
+        {
+            if (!ParseSize(spec.substr(0, dash), range.first))
+            {
+                return false;
+            }
+            range.last = std::max(fileSize, range.first + 1) - 1;
+            if (dash + 1 < spec.size() && !ParseSize(spec.substr(dash + 1), range.last))
+            {
+                return false;
+            }
+            if (range.last < range.first)
+            {
+                return false;
+            }
+            if (range.first >= fileSize)
+            {
+                continue;
+            }
+            range.last = std::min(range.last, fileSize - 1);
+        }
+
+        ranges.push_back(range);
+        if (ranges.size() > MAX_BYTE_RANGES)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void SendRangeResponse(Connection& connection, const int fileFd, const size_t fileSize,
+                       const std::string_view contentType, const FileValidators& validators,
+                       const std::vector<ByteRange>& ranges)
+{
+    const std::string totalSize = std::to_string(fileSize);
+    const std::string rangeHeaders = "Accept-Ranges: bytes\r\n" + ValidatorHeaders(validators);
+    if (ranges.empty())
+    {
+        close(fileFd);
+        QueueTextResponse(connection, 416, "Range Not Satisfiable", "Content-Range: bytes */" + totalSize + "\r\n");
+        return;
+    }
+
+    const auto rangeText = [&totalSize](const ByteRange& range) {
+        return "bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + "/" + totalSize;
+    };
+
+    if (ranges.size() == 1)
+    {
+        const size_t length = ranges[0].last - ranges[0].first + 1;
+        PendingResponse& response = QueueHttpResponse(connection, 206, contentType, length,
+                                                      rangeHeaders + "Content-Range: " + rangeText(ranges[0]) + "\r\n",
+                                                      nullptr, fileFd);
+        response.fileOffset = static_cast<off_t>(ranges[0].first);
+        return;
+    }
+
+    std::vector<std::string> partHeaders;
+    const std::string closingBoundary = std::string("\r\n--") + MULTIPART_BOUNDARY + "--\r\n";
+    size_t contentLength = closingBoundary.size();
+    for (const ByteRange& range : ranges)
+    {
+        partHeaders.push_back(std::string("\r\n--") + MULTIPART_BOUNDARY + "\r\nContent-Type: "
+                              + std::string(contentType) + "\r\nContent-Range: " + rangeText(range) + "\r\n\r\n");
+        contentLength += partHeaders.back().size() + range.last - range.first + 1;
+    }
+
+    const std::string multipartType = std::string("multipart/byteranges; boundary=") + MULTIPART_BOUNDARY;
+    QueueHttpResponse(connection, 206, multipartType, contentLength, rangeHeaders);
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+        PendingResponse& part = QueueResponse(connection, partHeaders[i], nullptr, fileFd,
+                                              ranges[i].last - ranges[i].first + 1);
+        part.fileOffset = static_cast<off_t>(ranges[i].first);
+        part.ownsFile = i + 1 == ranges.size();
+    }
+    QueueResponse(connection, closingBoundary);
+}
+
+void InitFileCache(FileCache& cache, const int epollFd)
+{
+    cache.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache.inotifyFd < 0)
+    {
+        std::cerr << "inotify_init1 failed, file cache disabled: " << strerror(errno) << "\n";
+        return;
+    }
+    if (epollFd < 0)
+    {
+        return;
+    }
+
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = cache.inotifyFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, cache.inotifyFd, &event) < 0)
+    {
+        std::cerr << "epoll_ctl(inotify) failed, file cache disabled: " << strerror(errno) << "\n";
+        close(cache.inotifyFd);
+        cache.inotifyFd = -1;
+    }
+}
+
+FileCacheEntry* FindCachedFile(FileCache& cache, const std::string_view filename)
+{
+    const auto it = cache.entries.find(filename);
+    if (it == cache.entries.end())
+    {
+        return nullptr;
+    }
+    cache.lru.splice(cache.lru.begin(), cache.lru, it->second.lruPosition);
+    return &it->second;
+}
+
+std::shared_ptr<const CachedFile> LookupCachedFile(FileCache& cache, const std::string_view filename)
+{
+    const FileCacheEntry* entry = FindCachedFile(cache, filename);
+    return entry ? entry->file : nullptr;
+}
+
+std::shared_ptr<const CachedFile> CacheFileContents(FileCache& cache, const std::string& key,
+                                                   const std::string_view contentType,
+                                                   std::shared_ptr<const std::string> body,
+                                                   const FileValidators& validators, const std::string& extraHeaders)
+{
+    auto file = std::make_shared<CachedFile>();
+    file->notModifiedHeaders = ValidatorHeaders(validators) + extraHeaders;
+    AppendFieldLines(file->headers, 200, contentType, body->size(), file->notModifiedHeaders);
+    file->body = std::move(body);
+    file->validators = validators;
+
+    const size_t entrySize = key.size() + file->headers.size() + file->notModifiedHeaders.size()
+                             + file->body->size();
+    if (cache.inotifyFd < 0 || entrySize > FILE_CACHE_BUDGET_BYTES)
+    {
+        return file;
+    }
+
+    InvalidateCachedFile(cache, key);
+    while (cache.usedBytes + entrySize > FILE_CACHE_BUDGET_BYTES && !cache.lru.empty())
+    {
+        InvalidateCachedFile(cache, cache.lru.back());
+    }
+
+    cache.lru.push_front(key);
+    FileCacheEntry& entry = cache.entries[key];
+    entry.file = file;
+    entry.lruPosition = cache.lru.begin();
+    entry.size = entrySize;
+    cache.usedBytes += entrySize;
+    return file;
+}
+
+void QueueCachedFile(Connection& connection, const HttpRequest& request, const CachedFile& file)
+{
+    if (IsNotModified(request, file.validators))
+    {
+        QueueNotModified(connection, file.notModifiedHeaders);
+        return;
+    }
+
+    const size_t headerOffset = connection.headerBuffer.size();
+    AppendStatusLine(connection.headerBuffer, 200);
+    connection.headerBuffer += file.headers;
+    AppendConnectionHeaders(connection.headerBuffer, connection.keepAlive);
+
+    PendingResponse& response = connection.responses.emplace_back();
+    response.headerOffset = headerOffset;
+    response.headerLength = connection.headerBuffer.size() - headerOffset;
+    response.body = file.body;
+    response.statusCode = 200;
+    response.contentLength = file.body->size();
+    response.queuedAt = std::chrono::steady_clock::now();
+}
+
+void WatchCachedFileDirectory(FileCache& cache, const std::string& filename)
+{
+    if (cache.inotifyFd < 0)
+    {
+        return;
+    }
+
+    const size_t slash = filename.rfind('/');
+    const std::string prefix = slash == std::string::npos ? "" : filename.substr(0, slash + 1);
+    if (cache.watchedPrefixes.contains(prefix))
+    {
+        return;
+    }
+    const std::string dirPath = std::string(DEFAULT_DOCUMENT_ROOT) + "/" + prefix;
+    const int wd = inotify_add_watch(cache.inotifyFd, dirPath.c_str(),
+                                     IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+                                     | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0)
+    {
+        if (errno == ENOENT)
+        {
+            return;
+        }
+        std::cerr << "inotify_add_watch(" << dirPath << ") failed: " << strerror(errno) << "\n";
+        return;
+    }
+    cache.watchedDirs[wd] = prefix;
+    cache.watchedPrefixes.insert(prefix);
+}
+
+void InvalidateCachedFile(FileCache& cache, const std::string& filename)
+{
+    const auto it = cache.entries.find(filename);
+    if (it == cache.entries.end())
+    {
+        return;
+    }
+    cache.usedBytes -= it->second.size;
+    cache.lru.erase(it->second.lruPosition);
+    cache.entries.erase(it);
+}
+
+void ClearFileCache(FileCache& cache)
+{
+    cache.entries.clear();
+    cache.lru.clear();
+    cache.usedBytes = 0;
+}
+
+void InvalidateFileVariants(FileCache& cache, const std::string& filename)
+{
+    std::string baseName = filename;
+    if (baseName.ends_with(".gz") || baseName.ends_with(".br"))
+    {
+        InvalidateCachedFile(cache, baseName);
+        baseName.resize(baseName.size() - 3);
+    }
+    InvalidateCachedFile(cache, baseName);
+    InvalidateCachedFile(cache, VariantKey(baseName, "gzip"));
+    InvalidateCachedFile(cache, VariantKey(baseName, "br"));
+    InvalidateCompressedVariant(g_compressedVariants, baseName);
+}
+
+void HandleFileCacheEvents(FileCache& cache)
+{
+    alignas(inotify_event) char buffer[BUFFER_SIZE];
+    while (true)
+    {
+        const ssize_t bytesRead = read(cache.inotifyFd, buffer, sizeof(buffer));
+        if (bytesRead <= 0)
+        {
+            if (bytesRead < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+
+        ++g_pathCache.generation;
+        for (ssize_t offset = 0; offset < bytesRead;)
+        {
+            const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+            offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+            if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            {
+                ClearFileCache(cache);
+                ClearCompressedVariants(g_compressedVariants);
+                if (const auto dir = cache.watchedDirs.find(event->wd);
+                    (event->mask & IN_IGNORED) && dir != cache.watchedDirs.end())
+                {
+                    cache.watchedPrefixes.erase(dir->second);
+                    cache.watchedDirs.erase(dir);
+                }
+                continue;
+            }
+
+            const auto dir = cache.watchedDirs.find(event->wd);
+            if (dir == cache.watchedDirs.end() || event->len == 0)
+            {
+                continue;
+            }
+            if (event->mask & IN_ISDIR)
+            {
+                ClearFileCache(cache);
+                ClearCompressedVariants(g_compressedVariants);
+                continue;
+            }
+            InvalidateFileVariants(cache, dir->second + event->name);
+        }
+    }
+}
+
+bool ReadWholeFile(const int fileFd, const size_t fileSize, std::string& contents)
+{
+    contents.resize(fileSize);
+    size_t offset = 0;
+    while (offset < fileSize)
+    {
+        const ssize_t bytesRead = pread(fileFd, contents.data() + offset, fileSize - offset,
+                                        static_cast<off_t>(offset));
+        if (bytesRead < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesRead <= 0)
+        {
+            return false;
+        }
+        offset += bytesRead;
+    }
+    return true;
+}
+
+void OpenDocumentRoot()
+{
+    g_documentRootFd = open(DEFAULT_DOCUMENT_ROOT, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (g_documentRootFd < 0)
+    {
+        std::cerr << "Failed to open document root " << DEFAULT_DOCUMENT_ROOT << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    const int probeFd = OpenBeneathDocumentRoot(".", O_PATH);
+    if (probeFd < 0 && errno == ENOSYS)
+    {
+        std::cerr << "openat2 is unavailable, resolving paths with openat\n";
+        g_openat2Supported = false;
+    }
+    if (probeFd >= 0)
+    {
+        close(probeFd);
+    }
+}
+
+int OpenBeneathDocumentRoot(const std::string& filename, const int flags)
+{
+    if (!g_openat2Supported)
+    {
+        return OpenComponentsBeneathDocumentRoot(filename, flags);
+    }
+
+    open_how how{};
+    how.flags = static_cast<uint64_t>(flags | O_CLOEXEC);
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    int fd;
+    do
+    {
+        fd = static_cast<int>(syscall(SYS_openat2, g_documentRootFd, filename.c_str(), &how, sizeof(how)));
+    } while (fd < 0 && (errno == EAGAIN || errno == EINTR));
+    return fd;
+}
+
+int OpenComponentsBeneathDocumentRoot(const std::string& filename, const int flags)
+{
+    // Without RESOLVE_BENEATH, walk the path one component at a time and refuse ".." and symlinks.
+    int dirFd = g_documentRootFd;
+    size_t start = 0;
+    while (true)
+    {
+        const size_t slash = filename.find('/', start);
+        const std::string component = filename.substr(start, slash == std::string::npos ? slash : slash - start);
+        int fd = -1;
+        if (component == "..")
+        {
+            errno = EXDEV;
+        }
+        else if (slash == std::string::npos)
+        {
+            fd = openat(dirFd, component.empty() ? "." : component.c_str(), flags | O_CLOEXEC | O_NOFOLLOW);
+        }
+        else if (component.empty() || component == ".")
+        {
+            start = slash + 1;
+            continue;
+        }
+        else
+        {
+            fd = openat(dirFd, component.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        }
+
+        if (dirFd != g_documentRootFd)
+        {
+            const int savedErrno = errno;
+            close(dirFd);
+            errno = savedErrno;
+        }
+        if (fd < 0 || slash == std::string::npos)
+        {
+            return fd;
+        }
+        dirFd = fd;
+        start = slash + 1;
+    }
+}
+
+const ResolvedPath* ResolvePath(PathCache& cache, const std::string_view filename)
+{
+    const auto now = std::chrono::steady_clock::now();
+    if (const auto it = cache.entries.find(filename); it != cache.entries.end())
+    {
+        const ResolvedPath& entry = it->second;
+        if (entry.generation == cache.generation && (entry.fd >= 0 || now - entry.resolvedAt < PATH_CACHE_NEGATIVE_TTL))
+        {
+            return entry.fd >= 0 ? &entry : nullptr;
+        }
+        if (entry.fd >= 0)
+        {
+            close(entry.fd);
+            --cache.openFiles;
+        }
+        cache.entries.erase(it);
+    }
+    if (g_fileCache.inotifyFd < 0 || cache.entries.size() >= PATH_CACHE_MAX_ENTRIES
+        || cache.openFiles >= PATH_CACHE_MAX_OPEN_FILES)
+    {
+        ClearPathCache(cache);
+    }
+
+    const std::string key(filename);
+    ResolvedPath resolved;
+    resolved.generation = cache.generation;
+    resolved.resolvedAt = now;
+    resolved.fd = OpenBeneathDocumentRoot(key, O_RDONLY);
+    if (resolved.fd >= 0 && (fstat(resolved.fd, &resolved.fileStat) < 0 || !S_ISREG(resolved.fileStat.st_mode)))
+    {
+        close(resolved.fd);
+        resolved.fd = -1;
+    }
+    if (resolved.fd >= 0)
+    {
+        WatchCachedFileDirectory(g_fileCache, key);
+    }
+    ObserveLatency(g_workerMetrics.fileOpenLatency, std::chrono::steady_clock::now() - now);
+
+    cache.openFiles += resolved.fd >= 0 ? 1 : 0;
+    const ResolvedPath& entry = cache.entries.emplace(key, resolved).first->second;
+    return entry.fd >= 0 ? &entry : nullptr;
+}
+
+void ClearPathCache(PathCache& cache)
+{
+    for (const auto& [filename, entry] : cache.entries)
+    {
+        if (entry.fd >= 0)
+        {
+            close(entry.fd);
+        }
+    }
+    cache.entries.clear();
+    cache.openFiles = 0;
+}
+
+void SendFileResponse(Connection& connection, const HttpRequest& request, const std::string_view filename,
+                      const ResolvedPath& resolved)
+{
+    const int fileFd = fcntl(resolved.fd, F_DUPFD_CLOEXEC, 0);
+    if (fileFd < 0)
+    {
+        std::cerr << "fcntl(F_DUPFD_CLOEXEC) failed: " << strerror(errno) << "\n";
+        QueueTextResponse(connection, 500, "Internal Server Error");
+        return;
+    }
+
+    const struct stat& fileStat = resolved.fileStat;
+    const auto fileSize = static_cast<size_t>(fileStat.st_size);
+    const std::string_view contentType = DetermineContentType(filename);
+    const FileValidators validators = MakeFileValidators(fileStat, "");
+    if (const std::string_view rangeHeader = FindHeaderValue(request, "Range");
+        !rangeHeader.empty() && !IsNotModified(request, validators) && IsRangeApplicable(request, validators))
+    {
+        if (std::vector<ByteRange> ranges; ParseByteRanges(rangeHeader, fileSize, ranges))
+        {
+            SendRangeResponse(connection, fileFd, fileSize, contentType, validators, ranges);
+            return;
+        }
+    }
+
+    if (std::string contents; fileSize <= MAX_CACHED_FILE_SIZE && ReadWholeFile(fileFd, fileSize, contents))
+    {
+        close(fileFd);
+        QueueCachedFile(connection, request,
+                        *CacheFileContents(g_fileCache, std::string(filename), contentType,
+                                           std::make_shared<const std::string>(std::move(contents)), validators,
+                                           IdentityExtraHeaders(contentType)));
+        return;
+    }
+
+    if (IsNotModified(request, validators))
+    {
+        close(fileFd);
+        QueueNotModified(connection, ValidatorHeaders(validators) + IdentityExtraHeaders(contentType));
+        return;
+    }
+
+    QueueHttpResponse(connection, 200, contentType, fileSize,
+                      ValidatorHeaders(validators) + IdentityExtraHeaders(contentType), nullptr, fileFd);
+    if (fileSize == 0)
+    {
+        close(fileFd);
+    }
+}
+
+void HandleClientConnection(Connection& connection, const HttpRequest& request)
+{
+    if (request.method == "GET" && request.target.substr(0, request.target.find('?')) == METRICS_PATH)
+    {
+        const auto body = std::make_shared<const std::string>(RenderMetrics(g_metricsRegistry));
+        QueueHttpResponse(connection, 200, METRICS_CONTENT_TYPE, body->size(), "Cache-Control: no-store\r\n", body);
+        return;
+    }
+
+    const std::string_view filename = ExtractRequestedFile(request);
+
+    if (filename.empty())
+    {
+        QueueTextResponse(connection, 404, "File Not Found");
+        return;
+    }
+
+    if (g_siteBundle.data)
+    {
+        SendBundleResponse(connection, request, filename);
+        return;
+    }
+
+    const bool hasRange = !FindHeaderValue(request, "Range").empty();
+    FileCacheEntry* identity = hasRange ? nullptr : FindCachedFile(g_fileCache, filename);
+    if (const std::string_view contentType = DetermineContentType(filename);
+        !hasRange && IsCompressibleType(contentType)
+        && SendCompressedVariant(connection, request, filename, contentType, identity))
+    {
+        return;
+    }
+
+    if (identity)
+    {
+        QueueCachedFile(connection, request, *identity->file);
+        return;
+    }
+
+    const ResolvedPath* resolved = ResolvePath(g_pathCache, filename);
+    if (!resolved)
+    {
+        QueueTextResponse(connection, 404, "File Not Found");
+        return;
+    }
+
+    SendFileResponse(connection, request, filename, *resolved);
+}
+
+bool IsCompressibleType(const std::string_view contentType)
+{
+    return contentType.starts_with("text/") || contentType == "application/javascript"
+           || contentType == "application/json" || contentType == "application/xml" || contentType.ends_with("+json")
+           || contentType.ends_with("+xml");
+}
+
+bool AcceptsEncoding(std::string_view acceptEncoding, const std::string_view coding)
+{
+    bool wildcardAccepted = false;
+    while (!acceptEncoding.empty())
+    {
+        const size_t comma = acceptEncoding.find(',');
+        std::string_view item = TrimWhitespace(acceptEncoding.substr(0, comma));
+        acceptEncoding.remove_prefix(comma == std::string_view::npos ? acceptEncoding.size() : comma + 1);
+
+        bool rejected = false;
+        if (const size_t semicolon = item.find(';'); semicolon != std::string_view::npos)
+        {
+            const std::string_view quality = TrimWhitespace(item.substr(semicolon + 1));
+            rejected = quality.starts_with("q=0") && quality.find_first_of("123456789", 3) == std::string_view::npos;
+            item = TrimWhitespace(item.substr(0, semicolon));
+        }
+
+        if (EqualsIgnoreCase(item, coding))
+        {
+            return !rejected;
+        }
+        if (item == "*")
+        {
+            wildcardAccepted = !rejected;
+        }
+    }
+    return wildcardAccepted;
+}
+
+std::string IdentityExtraHeaders(std::string_view contentType)
+{
+    return IsCompressibleType(contentType) ? "Accept-Ranges: bytes\r\nVary: Accept-Encoding\r\n"
+                                           : "Accept-Ranges: bytes\r\n";
+}
+
+std::string VariantKey(const std::string_view filename, const std::string_view coding)
+{
+    std::string key(filename);
+    key += VARIANT_KEY_SEPARATOR;
+    key += coding;
+    return key;
+}
+
+bool SendCompressedVariant(Connection& connection, const HttpRequest& request, const std::string_view filename,
+                           const std::string_view contentType, FileCacheEntry* identity)
+{
+    const std::string_view acceptEncoding = FindHeaderValue(request, "Accept-Encoding");
+
+    if (AcceptsEncoding(acceptEncoding, "br"))
+    {
+        const std::string key = VariantKey(filename, "br");
+        if (const auto cached = LookupCachedFile(g_fileCache, key))
+        {
+            QueueCachedFile(connection, request, *cached);
+            return true;
+        }
+        if (!identity || !identity->brotliUnavailable)
+        {
+            if (SendPrecompressedSibling(connection, request, key, std::string(filename) + ".br", contentType, "br"))
+            {
+                return true;
+            }
+            if (identity)
+            {
+                identity->brotliUnavailable = true;
+            }
+        }
+    }
+
+    if (!AcceptsEncoding(acceptEncoding, "gzip"))
+    {
+        return false;
+    }
+
+    const std::string key = VariantKey(filename, "gzip");
+    if (const auto cached = LookupCachedFile(g_fileCache, key))
+    {
+        QueueCachedFile(connection, request, *cached);
+        return true;
+    }
+
+    if (identity && identity->gzip == VariantState::Unavailable)
+    {
+        return false;
+    }
+
+    // While a compression is pending, the shared variant cache is polled at most once per interval.
+    const auto now = std::chrono::steady_clock::now();
+    const bool pending = identity && identity->gzip == VariantState::Pending;
+    if (pending && now - identity->gzipCheckedAt < COMPRESSION_RECHECK_INTERVAL)
+    {
+        return false;
+    }
+    if (const auto variant = LookupCompressedVariant(g_compressedVariants, filename))
+    {
+        WatchCachedFileDirectory(g_fileCache, std::string(filename));
+        QueueCachedFile(connection, request,
+                        *CacheFileContents(g_fileCache, key, contentType,
+                                           std::shared_ptr<const std::string>(variant, &variant->data),
+                                           variant->validators, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"));
+        return true;
+    }
+    if (!pending
+        && SendPrecompressedSibling(connection, request, key, std::string(filename) + ".gz", contentType, "gzip"))
+    {
+        return true;
+    }
+
+    if (identity)
+    {
+        identity->gzip = ScheduleCompression(g_compressedVariants, filename);
+        identity->gzipCheckedAt = now;
+    }
+    else if (ResolvePath(g_pathCache, filename))
+    {
+        ScheduleCompression(g_compressedVariants, filename);
+    }
+    return false;
+}
+
+bool SendPrecompressedSibling(Connection& connection, const HttpRequest& request, const std::string& variantKey,
+                              const std::string_view siblingName, const std::string_view contentType,
+                              const std::string_view coding)
+{
+    const ResolvedPath* resolved = ResolvePath(g_pathCache, siblingName);
+    const int fileFd = resolved ? fcntl(resolved->fd, F_DUPFD_CLOEXEC, 0) : -1;
+    if (fileFd < 0)
+    {
+        return false;
+    }
+
+    const struct stat& fileStat = resolved->fileStat;
+    const std::string extraHeaders = "Content-Encoding: " + std::string(coding) + "\r\nVary: Accept-Encoding\r\n";
+    const FileValidators validators = MakeFileValidators(fileStat, "-" + std::string(coding));
+    const auto fileSize = static_cast<size_t>(fileStat.st_size);
+    if (std::string contents; fileSize <= MAX_CACHED_FILE_SIZE && ReadWholeFile(fileFd, fileSize, contents))
+    {
+        close(fileFd);
+        QueueCachedFile(connection, request,
+                        *CacheFileContents(g_fileCache, variantKey, contentType,
+                                           std::make_shared<const std::string>(std::move(contents)), validators,
+                                           extraHeaders));
+        return true;
+    }
+
+    if (IsNotModified(request, validators))
+    {
+        close(fileFd);
+        QueueNotModified(connection, ValidatorHeaders(validators) + extraHeaders);
+        return true;
+    }
+
+    QueueHttpResponse(connection, 200, contentType, fileSize, ValidatorHeaders(validators) + extraHeaders, nullptr,
+                      fileFd);
+    if (fileSize == 0)
+    {
+        close(fileFd);
+    }
+    return true;
+}
+
+std::shared_ptr<const CompressedBody> LookupCompressedVariant(CompressedVariantCache& variants,
+                                                              const std::string_view filename)
+{
+    std::lock_guard lock(variants.mutex);
+    const auto it = variants.entries.find(filename);
+    if (it == variants.entries.end())
+    {
+        return nullptr;
+    }
+    variants.lru.splice(variants.lru.begin(), variants.lru, it->second.lruPosition);
+    return it->second.body;
+}
+
+VariantState ScheduleCompression(CompressedVariantCache& variants, const std::string_view filename)
+{
+    std::lock_guard lock(variants.mutex);
+    if (variants.unavailable.contains(filename))
+    {
+        return VariantState::Unavailable;
+    }
+    if (variants.attempted.size() >= MAX_COMPRESSION_ATTEMPTS)
+    {
+        // Forget files that turned out not to be worth compressing; cached and queued ones stay tracked.
+        variants.attempted.clear();
+        variants.unavailable.clear();
+        for (const auto& [name, variant] : variants.entries)
+        {
+            variants.attempted.insert(name);
+        }
+        for (const CompressionJob& queued : variants.jobs)
+        {
+            variants.attempted.insert(queued.filename);
+        }
+        if (variants.attempted.size() >= MAX_COMPRESSION_ATTEMPTS)
+        {
+            return VariantState::Pending;
+        }
+    }
+    if (variants.attempted.emplace(filename).second)
+    {
+        variants.jobs.push_back({std::string(filename), variants.generation});
+        variants.jobAvailable.notify_one();
+    }
+    return VariantState::Pending;
+}
+
+void RunCompressionWorker(CompressedVariantCache& variants)
+{
+    while (true)
+    {
+        CompressionJob job;
+        {
+            std::unique_lock lock(variants.mutex);
+            variants.jobAvailable.wait(lock, [&variants] { return !variants.jobs.empty(); });
+            job = std::move(variants.jobs.front());
+            variants.jobs.pop_front();
+        }
+
+        std::shared_ptr<const CompressedBody> body;
+        const bool readable = CompressFile(job.filename, body);
+
+        std::lock_guard lock(variants.mutex);
+        if (job.generation != variants.generation || !readable)
+        {
+            variants.attempted.erase(job.filename);
+            continue;
+        }
+        if (!body || body->data.size() > COMPRESSED_CACHE_BUDGET_BYTES)
+        {
+            variants.unavailable.insert(job.filename);
+            continue;
+        }
+        if (variants.entries.contains(job.filename))
+        {
+            continue;
+        }
+
+        while (variants.usedBytes + body->data.size() > COMPRESSED_CACHE_BUDGET_BYTES && !variants.lru.empty())
+        {
+            const auto victim = variants.entries.find(variants.lru.back());
+            variants.usedBytes -= victim->second.body->data.size();
+            variants.attempted.erase(victim->first);
+            variants.entries.erase(victim);
+            variants.lru.pop_back();
+        }
+
+        variants.lru.push_front(job.filename);
+        variants.usedBytes += body->data.size();
+        variants.entries[job.filename] = {std::move(body), variants.lru.begin()};
+    }
+}
+
+bool CompressFile(const std::string& filename, std::shared_ptr<const CompressedBody>& body)
+{
+    const int fileFd = OpenBeneathDocumentRoot(filename, O_RDONLY);
+    struct stat fileStat{};
+    if (fileFd < 0 || fstat(fileFd, &fileStat) < 0 || !S_ISREG(fileStat.st_mode))
+    {
+        if (fileFd >= 0)
+        {
+            close(fileFd);
+        }
+        return false;
+    }
+    if (static_cast<size_t>(fileStat.st_size) > MAX_COMPRESSIBLE_FILE_SIZE)
+    {
+        close(fileFd);
+        return true;
+    }
+
+    std::string contents;
+    const bool readOk = ReadWholeFile(fileFd, static_cast<size_t>(fileStat.st_size), contents);
+    close(fileFd);
+    if (!readOk)
+    {
+        return false;
+    }
+
+    auto compressed = std::make_shared<CompressedBody>();
+    if (GzipCompress(contents, compressed->data) && compressed->data.size() < contents.size())
+    {
+        compressed->validators = MakeFileValidators(fileStat, "-gzip");
+        body = std::move(compressed);
+    }
+    return true;
+}
+
+bool GzipCompress(const std::string& input, std::string& output)
+{
+    z_stream stream{};
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return false;
+    }
+
+    output.resize(deflateBound(&stream, input.size()));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    stream.avail_in = static_cast<uInt>(input.size());
+    stream.next_out = reinterpret_cast<Bytef*>(output.data());
+    stream.avail_out = static_cast<uInt>(output.size());
+
+    const int result = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+void InvalidateCompressedVariant(CompressedVariantCache& variants, const std::string_view filename)
+{
+    std::lock_guard lock(variants.mutex);
+    ++variants.generation;
+    variants.attempted.erase(std::string(filename));
+    variants.unavailable.erase(std::string(filename));
+    if (const auto it = variants.entries.find(filename); it != variants.entries.end())
+    {
+        variants.usedBytes -= it->second.body->data.size();
+        variants.lru.erase(it->second.lruPosition);
+        variants.entries.erase(it);
+    }
+}
+
+void ClearCompressedVariants(CompressedVariantCache& variants)
+{
+    std::lock_guard lock(variants.mutex);
+    ++variants.generation;
+    variants.attempted.clear();
+    variants.unavailable.clear();
+    variants.entries.clear();
+    variants.lru.clear();
+    variants.usedBytes = 0;
+}
+
+void RegisterWorkerMetrics(MetricsRegistry& registry, const WorkerMetrics& metrics)
+{
+    std::lock_guard lock(registry.mutex);
+    registry.workers.push_back(&metrics);
+}
+
+void AddToCounter(std::atomic<uint64_t>& counter, const uint64_t delta)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+void ObserveLatency(LatencyHistogram& histogram, const std::chrono::steady_clock::duration elapsed)
+{
+    const auto nanoseconds = static_cast<uint64_t>(std::max<int64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), 0));
+    const auto bound = std::lower_bound(std::begin(LATENCY_BUCKET_BOUNDS_US), std::end(LATENCY_BUCKET_BOUNDS_US),
+                                        (nanoseconds + 999) / 1000);
+    AddToCounter(histogram.buckets[bound - std::begin(LATENCY_BUCKET_BOUNDS_US)], 1);
+    AddToCounter(histogram.sumNanoseconds, nanoseconds);
+}
+
+std::string RenderMetrics(MetricsRegistry& registry)
+{
+    std::vector<const WorkerMetrics*> workers;
+    {
+        std::lock_guard lock(registry.mutex);
+        workers = registry.workers;
+    }
+
+    const auto total = [&workers](const auto& counter) {
+        uint64_t sum = 0;
+        for (const WorkerMetrics* metrics : workers)
+        {
+            sum += std::invoke(counter, *metrics).load(std::memory_order_relaxed);
+        }
+        return sum;
+    };
+
+    std::string out;
+    out += "# HELP webserver_responses_total Completed HTTP responses by status code.\n"
+           "# TYPE webserver_responses_total counter\n";
+    for (int statusCode = 0; statusCode < MAX_STATUS_CODE; ++statusCode)
+    {
+        if (const uint64_t count = total([statusCode](const WorkerMetrics& metrics) -> const auto& {
+                return metrics.responsesByStatus[statusCode];
+            });
+            count > 0)
+        {
+            AppendMetricValue(out, "webserver_responses_total", "code=\"" + std::to_string(statusCode) + "\"", count);
+        }
+    }
+
+    out += "# HELP webserver_sent_bytes_total Bytes written to client sockets.\n"
+           "# TYPE webserver_sent_bytes_total counter\n";
+    AppendMetricValue(out, "webserver_sent_bytes_total", {}, total(&WorkerMetrics::bytesSent));
+
+    const uint64_t accepted = total(&WorkerMetrics::connectionsAccepted);
+    const uint64_t closed = total(&WorkerMetrics::connectionsClosed);
+    out += "# HELP webserver_connections_total Accepted client connections.\n"
+           "# TYPE webserver_connections_total counter\n";
+    AppendMetricValue(out, "webserver_connections_total", {}, accepted);
+    out += "# HELP webserver_open_connections Client connections currently open.\n"
+           "# TYPE webserver_open_connections gauge\n";
+    AppendMetricValue(out, "webserver_open_connections", {}, accepted > closed ? accepted - closed : 0);
+    out += "# HELP webserver_access_log_dropped_total Access log records dropped because a ring was full.\n"
+           "# TYPE webserver_access_log_dropped_total counter\n";
+    AppendMetricValue(out, "webserver_access_log_dropped_total", {}, total(&WorkerMetrics::accessLogDropped));
+
+    AppendLatencyMetric(out, workers, &WorkerMetrics::parseLatency, "webserver_parse_duration_seconds",
+                        "Time spent parsing a request head.");
+    AppendLatencyMetric(out, workers, &WorkerMetrics::fileOpenLatency, "webserver_file_open_duration_seconds",
+                        "Time spent opening and stating a file from the document root.");
+    AppendLatencyMetric(out, workers, &WorkerMetrics::sendLatency, "webserver_send_duration_seconds",
+                        "Time from queueing a response to writing its last byte.");
+    return out;
+}
+
+void AppendMetricValue(std::string& out, const std::string_view name, const std::string_view labels,
+                       const uint64_t value)
+{
+    char digits[24];
+    const auto [end, error] = std::to_chars(digits, digits + sizeof(digits), value);
+    out += name;
+    if (!labels.empty())
+    {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out.append(digits, end);
+    out += '\n';
+}
+
+void AppendLatencyMetric(std::string& out, const std::span<const WorkerMetrics* const> workers,
+                         LatencyHistogram WorkerMetrics::*histogram, const std::string_view name,
+                         const std::string_view help)
+{
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += " histogram\n";
+
+    const std::string bucketName = std::string(name) + "_bucket";
+    uint64_t cumulative = 0;
+    uint64_t sumNanoseconds = 0;
+    for (size_t i = 0; i <= std::size(LATENCY_BUCKET_BOUNDS_US); ++i)
+    {
+        for (const WorkerMetrics* metrics : workers)
+        {
+            cumulative += (metrics->*histogram).buckets[i].load(std::memory_order_relaxed);
+        }
+
+        char bound[32] = "+Inf";
+        char* boundEnd = bound + 4;
+        if (i < std::size(LATENCY_BUCKET_BOUNDS_US))
+        {
+            boundEnd = std::to_chars(bound, bound + sizeof(bound),
+                                     static_cast<double>(LATENCY_BUCKET_BOUNDS_US[i]) / 1e6,
+                                     std::chars_format::fixed)
+                           .ptr;
+        }
+        AppendMetricValue(out, bucketName, "le=\"" + std::string(bound, boundEnd) + "\"", cumulative);
+    }
+    for (const WorkerMetrics* metrics : workers)
+    {
+        sumNanoseconds += (metrics->*histogram).sumNanoseconds.load(std::memory_order_relaxed);
+    }
+
+    char sum[32];
+    const auto [sumEnd, error] = std::to_chars(sum, sum + sizeof(sum), static_cast<double>(sumNanoseconds) / 1e9,
+                                               std::chars_format::fixed, 9);
+    out += name;
+    out += "_sum ";
+    out.append(sum, sumEnd);
+    out += '\n';
+    AppendMetricValue(out, std::string(name) + "_count", {}, cumulative);
+}
+
+bool OpenAccessLog(AccessLog& log)
+{
+    log.fd = open(log.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat fileStat{};
+    if (log.fd < 0 || fstat(log.fd, &fileStat) < 0)
+    {
+        std::cerr << "Failed to open access log " << log.path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    log.fileBytes = static_cast<size_t>(fileStat.st_size);
+    return true;
+}
+
+AccessLogRing* CreateAccessLogRing(AccessLog& log)
+{
+    std::lock_guard lock(log.mutex);
+    return log.rings.emplace_back(std::make_unique<AccessLogRing>()).get();
+}
+
+void LogAccess(AccessLogRing& ring, const Connection& connection, const HttpRequest& request,
+               const PendingResponse& response)
+{
+    const size_t tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail - ring.head.load(std::memory_order_acquire) == ACCESS_LOG_RING_CAPACITY)
+    {
+        AddToCounter(g_workerMetrics.accessLogDropped, 1);
+        return;
+    }
+
+    AccessLogRecord& record = ring.records[tail % ACCESS_LOG_RING_CAPACITY];
+    record.time = time(nullptr);
+    record.clientAddress = connection.clientAddress;
+    record.statusCode = response.statusCode;
+    record.contentLength = response.contentLength;
+    const char* requestLineEnd = request.version.data() + request.version.size();
+    CopyLogField(record.requestLine, std::string_view(request.method.data(), requestLineEnd));
+    CopyLogField(record.referer, FindHeaderValue(request, "Referer"));
+    CopyLogField(record.userAgent, FindHeaderValue(request, "User-Agent"));
+    ring.tail.store(tail + 1, std::memory_order_release);
+}
+
+template <size_t Capacity>
+void CopyLogField(LogField<Capacity>& field, const std::string_view text)
+{
+    field.length = static_cast<uint16_t>(std::min(text.size(), Capacity));
+    std::memcpy(field.text.data(), text.data(), field.length);
+}
+
+void RunAccessLogWriter(AccessLog& log)
+{
+    std::string batch;
+    batch.reserve(ACCESS_LOG_BATCH_SIZE * 2);
+    std::vector<AccessLogRing*> rings;
+    while (true)
+    {
+        {
+            std::lock_guard lock(log.mutex);
+            rings.clear();
+            for (const auto& ring : log.rings)
+            {
+                rings.push_back(ring.get());
+            }
+        }
+
+        for (AccessLogRing* ring : rings)
+        {
+            const size_t tail = ring->tail.load(std::memory_order_acquire);
+            for (size_t head = ring->head.load(std::memory_order_relaxed); head != tail; ++head)
+            {
+                FormatAccessLogRecord(ring->records[head % ACCESS_LOG_RING_CAPACITY], log.combinedFormat, batch);
+                ring->head.store(head + 1, std::memory_order_release);
+                if (batch.size() >= ACCESS_LOG_BATCH_SIZE)
+                {
+                    WriteAccessLogBatch(log, batch);
+                    batch.clear();
+                }
+            }
+        }
+
+        if (batch.empty())
+        {
+            std::this_thread::sleep_for(ACCESS_LOG_FLUSH_INTERVAL);
+            continue;
+        }
+        WriteAccessLogBatch(log, batch);
+        batch.clear();
+    }
+}
+
+void FormatAccessLogRecord(const AccessLogRecord& record, const bool combinedFormat, std::string& out)
+{
+    static constexpr const char* MONTH_NAMES[] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+    thread_local time_t cachedSecond = -1;
+    thread_local char cachedTime[64];
+    if (record.time != cachedSecond)
+    {
+        tm parts{};
+        gmtime_r(&record.time, &parts);
+        snprintf(cachedTime, sizeof(cachedTime), "[%02d/%s/%04d:%02d:%02d:%02d +0000]", parts.tm_mday,
+                 MONTH_NAMES[parts.tm_mon], parts.tm_year + 1900, parts.tm_hour, parts.tm_min, parts.tm_sec);
+        cachedSecond = record.time;
+    }
+
+    char clientIp[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &record.clientAddress, clientIp, sizeof(clientIp));
+    char number[24];
+
+    out += clientIp;
+    out += " - - ";
+    out += cachedTime;
+    out += " \"";
+    AppendEscapedLogText(out, std::string_view(record.requestLine.text.data(), record.requestLine.length));
+    out += "\" ";
+    out.append(number, std::to_chars(number, number + sizeof(number), record.statusCode).ptr);
+    out += ' ';
+    if (record.contentLength == 0)
+    {
+        out += '-';
+    }
+    else
+    {
+        out.append(number, std::to_chars(number, number + sizeof(number), record.contentLength).ptr);
+    }
+
+    if (combinedFormat)
+    {
+        for (const auto* field : {&record.referer, &record.userAgent})
+        {
+            out += " \"";
+            AppendEscapedLogText(out, field->length > 0 ? std::string_view(field->text.data(), field->length) : "-");
+            out += '"';
+        }
+    }
+    out += '\n';
+}
+
+void AppendEscapedLogText(std::string& out, const std::string_view text)
+{
+    static constexpr char HEX_DIGITS[] = "0123456789ABCDEF";
+    for (const char c : text)
+    {
+        const auto byte = static_cast<unsigned char>(c);
+        if (byte < 0x20 || byte >= 0x7f || c == '"' || c == '\\')
+        {
+            out += "\\x";
+            out += HEX_DIGITS[byte >> 4];
+            out += HEX_DIGITS[byte & 0xf];
+            continue;
+        }
+        out += c;
+    }
+}
+
+void WriteAccessLogBatch(AccessLog& log, const std::string& batch)
+{
+    if (log.fileBytes > 0 && log.fileBytes + batch.size() > log.maxBytes)
+    {
+        RotateAccessLog(log);
+    }
+
+    size_t offset = 0;
+    while (offset < batch.size())
+    {
+        const ssize_t bytesWritten = write(log.fd, batch.data() + offset, batch.size() - offset);
+        if (bytesWritten < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            std::cerr << "Access log write failed: " << strerror(errno) << "\n";
+            return;
+        }
+        offset += static_cast<size_t>(bytesWritten);
+    }
+    log.fileBytes += batch.size();
+}
+
+void RotateAccessLog(AccessLog& log)
+{
+    close(log.fd);
+    for (int i = ACCESS_LOG_ROTATED_FILES - 1; i > 0; --i)
+    {
+        const std::string from = log.path + "." + std::to_string(i);
+        rename(from.c_str(), (log.path + "." + std::to_string(i + 1)).c_str());
+    }
+    rename(log.path.c_str(), (log.path + ".1").c_str());
+    OpenAccessLog(log);
+}
+
+void PackSiteBundle(const std::string& outputPath)
+{
+    std::vector<std::string> paths;
+    std::error_code error;
+    for (auto it = std::filesystem::recursive_directory_iterator(DEFAULT_DOCUMENT_ROOT, error);
+         !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error))
+    {
+        // Symlinks may point outside the document root, which the server itself never serves.
+        if (!it->is_symlink() && it->is_regular_file())
+        {
+            paths.push_back(std::filesystem::relative(it->path(), DEFAULT_DOCUMENT_ROOT).generic_string());
+        }
+    }
+    if (error)
+    {
+        std::cerr << "Failed to scan " << DEFAULT_DOCUMENT_ROOT << ": " << error.message() << "\n";
+        exit(EXIT_FAILURE);
+    }
+    std::sort(paths.begin(), paths.end());
+
+    std::vector<BundleEntry> entries;
+    std::string blob;
+    size_t compressedCount = 0;
+    for (const std::string& path : paths)
+    {
+        const std::string filePath = std::string(DEFAULT_DOCUMENT_ROOT) + "/" + path;
+        const int fileFd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        struct stat fileStat{};
+        std::string contents;
+        if (fileFd < 0 || fstat(fileFd, &fileStat) < 0
+            || !ReadWholeFile(fileFd, static_cast<size_t>(fileStat.st_size), contents))
+        {
+            std::cerr << "Failed to read " << filePath << ": " << strerror(errno) << "\n";
+            exit(EXIT_FAILURE);
+        }
+        close(fileFd);
+
+        const std::string_view contentType = DetermineContentType(path);
+        const bool compressible = IsCompressibleType(contentType);
+        BundleEntry& entry = entries.emplace_back();
+        entry.path = AppendBundleText(blob, path);
+        entry.modifiedTime = fileStat.st_mtime;
+        entry.identity = AppendBundleVariant(blob, contentType, contents, MakeFileValidators(fileStat, ""),
+                                             compressible ? "Vary: Accept-Encoding\r\n" : "");
+
+        if (std::string compressed;
+            compressible && GzipCompress(contents, compressed) && compressed.size() < contents.size())
+        {
+            entry.gzip = AppendBundleVariant(blob, contentType, compressed, MakeFileValidators(fileStat, "-gzip"),
+                                             "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+            ++compressedCount;
+        }
+    }
+
+    BundleHeader header;
+    std::memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.entryCount = static_cast<uint32_t>(entries.size());
+    const size_t blobOffset = sizeof(header) + entries.size() * sizeof(BundleEntry);
+    for (BundleEntry& entry : entries)
+    {
+        for (BundleSpan* span : {&entry.path, &entry.identity.headers, &entry.identity.notModifiedHeaders,
+                                 &entry.identity.etag, &entry.identity.body, &entry.gzip.headers,
+                                 &entry.gzip.notModifiedHeaders, &entry.gzip.etag, &entry.gzip.body})
+        {
+            span->offset += blobOffset;
+        }
+    }
+
+    std::string bundle(reinterpret_cast<const char*>(&header), sizeof(header));
+    bundle.append(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(BundleEntry));
+    bundle += blob;
+
+    const std::string temporaryPath = outputPath + ".tmp";
+    const int bundleFd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (bundleFd < 0 || write(bundleFd, bundle.data(), bundle.size()) != static_cast<ssize_t>(bundle.size())
+        || close(bundleFd) < 0 || rename(temporaryPath.c_str(), outputPath.c_str()) < 0)
+    {
+        std::cerr << "Failed to write bundle " << outputPath << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    std::cout << "Packed " << entries.size() << " files (" << compressedCount << " with gzip variants, "
+              << bundle.size() << " bytes) into " << outputPath << "\n";
+}
+
+BundleSpan AppendBundleText(std::string& blob, const std::string_view text)
+{
+    const BundleSpan span{blob.size(), text.size()};
+    blob += text;
+    return span;
+}
+
+BundleVariant AppendBundleVariant(std::string& blob, const std::string_view contentType, const std::string& body,
+                                  const FileValidators& validators, const std::string& extraHeaders)
+{
+    const std::string notModifiedHeaders = ValidatorHeaders(validators) + extraHeaders;
+    std::string headers;
+    AppendFieldLines(headers, 200, contentType, body.size(), notModifiedHeaders);
+
+    BundleVariant variant;
+    variant.headers = AppendBundleText(blob, headers);
+    variant.notModifiedHeaders = AppendBundleText(blob, notModifiedHeaders);
+    variant.etag = AppendBundleText(blob, validators.etag);
+    variant.body = AppendBundleText(blob, body);
+    return variant;
+}
+
+void MapSiteBundle(const std::string& path, SiteBundle& bundle)
+{
+    const int bundleFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat bundleStat{};
+    if (bundleFd < 0 || fstat(bundleFd, &bundleStat) < 0)
+    {
+        std::cerr << "Failed to open bundle " << path << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    bundle.size = static_cast<size_t>(bundleStat.st_size);
+    void* mapping = bundle.size > 0 ? mmap(nullptr, bundle.size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, bundleFd, 0)
+                                    : MAP_FAILED;
+    close(bundleFd);
+    if (mapping == MAP_FAILED)
+    {
+        std::cerr << "Failed to map bundle " << path << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    bundle.data = static_cast<const char*>(mapping);
+
+    BundleHeader header;
+    std::memcpy(&header, bundle.data, std::min(sizeof(header), bundle.size));
+    const bool headerValid = bundle.size >= sizeof(header) && std::memcmp(header.magic, BUNDLE_MAGIC, 8) == 0
+                             && header.version == BUNDLE_VERSION
+                             && header.entryCount <= (bundle.size - sizeof(header)) / sizeof(BundleEntry);
+    if (headerValid)
+    {
+        bundle.entries = {reinterpret_cast<const BundleEntry*>(bundle.data + sizeof(header)), header.entryCount};
+    }
+    const auto isEntryValid = [&bundle](const BundleEntry& entry) {
+        return entry.path.length > 0 && IsBundleVariantValid(bundle, {entry.path, {}, {}, {}})
+               && IsBundleVariantValid(bundle, entry.identity) && IsBundleVariantValid(bundle, entry.gzip);
+    };
+    if (!headerValid || !std::all_of(bundle.entries.begin(), bundle.entries.end(), isEntryValid))
+    {
+        std::cerr << "Bundle " << path << " is corrupt or was built by another version\n";
+        exit(EXIT_FAILURE);
+    }
+}
+
+bool IsBundleVariantValid(const SiteBundle& bundle, const BundleVariant& variant)
+{
+    for (const BundleSpan& span : {variant.headers, variant.notModifiedHeaders, variant.etag, variant.body})
+    {
+        if (span.offset > bundle.size || span.length > bundle.size - span.offset)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string_view BundleText(const SiteBundle& bundle, const BundleSpan span)
+{
+    return {bundle.data + span.offset, span.length};
+}
+
+const BundleEntry* FindBundleEntry(const SiteBundle& bundle, const std::string_view filename)
+{
+    const auto it = std::lower_bound(bundle.entries.begin(), bundle.entries.end(), filename,
+                                     [&bundle](const BundleEntry& entry, const std::string_view key) {
+                                         return BundleText(bundle, entry.path) < key;
+                                     });
+    return it != bundle.entries.end() && BundleText(bundle, it->path) == filename ? &*it : nullptr;
+}
+
+void SendBundleResponse(Connection& connection, const HttpRequest& request, const std::string_view filename)
+{
+    const BundleEntry* entry = FindBundleEntry(g_siteBundle, filename);
+    if (!entry)
+    {
+        QueueTextResponse(connection, 404, "File Not Found");
+        return;
+    }
+
+    const bool sendGzip = entry->gzip.body.length > 0
+                          && AcceptsEncoding(FindHeaderValue(request, "Accept-Encoding"), "gzip");
+    const BundleVariant& variant = sendGzip ? entry->gzip : entry->identity;
+    if (IsNotModified(request, BundleText(g_siteBundle, variant.etag), entry->modifiedTime))
+    {
+        QueueNotModified(connection, BundleText(g_siteBundle, variant.notModifiedHeaders));
+        return;
+    }
+
+    const size_t headerOffset = connection.headerBuffer.size();
+    AppendStatusLine(connection.headerBuffer, 200);
+    connection.headerBuffer += BundleText(g_siteBundle, variant.headers);
+    AppendConnectionHeaders(connection.headerBuffer, connection.keepAlive);
+
+    PendingResponse& response = connection.responses.emplace_back();
+    response.headerOffset = headerOffset;
+    response.headerLength = connection.headerBuffer.size() - headerOffset;
+    response.mappedBody = BundleText(g_siteBundle, variant.body);
+    response.statusCode = 200;
+    response.contentLength = variant.body.length;
+    response.queuedAt = std::chrono::steady_clock::now();
+}
+
+std::string_view ResponseBody(const PendingResponse& response)
+{
+    if (!response.mappedBody.empty() || !response.body)
+    {
+        return response.mappedBody;
+    }
+    return *response.body;
+}
+
+
+void StartHttp2Session(Connection& connection)
+{
+    connection.http2 = std::make_unique<Http2Session>();
+    int enable = 1;
+    setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    std::string settings = {0, static_cast<char>(HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS)};
+    AppendUint32(settings, HTTP2_MAX_CONCURRENT_STREAMS);
+    QueueHttp2Frame(connection, Http2FrameType::Settings, 0, 0, settings);
+}
+
+bool IsHttp2UpgradeRequest(const HttpRequest& request)
+{
+    const std::string_view connectionHeader = FindHeaderValue(request, "Connection");
+    return HasHeaderToken(FindHeaderValue(request, "Upgrade"), "h2c") && HasHeaderToken(connectionHeader, "Upgrade")
+           && HasHeaderToken(connectionHeader, "HTTP2-Settings") && FindHeaderValue(request, "Content-Length").empty()
+           && FindHeaderValue(request, "Transfer-Encoding").empty();
+}
+
+bool UpgradeToHttp2(Connection& connection, const HttpRequest& request)
+{
+    std::string settings;
+    if (!DecodeBase64Url(FindHeaderValue(request, "HTTP2-Settings"), settings) || settings.size() % 6 != 0)
+    {
+        return false;
+    }
+
+    std::string requestText;
+    requestText.append(request.method).append(" ").append(request.target).append(" HTTP/1.1\r\n");
+    for (size_t i = 0; i < request.headerCount; ++i)
+    {
+        if (!IsConnectionSpecificHeader(request.headers[i].name))
+        {
+            requestText.append(request.headers[i].name).append(": ").append(request.headers[i].value).append("\r\n");
+        }
+    }
+    requestText += "\r\n";
+    connection.request.erase(0, request.length);
+    connection.parser = RequestParser{};
+    connection.keepAlive = true;
+
+    QueueResponse(connection, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    StartHttp2Session(connection);
+    Http2Session& session = *connection.http2;
+    if (const Http2Error error = ApplyHttp2Settings(session, settings); error != Http2Error::NoError)
+    {
+        FailHttp2Connection(connection, session, error);
+        return true;
+    }
+    session.lastStreamId = 1;
+    Http2Stream stream;
+    stream.id = 1;
+    stream.sendWindow = session.peerInitialWindow;
+    StartHttp2Stream(connection, session, std::move(stream), std::move(requestText));
+    return true;
+}
+
+bool IsConnectionSpecificHeader(const std::string_view name)
+{
+    return EqualsIgnoreCase(name, "Connection") || EqualsIgnoreCase(name, "Keep-Alive")
+           || EqualsIgnoreCase(name, "Proxy-Connection") || EqualsIgnoreCase(name, "Transfer-Encoding")
+           || EqualsIgnoreCase(name, "Upgrade") || EqualsIgnoreCase(name, "HTTP2-Settings");
+}
+
+bool DecodeBase64Url(std::string_view text, std::string& out)
+{
+    while (text.ends_with('='))
+    {
+        text.remove_suffix(1);
+    }
+    uint32_t buffer = 0;
+    int bits = 0;
+    for (const char c : text)
+    {
+        uint32_t value;
+        if (c >= 'A' && c <= 'Z')
+        {
+            value = c - 'A';
+        }
+        else if (c >= 'a' && c <= 'z')
+        {
+            value = c - 'a' + 26;
+        }
+        else if (c >= '0' && c <= '9')
+        {
+            value = c - '0' + 52;
+        }
+        else if (c == '-' || c == '+')
+        {
+            value = 62;
+        }
+        else if (c == '_' || c == '/')
+        {
+            value = 63;
+        }
+        else
+        {
+            return false;
+        }
+        buffer = buffer << 6 | value;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            out += static_cast<char>(buffer >> bits);
+        }
+    }
+    return true;
+}
+
+void ProcessHttp2Frames(Connection& connection, Http2Session& session)
+{
+    std::string_view input = connection.request;
+    if (!session.prefaceReceived)
+    {
+        if (input.size() < HTTP2_PREFACE.size() && HTTP2_PREFACE.starts_with(input))
+        {
+            return;
+        }
+        if (!input.starts_with(HTTP2_PREFACE))
+        {
+            FailHttp2Connection(connection, session, Http2Error::ProtocolError);
+            connection.request.clear();
+            return;
+        }
+        input.remove_prefix(HTTP2_PREFACE.size());
+        session.prefaceReceived = true;
+    }
+
+    while (!session.goAwaySent && input.size() >= HTTP2_FRAME_HEADER_SIZE)
+    {
+        const size_t length = ReadUint32(input) >> 8;
+        if (length > HTTP2_DEFAULT_FRAME_SIZE)
+        {
+            FailHttp2Connection(connection, session, Http2Error::FrameSizeError);
+            break;
+        }
+        if (input.size() < HTTP2_FRAME_HEADER_SIZE + length)
+        {
+            break;
+        }
+        const auto type = static_cast<Http2FrameType>(input[3]);
+        const auto flags = static_cast<uint8_t>(input[4]);
+        const uint32_t streamId = ReadUint32(input.substr(5)) & 0x7fffffff;
+        const Http2Error error = HandleHttp2Frame(connection, session, type, flags, streamId,
+                                                  input.substr(HTTP2_FRAME_HEADER_SIZE, length));
+        input.remove_prefix(HTTP2_FRAME_HEADER_SIZE + length);
+        if (error != Http2Error::NoError)
+        {
+            FailHttp2Connection(connection, session, error);
+        }
+    }
+
+    if (session.goAwaySent)
+    {
+        connection.request.clear();
+        return;
+    }
+    connection.request.erase(0, connection.request.size() - input.size());
+    if (session.unacknowledgedData > 0)
+    {
+        std::string increment;
+        AppendUint32(increment, static_cast<uint32_t>(session.unacknowledgedData));
+        QueueHttp2Frame(connection, Http2FrameType::WindowUpdate, 0, 0, increment);
+        session.unacknowledgedData = 0;
+    }
+    ScheduleHttp2Output(connection, session);
+}
+
+Http2Error HandleHttp2Frame(Connection& connection, Http2Session& session, const Http2FrameType type,
+                            const uint8_t flags, const uint32_t streamId, const std::string_view payload)
+{
+    if (session.headerStreamId != 0 && (type != Http2FrameType::Continuation || streamId != session.headerStreamId))
+    {
+        return Http2Error::ProtocolError;
+    }
+
+    switch (type)
+    {
+    case Http2FrameType::Data:
+        if (streamId == 0)
+        {
+            return Http2Error::ProtocolError;
+        }
+        session.unacknowledgedData += payload.size();
+        return Http2Error::NoError;
+    case Http2FrameType::Headers:
+        return HandleHttp2Headers(connection, session, flags, streamId, payload);
+    case Http2FrameType::Continuation:
+        if (session.headerStreamId == 0)
+        {
+            return Http2Error::ProtocolError;
+        }
+        session.headerBlock += payload;
+        if (session.headerBlock.size() > MAX_REQUEST_SIZE)
+        {
+            return Http2Error::EnhanceYourCalm;
+        }
+        return flags & HTTP2_FLAG_END_HEADERS ? CompleteHttp2Headers(connection, session) : Http2Error::NoError;
+    case Http2FrameType::Priority:
+        if (streamId == 0)
+        {
+            return Http2Error::ProtocolError;
+        }
+        if (payload.size() != 5)
+        {
+            ResetHttp2Stream(connection, session, streamId, Http2Error::FrameSizeError);
+        }
+        else if (const auto it = session.streams.find(streamId); it != session.streams.end())
+        {
+            it->second.weight = static_cast<uint8_t>(payload[4]) + 1;
+        }
+        return Http2Error::NoError;
+    case Http2FrameType::RstStream:
+        if (streamId == 0 || streamId > session.lastStreamId)
+        {
+            return Http2Error::ProtocolError;
+        }
+        if (payload.size() != 4)
+        {
+            return Http2Error::FrameSizeError;
+        }
+        if (const auto it = session.streams.find(streamId); it != session.streams.end())
+        {
+            ReleaseHttp2Stream(it->second);
+            session.streams.erase(it);
+        }
+        return Http2Error::NoError;
+    case Http2FrameType::Settings:
+        if (streamId != 0)
+        {
+            return Http2Error::ProtocolError;
+        }
+        if (flags & HTTP2_FLAG_ACK)
+        {
+            return payload.empty() ? Http2Error::NoError : Http2Error::FrameSizeError;
+        }
+        if (const Http2Error error = ApplyHttp2Settings(session, payload); error != Http2Error::NoError)
+        {
+            return error;
+        }
+        QueueHttp2Frame(connection, Http2FrameType::Settings, HTTP2_FLAG_ACK, 0);
+        return Http2Error::NoError;
+    case Http2FrameType::Ping:
+        if (streamId != 0)
+        {
+            return Http2Error::ProtocolError;
+        }
+        if (payload.size() != 8)
+        {
+            return Http2Error::FrameSizeError;
+        }
+        if (!(flags & HTTP2_FLAG_ACK))
+        {
+            QueueHttp2Frame(connection, Http2FrameType::Ping, HTTP2_FLAG_ACK, 0, payload);
+        }
+        return Http2Error::NoError;
+    case Http2FrameType::GoAway:
+        return streamId == 0 ? Http2Error::NoError : Http2Error::ProtocolError;
+    case Http2FrameType::WindowUpdate:
+        return HandleHttp2WindowUpdate(connection, session, streamId, payload);
+    case Http2FrameType::PushPromise:
+        return Http2Error::ProtocolError;
+    }
+    return Http2Error::NoError;
+}
+
+Http2Error HandleHttp2Headers(Connection& connection, Http2Session& session, const uint8_t flags,
+                              const uint32_t streamId, std::string_view payload)
+{
+    if (streamId == 0 || streamId % 2 == 0)
+    {
+        return Http2Error::ProtocolError;
+    }
+    if (flags & HTTP2_FLAG_PADDED)
+    {
+        if (payload.empty() || static_cast<uint8_t>(payload[0]) >= payload.size())
+        {
+            return Http2Error::ProtocolError;
+        }
+        payload = payload.substr(1, payload.size() - 1 - static_cast<uint8_t>(payload[0]));
+    }
+    session.headerWeight = HTTP2_DEFAULT_WEIGHT;
+    if (flags & HTTP2_FLAG_PRIORITY)
+    {
+        if (payload.size() < 5)
+        {
+            return Http2Error::FrameSizeError;
+        }
+        session.headerWeight = static_cast<uint8_t>(payload[4]) + 1;
+        payload.remove_prefix(5);
+    }
+    session.headerStreamId = streamId;
+    session.headerBlock.assign(payload);
+    return flags & HTTP2_FLAG_END_HEADERS ? CompleteHttp2Headers(connection, session) : Http2Error::NoError;
+}
+
+Http2Error CompleteHttp2Headers(Connection& connection, Http2Session& session)
+{
+    const uint32_t streamId = session.headerStreamId;
+    session.headerStreamId = 0;
+    std::vector<HpackEntry> fields;
+    size_t listSize = 0;
+    if (!DecodeHpackBlock(session.decoder, session.headerBlock, fields, listSize))
+    {
+        return Http2Error::CompressionError;
+    }
+    if (streamId <= session.lastStreamId)
+    {
+        return Http2Error::NoError;
+    }
+    session.lastStreamId = streamId;
+
+    std::string requestText;
+    if (listSize > MAX_REQUEST_SIZE || session.streams.size() >= HTTP2_MAX_CONCURRENT_STREAMS)
+    {
+        ResetHttp2Stream(connection, session, streamId, Http2Error::RefusedStream);
+        return Http2Error::NoError;
+    }
+    if (!BuildHttp2Request(fields, requestText))
+    {
+        ResetHttp2Stream(connection, session, streamId, Http2Error::ProtocolError);
+        return Http2Error::NoError;
+    }
+
+    Http2Stream stream;
+    stream.id = streamId;
+    stream.weight = session.headerWeight;
+    stream.sendWindow = session.peerInitialWindow;
+    StartHttp2Stream(connection, session, std::move(stream), std::move(requestText));
+    return Http2Error::NoError;
+}
+
+Http2Error HandleHttp2WindowUpdate(Connection& connection, Http2Session& session, const uint32_t streamId,
+                                   const std::string_view payload)
+{
+    if (payload.size() != 4)
+    {
+        return Http2Error::FrameSizeError;
+    }
+    const uint32_t increment = ReadUint32(payload) & 0x7fffffff;
+    if (streamId == 0)
+    {
+        if (increment == 0)
+        {
+            return Http2Error::ProtocolError;
+        }
+        session.sendWindow += increment;
+        return session.sendWindow > HTTP2_MAX_WINDOW_SIZE ? Http2Error::FlowControlError : Http2Error::NoError;
+    }
+
+    const auto it = session.streams.find(streamId);
+    if (it == session.streams.end())
+    {
+        return Http2Error::NoError;
+    }
+    it->second.sendWindow += increment;
+    if (increment == 0 || it->second.sendWindow > HTTP2_MAX_WINDOW_SIZE)
+    {
+        ResetHttp2Stream(connection, session, streamId,
+                         increment == 0 ? Http2Error::ProtocolError : Http2Error::FlowControlError);
+    }
+    return Http2Error::NoError;
+}
+
+Http2Error ApplyHttp2Settings(Http2Session& session, std::string_view payload)
+{
+    if (payload.size() % 6 != 0)
+    {
+        return Http2Error::FrameSizeError;
+    }
+    for (; !payload.empty(); payload.remove_prefix(6))
+    {
+        const auto identifier = static_cast<uint16_t>(static_cast<uint8_t>(payload[0]) << 8
+                                                      | static_cast<uint8_t>(payload[1]));
+        const uint32_t value = ReadUint32(payload.substr(2));
+        if (identifier == HTTP2_SETTINGS_HEADER_TABLE_SIZE)
+        {
+            const size_t tableSize = std::min<size_t>(value, HPACK_DEFAULT_TABLE_SIZE);
+            session.encoderSizeChanged = session.encoderSizeChanged || tableSize != session.encoder.maxSize;
+            ResizeHpackTable(session.encoder, tableSize);
+        }
+        else if (identifier == HTTP2_SETTINGS_ENABLE_PUSH && value > 1)
+        {
+            return Http2Error::ProtocolError;
+        }
+        else if (identifier == HTTP2_SETTINGS_INITIAL_WINDOW_SIZE)
+        {
+            if (value > HTTP2_MAX_WINDOW_SIZE)
+            {
+                return Http2Error::FlowControlError;
+            }
+            for (auto& [id, stream] : session.streams)
+            {
+                stream.sendWindow += value - session.peerInitialWindow;
+                if (stream.sendWindow > HTTP2_MAX_WINDOW_SIZE)
+                {
+                    return Http2Error::FlowControlError;
+                }
+            }
+            session.peerInitialWindow = value;
+        }
+        else if (identifier == HTTP2_SETTINGS_MAX_FRAME_SIZE)
+        {
+            if (value < HTTP2_DEFAULT_FRAME_SIZE || value > HTTP2_MAX_FRAME_SIZE)
+            {
+                return Http2Error::ProtocolError;
+            }
+            session.peerMaxFrameSize = value;
+        }
+    }
+    return Http2Error::NoError;
+}
 
-std::string ExtractRequestedFile(const std::string& request);
+bool BuildHttp2Request(const std::span<const HpackEntry> fields, std::string& requestText)
+{
+    const auto isForbidden = [](const char c) { return c == '\r' || c == '\n' || c == '\0'; };
+    std::string_view method;
+    std::string_view path;
+    std::string_view authority;
+    std::string headerLines;
+    bool hasHost = false;
+    for (const HpackEntry& field : fields)
+    {
+        if (field.name.empty() || std::ranges::any_of(field.name, isForbidden)
+            || std::ranges::any_of(field.value, isForbidden)
+            || std::ranges::any_of(field.name, [](const char c) { return c >= 'A' && c <= 'Z'; }))
+        {
+            return false;
+        }
+        if (field.name[0] == ':')
+        {
+            if (!headerLines.empty())
+            {
+                return false;
+            }
+            if (field.name == ":method")
+            {
+                method = field.value;
+            }
+            else if (field.name == ":path")
+            {
+                path = field.value;
+            }
+            else if (field.name == ":authority")
+            {
+                authority = field.value;
+            }
+            else if (field.name != ":scheme")
+            {
+                return false;
+            }
+            continue;
+        }
+        if (field.name == "te" ? field.value != "trailers" : IsConnectionSpecificHeader(field.name))
+        {
+            return false;
+        }
+        hasHost = hasHost || field.name == "host";
+        headerLines.append(field.name).append(": ").append(field.value).append("\r\n");
+    }
+    if (method.empty() || path.empty())
+    {
+        return false;
+    }
 
-std::string DetermineContentType(const std::string& filename);
+    requestText.append(method).append(" ").append(path).append(" HTTP/1.1\r\n");
+    if (!hasHost && !authority.empty())
+    {
+        requestText.append("host: ").append(authority).append("\r\n");
+    }
+    requestText.append(headerLines).append("\r\n");
+    return true;
+}
 
-std::string BuildHttpResponse(int statusCode, const std::string& contentType, const std::string& body);
+void StartHttp2Stream(Connection& connection, Http2Session& session, Http2Stream stream, std::string requestText)
+{
+    Connection exchange;
+    exchange.clientAddress = connection.clientAddress;
+    exchange.request = std::move(requestText);
+    ProcessRequests(exchange);
+    if (exchange.responses.empty())
+    {
+        ResetHttp2Stream(connection, session, stream.id, Http2Error::InternalError);
+        return;
+    }
 
-void SendFileResponse(int clientFd, const std::string& filePath);
+    const auto text = std::make_shared<const std::string>(std::move(exchange.headerBuffer));
+    std::string_view fieldLines;
+    for (PendingResponse& response : exchange.responses)
+    {
+        std::string_view bytes = std::string_view(*text).substr(response.headerOffset, response.headerLength);
+        if (stream.statusCode == 0)
+        {
+            const size_t statusEnd = bytes.find("\r\n") + 2;
+            const size_t headersEnd = bytes.find("\r\n\r\n", statusEnd - 2) + 2;
+            std::from_chars(bytes.data() + 9, bytes.data() + 12, stream.statusCode);
+            fieldLines = bytes.substr(statusEnd, headersEnd - statusEnd);
+            bytes.remove_prefix(headersEnd + 2);
+            stream.contentLength = response.contentLength;
+            stream.queuedAt = response.queuedAt;
+        }
+        AppendHttp2BodySegment(stream, text, bytes);
+        AppendHttp2BodySegment(stream, response.body, ResponseBody(response));
+        if (response.fileFd >= 0 && response.fileRemaining > 0)
+        {
+            Http2BodySegment& segment = stream.body.emplace_back();
+            segment.fileFd = response.fileFd;
+            segment.ownsFile = response.ownsFile;
+            segment.fileOffset = response.fileOffset;
+            segment.fileRemaining = response.fileRemaining;
+            response.fileFd = -1;
+        }
+        ReleaseResponse(response);
+    }
 
-void HandleClientConnection(int clientFd);
+    QueueHttp2Headers(connection, session, stream, fieldLines, stream.body.empty());
+    if (!stream.body.empty())
+    {
+        session.streams.emplace(stream.id, std::move(stream));
+    }
+}
 
-[[noreturn]] int main()
+void AppendHttp2BodySegment(Http2Stream& stream, std::shared_ptr<const std::string> owner,
+                            const std::string_view bytes)
 {
-    std::cout << "Starting web server on port " << SERVER_PORT << "...\n";
-    std::cout << "Document root: " << DEFAULT_DOCUMENT_ROOT << "\n";
-
-    const int serverSocket = CreateTcpSocket();
-    BindSocket(serverSocket, SERVER_PORT);
-    ListenForConnections(serverSocket);
-
-    std::cout << "Server is listening...\n";
+    if (!bytes.empty())
+    {
+        Http2BodySegment& segment = stream.body.emplace_back();
+        segment.owner = std::move(owner);
+        segment.bytes = bytes;
+    }
+}
 
+void QueueHttp2Headers(Connection& connection, Http2Session& session, const Http2Stream& stream,
+                       const std::string_view fieldLines, const bool endStream)
+{
+    std::string block;
+    EncodeHttp2ResponseHeaders(session, stream.statusCode, fieldLines, block);
+    std::string_view remaining = block;
+    Http2FrameType type = Http2FrameType::Headers;
+    uint8_t flags = endStream ? HTTP2_FLAG_END_STREAM : 0;
     while (true)
     {
-        sockaddr_in clientAddr{};
-        socklen_t clientLen = sizeof(clientAddr);
-        const int clientSocket = accept(serverSocket, reinterpret_cast<struct sockaddr*>(&clientAddr), &clientLen);
+        const std::string_view fragment = remaining.substr(0, session.peerMaxFrameSize);
+        remaining.remove_prefix(fragment.size());
+        PendingResponse& response = QueueHttp2Frame(
+            connection, type, flags | (remaining.empty() ? HTTP2_FLAG_END_HEADERS : 0), stream.id, fragment);
+        if (remaining.empty())
+        {
+            if (endStream)
+            {
+                MarkHttp2StreamComplete(response, stream);
+            }
+            return;
+        }
+        type = Http2FrameType::Continuation;
+        flags = 0;
+    }
+}
 
-        if (clientSocket < 0)
+void EncodeHttp2ResponseHeaders(Http2Session& session, const int statusCode, std::string_view fieldLines,
+                                std::string& block)
+{
+    if (session.encoderSizeChanged)
+    {
+        EncodeHpackInteger(block, 0x20, 5, session.encoder.maxSize);
+        session.encoderSizeChanged = false;
+    }
+    char status[8];
+    const auto [statusEnd, error] = std::to_chars(status, status + sizeof(status), statusCode);
+    EncodeHpackField(session.encoder, block, ":status", std::string_view(status, statusEnd));
+
+    std::string name;
+    while (!fieldLines.empty())
+    {
+        const size_t lineEnd = fieldLines.find("\r\n");
+        const std::string_view line = fieldLines.substr(0, lineEnd);
+        fieldLines.remove_prefix(lineEnd == std::string_view::npos ? fieldLines.size() : lineEnd + 2);
+        const size_t colon = line.find(':');
+        if (colon == std::string_view::npos || IsConnectionSpecificHeader(line.substr(0, colon)))
         {
-            std::cerr << "Accept failed: " << strerror(errno) << "\n";
             continue;
         }
+        name.assign(line.substr(0, colon));
+        std::transform(name.begin(), name.end(), name.begin(), [](const unsigned char c) { return std::tolower(c); });
+        EncodeHpackField(session.encoder, block, name, TrimWhitespace(line.substr(colon + 1)));
+    }
+}
 
-        std::cout << "Connection from " << inet_ntoa(clientAddr.sin_addr) << "\n";
-        HandleClientConnection(clientSocket);
-        close(clientSocket);
+void ScheduleHttp2Output(Connection& connection, Http2Session& session)
+{
+    size_t queued = 0;
+    size_t idleVisits = 0;
+    while (queued < HTTP2_OUTPUT_BUDGET && session.sendWindow > 0 && idleVisits < session.streams.size())
+    {
+        auto it = session.streams.lower_bound(session.nextScheduledStream);
+        if (it == session.streams.end())
+        {
+            it = session.streams.begin();
+        }
+        Http2Stream& stream = it->second;
+        const size_t sent = QueueHttp2Data(connection, session, stream,
+                                           std::min(stream.weight * HTTP2_SCHEDULER_QUANTUM,
+                                                    HTTP2_OUTPUT_BUDGET - queued));
+        queued += sent;
+        idleVisits = sent > 0 ? 0 : idleVisits + 1;
+        session.nextScheduledStream = stream.id + 1;
+        if (stream.body.empty())
+        {
+            session.streams.erase(it);
+        }
     }
 }
 
-int CreateTcpSocket()
+size_t QueueHttp2Data(Connection& connection, Http2Session& session, Http2Stream& stream, const size_t allowance)
 {
-    const int socketFd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socketFd < 0)
+    size_t queued = 0;
+    while (!stream.body.empty() && queued < allowance)
     {
-        std::cerr << "Socket creation failed: " << strerror(errno) << "\n";
-        exit(EXIT_FAILURE);
+        const int64_t window = std::min(session.sendWindow, stream.sendWindow);
+        if (window <= 0)
+        {
+            break;
+        }
+        Http2BodySegment& segment = stream.body.front();
+        const size_t available = segment.fileFd >= 0 ? segment.fileRemaining : segment.bytes.size();
+        const size_t length = std::min({available, allowance - queued, static_cast<size_t>(window),
+                                         static_cast<size_t>(session.peerMaxFrameSize)});
+        const bool endStream = length == available && stream.body.size() == 1;
+
+        PendingResponse& response = QueueResponse(connection, {});
+        AppendHttp2FrameHeader(connection.headerBuffer, length, Http2FrameType::Data,
+                               endStream ? HTTP2_FLAG_END_STREAM : 0, stream.id);
+        response.headerLength = HTTP2_FRAME_HEADER_SIZE;
+        if (segment.fileFd >= 0)
+        {
+            response.fileFd = segment.fileFd;
+            response.ownsFile = segment.ownsFile && length == available;
+            response.fileOffset = segment.fileOffset;
+            response.fileRemaining = length;
+            segment.fileOffset += length;
+            segment.fileRemaining -= length;
+        }
+        else
+        {
+            response.body = segment.owner;
+            response.mappedBody = segment.bytes.substr(0, length);
+            segment.bytes.remove_prefix(length);
+        }
+        if (endStream)
+        {
+            MarkHttp2StreamComplete(response, stream);
+        }
+        if (length == available)
+        {
+            stream.body.pop_front();
+        }
+        session.sendWindow -= length;
+        stream.sendWindow -= length;
+        queued += length;
     }
+    return queued;
+}
 
-    int enable = 1;
-    if (setsockopt(socketFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+void MarkHttp2StreamComplete(PendingResponse& response, const Http2Stream& stream)
+{
+    response.statusCode = stream.statusCode;
+    response.contentLength = stream.contentLength;
+    response.queuedAt = stream.queuedAt;
+}
+
+PendingResponse& QueueHttp2Frame(Connection& connection, const Http2FrameType type, const uint8_t flags,
+                                 const uint32_t streamId, const std::string_view payload)
+{
+    PendingResponse& response = QueueResponse(connection, {});
+    AppendHttp2FrameHeader(connection.headerBuffer, payload.size(), type, flags, streamId);
+    connection.headerBuffer += payload;
+    response.headerLength = HTTP2_FRAME_HEADER_SIZE + payload.size();
+    return response;
+}
+
+void AppendHttp2FrameHeader(std::string& out, const size_t length, const Http2FrameType type, const uint8_t flags,
+                            const uint32_t streamId)
+{
+    out += static_cast<char>(length >> 16);
+    out += static_cast<char>(length >> 8);
+    out += static_cast<char>(length);
+    out += static_cast<char>(type);
+    out += static_cast<char>(flags);
+    AppendUint32(out, streamId);
+}
+
+void AppendUint32(std::string& out, const uint32_t value)
+{
+    out += static_cast<char>(value >> 24);
+    out += static_cast<char>(value >> 16);
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+uint32_t ReadUint32(const std::string_view bytes)
+{
+    return static_cast<uint32_t>(static_cast<uint8_t>(bytes[0])) << 24
+           | static_cast<uint32_t>(static_cast<uint8_t>(bytes[1])) << 16
+           | static_cast<uint32_t>(static_cast<uint8_t>(bytes[2])) << 8 | static_cast<uint8_t>(bytes[3]);
+}
+
+void ResetHttp2Stream(Connection& connection, Http2Session& session, const uint32_t streamId, const Http2Error error)
+{
+    std::string payload;
+    AppendUint32(payload, static_cast<uint32_t>(error));
+    QueueHttp2Frame(connection, Http2FrameType::RstStream, 0, streamId, payload);
+    if (const auto it = session.streams.find(streamId); it != session.streams.end())
     {
-        std::cerr << "setsockopt(SO_REUSEADDR) failed\n";
+        ReleaseHttp2Stream(it->second);
+        session.streams.erase(it);
     }
+}
 
-    return socketFd;
+void FailHttp2Connection(Connection& connection, Http2Session& session, const Http2Error error)
+{
+    std::string payload;
+    AppendUint32(payload, session.lastStreamId);
+    AppendUint32(payload, static_cast<uint32_t>(error));
+    QueueHttp2Frame(connection, Http2FrameType::GoAway, 0, 0, payload);
+    session.goAwaySent = true;
+    connection.keepAlive = false;
 }
 
-void BindSocket(const int socketFd, const int port)
+void SendHttp2GoAway(const Connection& connection)
 {
-    sockaddr_in serverAddr{};
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(port);
+    if (!connection.http2)
+    {
+        return;
+    }
+    std::string frame;
+    AppendHttp2FrameHeader(frame, 8, Http2FrameType::GoAway, 0, 0);
+    AppendUint32(frame, connection.http2->lastStreamId);
+    AppendUint32(frame, static_cast<uint32_t>(Http2Error::NoError));
+    send(connection.fd, frame.data(), frame.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
 
-    if (bind(socketFd, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) < 0)
+void ReleaseHttp2Stream(Http2Stream& stream)
+{
+    for (const Http2BodySegment& segment : stream.body)
     {
-        std::cerr << "Bind failed on port " << port << ": " << strerror(errno) << "\n";
-        close(socketFd);
-        exit(EXIT_FAILURE);
+        if (segment.fileFd >= 0 && segment.ownsFile)
+        {
+            close(segment.fileFd);
+        }
     }
+    stream.body.clear();
 }
 
-void ListenForConnections(const int socketFd)
+void ReleaseHttp2Session(Connection& connection)
 {
-    if (listen(socketFd, BACKLOG_SIZE) < 0)
+    if (!connection.http2)
     {
-        std::cerr << "Listen failed: " << strerror(errno) << "\n";
-        close(socketFd);
-        exit(EXIT_FAILURE);
+        return;
+    }
+    for (auto& [id, stream] : connection.http2->streams)
+    {
+        ReleaseHttp2Stream(stream);
     }
 }
 
-std::string ExtractRequestedFile(const std::string& request)
+bool DecodeHpackBlock(HpackTable& table, std::string_view block, std::vector<HpackEntry>& fields, size_t& listSize)
 {
-    std::istringstream requestStream(request);
-    std::string method, path, version;
-    requestStream >> method >> path >> version;
+    bool fieldSeen = false;
+    while (!block.empty())
+    {
+        const auto first = static_cast<uint8_t>(block[0]);
+        uint64_t index = 0;
+        HpackEntry field;
+        if (first & 0x80)
+        {
+            if (!DecodeHpackInteger(block, 7, index) || !LookupHpackEntry(table, index, field))
+            {
+                return false;
+            }
+        }
+        else if ((first & 0xe0) == 0x20)
+        {
+            if (fieldSeen || !DecodeHpackInteger(block, 5, index) || index > HPACK_DEFAULT_TABLE_SIZE)
+            {
+                return false;
+            }
+            ResizeHpackTable(table, index);
+            continue;
+        }
+        else
+        {
+            const bool incremental = first & 0x40;
+            if (!DecodeHpackInteger(block, incremental ? 6 : 4, index)
+                || (index != 0 ? !LookupHpackEntry(table, index, field) : !DecodeHpackString(block, field.name))
+                || !DecodeHpackString(block, field.value))
+            {
+                return false;
+            }
+            if (incremental)
+            {
+                AddHpackEntry(table, field.name, field.value);
+            }
+        }
+        fieldSeen = true;
+        listSize += field.name.size() + field.value.size() + HPACK_ENTRY_OVERHEAD;
+        if (listSize <= MAX_REQUEST_SIZE)
+        {
+            fields.push_back(std::move(field));
+        }
+    }
+    return true;
+}
 
-    if (method != "GET")
+bool DecodeHpackInteger(std::string_view& input, const int prefixBits, uint64_t& value)
+{
+    if (input.empty())
+    {
+        return false;
+    }
+    const uint64_t limit = (1u << prefixBits) - 1;
+    value = static_cast<uint8_t>(input[0]) & limit;
+    input.remove_prefix(1);
+    if (value < limit)
+    {
+        return true;
+    }
+    for (int shift = 0; shift <= 28 && !input.empty(); shift += 7)
     {
-        return "";
+        const auto byte = static_cast<uint8_t>(input[0]);
+        input.remove_prefix(1);
+        value += static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return true;
+        }
     }
+    return false;
+}
 
-    if (path.empty() || path[0] != '/')
+bool DecodeHpackString(std::string_view& input, std::string& out)
+{
+    if (input.empty())
     {
-        return "index.html";
+        return false;
+    }
+    const bool huffman = static_cast<uint8_t>(input[0]) & 0x80;
+    uint64_t length = 0;
+    if (!DecodeHpackInteger(input, 7, length) || length > input.size())
+    {
+        return false;
+    }
+    const std::string_view text = input.substr(0, length);
+    input.remove_prefix(length);
+    if (!huffman)
+    {
+        out.assign(text);
+        return true;
     }
+    return DecodeHuffman(text, out);
+}
 
-    std::string filename = path.substr(1);
-    if (filename.empty())
+bool DecodeHuffman(const std::string_view input, std::string& out)
+{
+    out.clear();
+    uint32_t code = 0;
+    size_t length = 0;
+    for (const char c : input)
     {
-        filename = "index.html";
+        for (int bit = 7; bit >= 0; --bit)
+        {
+            code = code << 1 | ((static_cast<uint8_t>(c) >> bit) & 1);
+            ++length;
+            if (const uint32_t index = code - HPACK_HUFFMAN_TABLE.firstCode[length];
+                index < HPACK_HUFFMAN_TABLE.count[length])
+            {
+                const uint16_t symbol = HPACK_HUFFMAN_TABLE.symbols[HPACK_HUFFMAN_TABLE.offset[length] + index];
+                if (symbol == HPACK_HUFFMAN_EOS)
+                {
+                    return false;
+                }
+                out += static_cast<char>(symbol);
+                code = 0;
+                length = 0;
+            }
+            else if (length == HPACK_HUFFMAN_MAX_CODE_LENGTH)
+            {
+                return false;
+            }
+        }
     }
+    return length < 8 && code == (1u << length) - 1;
+}
 
-    if (filename.find("..") != std::string::npos)
+bool LookupHpackEntry(const HpackTable& table, const uint64_t index, HpackEntry& entry)
+{
+    if (index == 0)
+    {
+        return false;
+    }
+    if (index <= HPACK_STATIC_TABLE_SIZE)
+    {
+        entry.name = HPACK_STATIC_TABLE[index - 1].name;
+        entry.value = HPACK_STATIC_TABLE[index - 1].value;
+        return true;
+    }
+    if (index - HPACK_STATIC_TABLE_SIZE > table.entries.size())
     {
-        return "";
+        return false;
     }
+    entry = table.entries[index - HPACK_STATIC_TABLE_SIZE - 1];
+    return true;
+}
 
-    return filename;
+void AddHpackEntry(HpackTable& table, const std::string_view name, const std::string_view value)
+{
+    table.entries.push_front(HpackEntry{std::string(name), std::string(value)});
+    table.size += name.size() + value.size() + HPACK_ENTRY_OVERHEAD;
+    ResizeHpackTable(table, table.maxSize);
+}
+
+void ResizeHpackTable(HpackTable& table, const size_t maxSize)
+{
+    table.maxSize = maxSize;
+    while (table.size > table.maxSize)
+    {
+        table.size -= table.entries.back().name.size() + table.entries.back().value.size() + HPACK_ENTRY_OVERHEAD;
+        table.entries.pop_back();
+    }
 }
 
-std::string DetermineContentType(const std::string& filename)
+void EncodeHpackField(HpackTable& table, std::string& out, const std::string_view name, const std::string_view value)
 {
-    if (filename.ends_with(".html") || filename.ends_with(".htm"))
+    size_t nameIndex = 0;
+    for (size_t i = 0; i < HPACK_STATIC_TABLE_SIZE; ++i)
     {
-        return "text/html";
+        if (HPACK_STATIC_TABLE[i].name != name)
+        {
+            continue;
+        }
+        if (HPACK_STATIC_TABLE[i].value == value)
+        {
+            EncodeHpackInteger(out, 0x80, 7, i + 1);
+            return;
+        }
+        nameIndex = nameIndex != 0 ? nameIndex : i + 1;
     }
-    if (filename.ends_with(".css"))
+    for (size_t i = 0; i < table.entries.size(); ++i)
     {
-        return "text/css";
+        if (table.entries[i].name != name)
+        {
+            continue;
+        }
+        if (table.entries[i].value == value)
+        {
+            EncodeHpackInteger(out, 0x80, 7, HPACK_STATIC_TABLE_SIZE + i + 1);
+            return;
+        }
+        nameIndex = nameIndex != 0 ? nameIndex : HPACK_STATIC_TABLE_SIZE + i + 1;
     }
-    if (filename.ends_with(".js"))
+
+    const bool indexed = IsHpackIndexable(name)
+                         && name.size() + value.size() + HPACK_ENTRY_OVERHEAD <= table.maxSize;
+    EncodeHpackInteger(out, indexed ? 0x40 : 0x00, indexed ? 6 : 4, nameIndex);
+    if (nameIndex == 0)
     {
-        return "application/javascript";
+        EncodeHpackString(out, name);
     }
-    if (filename.ends_with(".png"))
+    EncodeHpackString(out, value);
+    if (indexed)
     {
-        return "image/png";
+        AddHpackEntry(table, name, value);
     }
-    if (filename.ends_with(".jpg") || filename.ends_with(".jpeg"))
+}
+
+bool IsHpackIndexable(const std::string_view name)
+{
+    return name != "date" && name != "etag" && name != "last-modified" && name != "content-length"
+           && name != "content-range";
+}
+
+void EncodeHpackInteger(std::string& out, const uint8_t prefix, const int prefixBits, uint64_t value)
+{
+    const uint64_t limit = (1u << prefixBits) - 1;
+    if (value < limit)
     {
-        return "image/jpeg";
+        out += static_cast<char>(prefix | value);
+        return;
     }
-    if (filename.ends_with(".gif"))
+    out += static_cast<char>(prefix | limit);
+    for (value -= limit; value >= 0x80; value >>= 7)
     {
-        return "image/gif";
+        out += static_cast<char>((value & 0x7f) | 0x80);
     }
-    return "application/octet-stream";
+    out += static_cast<char>(value);
+}
+
+void EncodeHpackString(std::string& out, const std::string_view text)
+{
+    EncodeHpackInteger(out, 0x00, 7, text.size());
+    out += text;
 }
 
-std::string BuildHttpResponse(const int statusCode, const std::string& contentType, const std::string& body)
+void RunHandoffListener(HandoffState& handoff, const std::string& path)
 {
-    std::ostringstream response;
-    if (statusCode == 200)
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    const int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0 || path.size() >= sizeof(address.sun_path))
     {
-        response << "HTTP/1.1 200 OK\r\n";
+        std::cerr << "Handoff socket " << path << " is unavailable: " << strerror(errno) << "\n";
+        return;
     }
-    else if (statusCode == 404)
+    path.copy(address.sun_path, path.size());
+    unlink(path.c_str());
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(listenFd, 1) < 0)
     {
-        response << "HTTP/1.1 404 Not Found\r\n";
+        std::cerr << "Handoff socket " << path << " is unavailable: " << strerror(errno) << "\n";
+        close(listenFd);
+        return;
     }
-    else
+
+    int successorFd = -1;
+    while (successorFd < 0)
     {
-        response << "HTTP/1.1 500 Internal Server Error\r\n";
+        successorFd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (successorFd >= 0 && !SendListeningSockets(handoff, successorFd))
+        {
+            std::cerr << "Listening socket handoff failed: " << strerror(errno) << "\n";
+            close(successorFd);
+            successorFd = -1;
+        }
+    }
+    close(listenFd);
+    unlink(path.c_str());
+
+    std::cout << "Listening sockets handed off, draining connections...\n";
+    handoff.draining.store(true, std::memory_order_release);
+    std::unique_lock lock(handoff.mutex);
+    handoff.changed.wait_for(lock, HANDOFF_TIMEOUT,
+                             [&handoff] { return handoff.workersStopped == handoff.workerCount; });
+    const std::vector<std::string> warmPaths = std::move(handoff.warmPaths);
+    lock.unlock();
+    if (!SendWarmPaths(successorFd, warmPaths))
+    {
+        std::cerr << "Sending warm file list failed: " << strerror(errno) << "\n";
     }
-    response << "Content-Type: " << contentType << "\r\n";
-    response << "Content-Length: " << body.length() << "\r\n";
-    response << "Connection: close\r\n\r\n";
-    response << body;
-    return response.str();
+    close(successorFd);
+
+    lock.lock();
+    handoff.changed.wait_for(lock, HANDOFF_DRAIN_TIMEOUT,
+                             [&handoff] { return handoff.workersDrained == handoff.workerCount; });
+    lock.unlock();
+    std::this_thread::sleep_for(ACCESS_LOG_FLUSH_INTERVAL * 2);
+    std::cout << "Connections drained, exiting" << std::endl;
+    std::quick_exit(EXIT_SUCCESS);
 }
 
-void SendFileResponse(int clientFd, const std::string& filePath)
+bool SendListeningSockets(HandoffState& handoff, const int successorFd)
 {
-    std::ifstream file(filePath, std::ios::binary);
-    if (!file.is_open())
+    std::unique_lock lock(handoff.mutex);
+    handoff.changed.wait(lock, [&handoff] {
+        return handoff.listenSockets.size() == static_cast<size_t>(handoff.workerCount);
+    });
+
+    const uint32_t header[2] = {HANDOFF_MAGIC, static_cast<uint32_t>(handoff.listenSockets.size())};
+    if (send(successorFd, header, sizeof(header), MSG_NOSIGNAL) != sizeof(header))
     {
-        std::string notFoundBody = "File Not Found";
-        std::string response = BuildHttpResponse(404, "text/plain", notFoundBody);
-        write(clientFd, response.c_str(), response.length());
-        return;
+        return false;
+    }
+    for (const int socketFd : handoff.listenSockets)
+    {
+        char marker = 'L';
+        iovec iov{&marker, 1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &socketFd, sizeof(int));
+        if (sendmsg(successorFd, &message, MSG_NOSIGNAL) != 1)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SendWarmPaths(const int successorFd, const std::vector<std::string>& paths)
+{
+    std::string list;
+    std::unordered_set<std::string_view> seen;
+    for (const std::string& path : paths)
+    {
+        if (seen.insert(path).second)
+        {
+            list += path;
+            list += '\n';
+        }
     }
 
-    std::ostringstream buffer;
-    buffer << file.rdbuf();
-    std::string content = buffer.str();
-    std::string contentType = DetermineContentType(filePath);
-    std::string httpResponse = BuildHttpResponse(200, contentType, content);
-    write(clientFd, httpResponse.c_str(), httpResponse.length());
-    file.close();
+    size_t offset = 0;
+    while (offset < list.size())
+    {
+        const ssize_t bytesSent = send(successorFd, list.data() + offset, list.size() - offset, MSG_NOSIGNAL);
+        if (bytesSent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesSent <= 0)
+        {
+            return false;
+        }
+        offset += bytesSent;
+    }
+    return true;
 }
 
-void HandleClientConnection(const int clientFd)
+void TakeOverListeningSockets(HandoffState& handoff, const std::string& path)
 {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    const int handoffFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handoffFd < 0 || path.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "Cannot take over from " << path << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+    path.copy(address.sun_path, path.size());
+    const timeval timeout{std::chrono::seconds(HANDOFF_TIMEOUT).count(), 0};
+    setsockopt(handoffFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(handoffFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+    {
+        std::cerr << "Cannot take over from " << path << ": " << strerror(errno) << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t header[2] = {};
+    if (recv(handoffFd, header, sizeof(header), MSG_WAITALL) != sizeof(header) || header[0] != HANDOFF_MAGIC)
+    {
+        std::cerr << "Invalid handoff from " << path << "\n";
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < header[1]; ++i)
+    {
+        char marker = 0;
+        iovec iov{&marker, 1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        const cmsghdr* cmsg = recvmsg(handoffFd, &message, MSG_CMSG_CLOEXEC) == 1 ? CMSG_FIRSTHDR(&message) : nullptr;
+        if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        {
+            std::cerr << "Listening socket handoff from " << path << " failed: " << strerror(errno) << "\n";
+            exit(EXIT_FAILURE);
+        }
+        int socketFd = -1;
+        std::memcpy(&socketFd, CMSG_DATA(cmsg), sizeof(int));
+        handoff.inheritedSockets.push_back(socketFd);
+    }
+
+    std::string list;
     char buffer[BUFFER_SIZE];
-    const ssize_t bytesRead = read(clientFd, buffer, sizeof(buffer) - 1);
-    if (bytesRead == 0)
+    ssize_t bytesRead = 0;
+    while ((bytesRead = recv(handoffFd, buffer, sizeof(buffer), 0)) > 0 || (bytesRead < 0 && errno == EINTR))
     {
-        std::cout << "Client closed connection (no data)\n";
-        return;
+        list.append(buffer, std::max<ssize_t>(bytesRead, 0));
     }
-    if (bytesRead < 0)
+    close(handoffFd);
+
+    for (size_t lineEnd = list.find('\n'), lineStart = 0; lineEnd != std::string::npos;
+         lineStart = lineEnd + 1, lineEnd = list.find('\n', lineStart))
     {
-        std::cerr << "Read error: " << strerror(errno) << "\n";
-        return;
+        handoff.prewarmPaths.emplace_back(list, lineStart, lineEnd - lineStart);
     }
-    buffer[bytesRead] = '\0';
+}
 
-    const std::string request(buffer);
-    const std::string filename = ExtractRequestedFile(request);
+void RegisterListeningSocket(HandoffState& handoff, const int serverSocket)
+{
+    std::lock_guard lock(handoff.mutex);
+    handoff.listenSockets.push_back(serverSocket);
+    handoff.changed.notify_all();
+}
 
-    if (filename.empty())
+void StopAccepting(HandoffState& handoff, const FileCache& cache)
+{
+    std::lock_guard lock(handoff.mutex);
+    for (const std::string& key : cache.lru)
     {
-        const std::string response = BuildHttpResponse(404, "text/plain", "File Not Found");
-        write(clientFd, response.c_str(), response.length());
-        return;
+        if (key.find(VARIANT_KEY_SEPARATOR) == std::string::npos)
+        {
+            handoff.warmPaths.push_back(key);
+        }
     }
+    ++handoff.workersStopped;
+    handoff.changed.notify_all();
+}
+
+void ReportWorkerDrained(HandoffState& handoff)
+{
+    std::lock_guard lock(handoff.mutex);
+    ++handoff.workersDrained;
+    handoff.changed.notify_all();
+}
 
-    const std::string fullPath = std::string(DEFAULT_DOCUMENT_ROOT) + "/" + filename;
-    if (!std::filesystem::exists(fullPath) || std::filesystem::is_directory(fullPath))
+void PrewarmFileCache(const std::vector<std::string>& paths)
+{
+    if (g_siteBundle.data || g_fileCache.inotifyFd < 0)
     {
-        const std::string response = BuildHttpResponse(404, "text/plain", "File Not Found");
-        write(clientFd, response.c_str(), response.length());
         return;
     }
-
-    SendFileResponse(clientFd, fullPath);
+    for (auto it = paths.rbegin(); it != paths.rend(); ++it)
+    {
+        const ResolvedPath* resolved = ResolvePath(g_pathCache, *it);
+        std::string contents;
+        if (!resolved || static_cast<size_t>(resolved->fileStat.st_size) > MAX_CACHED_FILE_SIZE
+            || !ReadWholeFile(resolved->fd, static_cast<size_t>(resolved->fileStat.st_size), contents))
+        {
+            continue;
+        }
+        const std::string_view contentType = DetermineContentType(*it);
+        CacheFileContents(g_fileCache, *it, contentType, std::make_shared<const std::string>(std::move(contents)),
+                          MakeFileValidators(resolved->fileStat, ""), IdentityExtraHeaders(contentType));
+    }
 }